@@ -0,0 +1,2217 @@
+﻿
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
+#include "main.h"
+
+
+//////////////////////////////////////////////////////////////////////
+
+
+Analyzer::Analyzer(SourceModel* source)
+    : m_source(source), m_candidates(), m_excluded(), m_integers(), m_demoted(), m_nonintegerdata(false),
+    m_datarange(0, 0), m_intranges(),
+    m_validator(nullptr), m_linemap(), m_returnpoints(), m_available(), m_csecount(0), m_csetemps(0), m_looptemps(0),
+    m_checksremoved(0), m_checkskept(0), m_invariants()
+{
+    assert(source != nullptr);
+}
+
+void Analyzer::Warning(const SourceLineModel& line, const Token& token, const string& message)
+{
+    std::cerr << "WARNING: at " << token.line << ":" << token.pos;
+    if (line.linenum != 0)
+        std::cerr << " line " << line.linenum;
+    std::cerr << " - " << message << std::endl;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Integer type inference
+
+// Check Single variables, and re-type to Integer all the variables that could hold only integer values.
+// Variable is demoted when all the values assigned to it (LET, FOR, READ) are integer constants,
+// Integer variables or other demoted variables, and the expressions have no '/', '^' or Single functions.
+// The values, and the results of the integer operations on the variable, should stay in Integer range.
+void Analyzer::InferIntegerVariables()
+{
+    // Collect the candidates
+    for (SourceLineModel& line : m_source->lines)
+        ScanStatement(line, line.statement);
+
+    // Integer variable with the same name already exists
+    for (auto it = m_candidates.begin(); it != m_candidates.end(); ++it)
+    {
+        string intname = it->first.substr(0, it->first.length() - 1) + "%";
+        if (m_integers.find(intname) != m_integers.end())
+            m_excluded.insert(it->first);
+    }
+
+    // Remove candidates with non-integer assignments, or with values out of Integer range, until nothing changes
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (SourceLineModel& line : m_source->lines)
+        {
+            if (CheckAssignments(line.statement))
+                changed = true;
+        }
+        if (!changed && CheckIntegerRanges())
+            changed = true;
+    }
+
+    // Re-type the variables; the notes go in the order of the lines, like the other diagnostics
+    std::vector<std::pair<const AnalyzerVariableSpec*, string> > demoted;
+    for (auto it = m_candidates.begin(); it != m_candidates.end(); ++it)
+    {
+        if (m_excluded.find(it->first) == m_excluded.end())
+            demoted.push_back(std::make_pair(&it->second, it->first));
+    }
+    std::stable_sort(demoted.begin(), demoted.end(),
+        [](const std::pair<const AnalyzerVariableSpec*, string>& a, const std::pair<const AnalyzerVariableSpec*, string>& b)
+        {
+            return a.first->token.line < b.first->token.line ||
+                (a.first->token.line == b.first->token.line && a.first->token.pos < b.first->token.pos);
+        });
+    for (const auto& variable : demoted)
+    {
+        string intname = variable.second.substr(0, variable.second.length() - 1) + "%";
+        m_demoted.insert(intname);
+        Warning(*variable.first->pline, variable.first->token,
+                "Variable " + variable.second + " holds only integer values, demoted to " + intname + ".");
+    }
+    for (SourceLineModel& line : m_source->lines)
+        RenameStatement(line.statement);
+}
+
+bool Analyzer::IsCandidate(const string& canoname) const
+{
+    return m_candidates.find(canoname) != m_candidates.end() &&
+        m_excluded.find(canoname) == m_excluded.end();
+}
+
+void Analyzer::RegisterName(const SourceLineModel& line, const Token& token, const string& canoname, bool isarray)
+{
+    char chtype = canoname[canoname.length() - 1];
+    if (chtype == '%')
+    {
+        m_integers.insert(canoname);
+        return;
+    }
+    if (chtype != '!')
+        return;
+
+    if (m_candidates.find(canoname) == m_candidates.end())
+    {
+        AnalyzerVariableSpec spec;
+        spec.pline = &line;
+        spec.token = token;
+        m_candidates[canoname] = spec;
+    }
+
+    // Arrays, and variables with explicit '!' suffix are not demoted
+    if (isarray || token.text.find('!') != string::npos)
+        m_excluded.insert(canoname);
+}
+
+void Analyzer::ScanStatement(const SourceLineModel& line, const StatementModel& statement)
+{
+    KeywordIndex keyword = statement.token.keyword;
+
+    if (statement.ident.type == TokenTypeIdentifier && keyword != KeywordDEF)
+        RegisterName(line, statement.ident, GetCanonicVariableName(statement.ident.text), false);
+    for (const Token& param : statement.params)
+    {
+        if (param.type != TokenTypeIdentifier)
+            continue;
+        string canoname = GetCanonicVariableName(param.text);
+        RegisterName(line, param, canoname, false);
+        if (keyword == KeywordDEF)  // DEF FN parameters
+            m_excluded.insert(canoname);
+    }
+    for (const VariableModel& variable : statement.variables)
+    {
+        RegisterName(line, statement.token, variable.name, !variable.indices.empty() || keyword == KeywordDIM);
+        if (keyword == KeywordINPUT)  // Input could be any number
+            m_excluded.insert(variable.name);
+    }
+    for (const VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        RegisterName(line, statement.token, varexpr.name, !varexpr.args.empty());
+        for (const ExpressionModel& expr : varexpr.args)
+            ScanExpression(line, expr);
+    }
+    for (const ExpressionModel& expr : statement.args)
+        ScanExpression(line, expr);
+
+    if (keyword == KeywordDATA)  // Non-integer number in DATA excludes all READ variables
+    {
+        for (const Token& param : statement.params)
+        {
+            if (param.type != TokenTypeNumber)
+                continue;
+            if (!param.IsDValueInteger() || param.dvalue < -32768 || param.dvalue > 32767)
+                m_nonintegerdata = true;
+            else
+            {
+                m_datarange.first = std::min(m_datarange.first, (int)param.dvalue);
+                m_datarange.second = std::max(m_datarange.second, (int)param.dvalue);
+            }
+        }
+    }
+
+    if (statement.stthen != nullptr)
+        ScanStatement(line, *statement.stthen);
+    if (statement.stelse != nullptr)
+        ScanStatement(line, *statement.stelse);
+}
+
+void Analyzer::ScanExpression(const SourceLineModel& line, const ExpressionModel& expr)
+{
+    for (const ExpressionNode& node : expr.nodes)
+    {
+        if (node.token.type == TokenTypeIdentifier)
+            RegisterName(line, node.token, GetCanonicVariableName(node.token.text), !node.args.empty());
+        for (const ExpressionModel& exprin : node.args)
+            ScanExpression(line, exprin);
+    }
+}
+
+// Returns true if some candidates were excluded
+bool Analyzer::CheckAssignments(const StatementModel& statement)
+{
+    bool changed = false;
+    KeywordIndex keyword = statement.token.keyword;
+
+    if (keyword == KeywordLET && statement.ident.type == TokenTypeIdentifier &&
+        !statement.varexprs.empty() && !statement.args.empty())
+    {
+        const string& canoname = statement.varexprs[0].name;
+        if (IsCandidate(canoname) && !IsIntegerExpression(statement.args[0]))
+        {
+            m_excluded.insert(canoname);
+            changed = true;
+        }
+    }
+    else if (keyword == KeywordFOR && statement.ident.type == TokenTypeIdentifier)
+    {
+        string canoname = GetCanonicVariableName(statement.ident.text);
+        for (const ExpressionModel& expr : statement.args)
+        {
+            if (IsCandidate(canoname) && !IsIntegerExpression(expr))
+            {
+                m_excluded.insert(canoname);
+                changed = true;
+            }
+        }
+    }
+    else if (keyword == KeywordREAD && m_nonintegerdata)
+    {
+        for (const VariableExpressionModel& varexpr : statement.varexprs)
+        {
+            if (IsCandidate(varexpr.name))
+            {
+                m_excluded.insert(varexpr.name);
+                changed = true;
+            }
+        }
+    }
+
+    if (statement.stthen != nullptr && CheckAssignments(*statement.stthen))
+        changed = true;
+    if (statement.stelse != nullptr && CheckAssignments(*statement.stelse))
+        changed = true;
+
+    return changed;
+}
+
+bool Analyzer::IsIntegerExpression(const ExpressionModel& expr) const
+{
+    if (expr.IsEmpty())
+        return false;
+    return IsIntegerNode(expr, expr.nodes[expr.root]);
+}
+
+// Check if the expression sub-tree value is always integer, assuming the candidates are Integer
+bool Analyzer::IsIntegerNode(const ExpressionModel& expr, const ExpressionNode& node) const
+{
+    const Token& token = node.token;
+
+    if (token.type == TokenTypeNumber)
+        return token.IsDValueInteger() && token.dvalue >= -32768 && token.dvalue <= 32767;
+
+    if (token.type == TokenTypeIdentifier)
+    {
+        string canoname = GetCanonicVariableName(token.text);
+        if (!node.args.empty())  // Array element, arrays are not demoted
+            return canoname[canoname.length() - 1] == '%';
+        return canoname[canoname.length() - 1] == '%' || IsCandidate(canoname);
+    }
+
+    if (token.type == TokenTypeKeyword && IsFunctionKeyword(token.keyword))
+    {
+        if (node.vtype == ValueTypeInteger)  // INT, FIX, CINT, PEEK, LEN etc.
+            return true;
+        if ((token.keyword == KeywordABS || token.keyword == KeywordSGN) && node.args.size() == 1)
+            return IsIntegerExpression(node.args[0]);
+        return false;
+    }
+
+    if (token.type == TokenTypeOperation || token.IsBinaryOperation())
+    {
+        const string& text = token.text;
+        if (text == "=" || text == "<>" || text == "><" || text == "<" || text == ">" ||
+            text == "<=" || text == "=<" || text == ">=" || text == "=>")
+            return true;  // -1 or 0
+        if (text == "/" || text == "^")
+            return false;
+        if (node.left >= 0 && !IsIntegerNode(expr, expr.nodes[node.left]))
+            return false;
+        if (node.right >= 0 && !IsIntegerNode(expr, expr.nodes[node.right]))
+            return false;
+        return node.right >= 0;
+    }
+
+    return false;
+}
+
+// Find the value ranges of the candidates, exclude the candidates with values that could go out of Integer range,
+// or used in integer operations that could overflow; returns true if some candidates were excluded
+bool Analyzer::CheckIntegerRanges()
+{
+    // Variable is 0 until assigned; widen the ranges by the assigned values, a range still growing is not bounded
+    m_intranges.clear();
+    for (auto it = m_candidates.begin(); it != m_candidates.end(); ++it)
+    {
+        if (m_excluded.find(it->first) == m_excluded.end())
+            m_intranges[it->first] = std::make_pair(0, 0);
+    }
+    std::set<string> failed, grown;
+    for (int pass = 0; pass < 8; pass++)
+    {
+        grown.clear();
+        for (const SourceLineModel& line : m_source->lines)
+            CollectIntegerRanges(line.statement, grown, failed);
+        if (grown.empty())
+            break;
+    }
+    failed.insert(grown.begin(), grown.end());
+
+    // Integer operations on the candidates
+    for (const SourceLineModel& line : m_source->lines)
+        CheckIntegerOverflows(line.statement, failed);
+
+    bool changed = false;
+    for (const string& canoname : failed)
+    {
+        if (m_excluded.insert(canoname).second)
+            changed = true;
+    }
+    return changed;
+}
+
+// Widen the ranges of the candidates by the values assigned in the statement
+void Analyzer::CollectIntegerRanges(const StatementModel& statement, std::set<string>& grown, std::set<string>& failed)
+{
+    KeywordIndex keyword = statement.token.keyword;
+    string canoname;
+    long long minvalue = 0, maxvalue = 0;
+    bool known = true;
+    if (keyword == KeywordLET && statement.ident.type == TokenTypeIdentifier &&
+        !statement.varexprs.empty() && !statement.args.empty())
+    {
+        canoname = statement.varexprs[0].name;
+        int low = 0, high = 0;
+        known = IsCandidate(canoname) && GetIntegerNodeRange(statement.args[0], statement.args[0].nodes[statement.args[0].root], low, high);
+        minvalue = low;  maxvalue = high;
+    }
+    else if (keyword == KeywordFOR && statement.ident.type == TokenTypeIdentifier && statement.args.size() >= 2)
+    {
+        // The variable gets the start value, then up to the end value plus the step
+        canoname = GetCanonicVariableName(statement.ident.text);
+        int ranges[3][2] = { { 0, 0 }, { 0, 0 }, { 1, 1 } };
+        for (size_t i = 0; i < statement.args.size() && i < 3 && known; i++)
+        {
+            const ExpressionModel& expr = statement.args[i];
+            known = IsCandidate(canoname) && GetIntegerNodeRange(expr, expr.nodes[expr.root], ranges[i][0], ranges[i][1]);
+        }
+        minvalue = std::min((long long)ranges[0][0], (long long)ranges[1][0] + std::min(ranges[2][0], 0));
+        maxvalue = std::max((long long)ranges[0][1], (long long)ranges[1][1] + std::max(ranges[2][1], 0));
+    }
+    else if (keyword == KeywordREAD)
+    {
+        for (const VariableExpressionModel& varexpr : statement.varexprs)
+        {
+            auto it = m_intranges.find(varexpr.name);
+            if (it == m_intranges.end() || !IsCandidate(varexpr.name))
+                continue;
+            if (m_datarange.first < it->second.first || m_datarange.second > it->second.second)
+            {
+                it->second.first = std::min(it->second.first, m_datarange.first);
+                it->second.second = std::max(it->second.second, m_datarange.second);
+                grown.insert(varexpr.name);
+            }
+        }
+    }
+
+    auto it = m_intranges.find(canoname);
+    if (!canoname.empty() && it != m_intranges.end())
+    {
+        if (!known || minvalue < SHRT_MIN || maxvalue > SHRT_MAX)
+            failed.insert(canoname);
+        else if (minvalue < it->second.first || maxvalue > it->second.second)
+        {
+            it->second.first = std::min(it->second.first, (int)minvalue);
+            it->second.second = std::max(it->second.second, (int)maxvalue);
+            grown.insert(canoname);
+        }
+    }
+
+    if (statement.stthen != nullptr)
+        CollectIntegerRanges(*statement.stthen, grown, failed);
+    if (statement.stelse != nullptr)
+        CollectIntegerRanges(*statement.stelse, grown, failed);
+}
+
+// Find integer operations on the candidates that could overflow, note the candidates used there
+void Analyzer::CheckIntegerOverflows(const StatementModel& statement, std::set<string>& failed) const
+{
+    if (statement.token.keyword == KeywordDEF)
+        return;  // DEF FN parameters are not candidates
+    for (const ExpressionModel& expr : statement.args)
+        CheckIntegerOverflows(expr, failed);
+    for (const VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        for (const ExpressionModel& expr : varexpr.args)
+            CheckIntegerOverflows(expr, failed);
+    }
+    if (statement.stthen != nullptr)
+        CheckIntegerOverflows(*statement.stthen, failed);
+    if (statement.stelse != nullptr)
+        CheckIntegerOverflows(*statement.stelse, failed);
+}
+
+void Analyzer::CheckIntegerOverflows(const ExpressionModel& expr, std::set<string>& failed) const
+{
+    for (const ExpressionNode& node : expr.nodes)
+    {
+        for (const ExpressionModel& exprin : node.args)
+            CheckIntegerOverflows(exprin, failed);
+
+        int minvalue, maxvalue;
+        if (IsIntegerNode(expr, node) && !GetIntegerNodeRange(expr, node, minvalue, maxvalue))
+            CollectCandidateNames(expr, node, failed);
+    }
+}
+
+// Get the value range of the integer expression sub-tree, the candidates take the values from m_intranges;
+// returns false if the value could go out of Integer range
+bool Analyzer::GetIntegerNodeRange(const ExpressionModel& expr, const ExpressionNode& node, int& minvalue, int& maxvalue) const
+{
+    const Token& token = node.token;
+    minvalue = SHRT_MIN;  maxvalue = SHRT_MAX;
+
+    if (token.type == TokenTypeNumber)
+    {
+        if (!token.IsDValueInteger() || token.dvalue < SHRT_MIN || token.dvalue > SHRT_MAX)
+            return false;
+        minvalue = maxvalue = (int)token.dvalue;
+        return true;
+    }
+
+    if (token.type == TokenTypeIdentifier)
+    {
+        auto it = m_intranges.find(GetCanonicVariableName(token.text));
+        if (it != m_intranges.end() && node.args.empty())
+        {
+            minvalue = it->second.first;
+            maxvalue = it->second.second;
+        }
+        return true;
+    }
+
+    if (token.type == TokenTypeKeyword && IsFunctionKeyword(token.keyword))
+    {
+        if ((token.keyword == KeywordABS || token.keyword == KeywordSGN) && node.args.size() == 1 &&
+            IsIntegerExpression(node.args[0]))
+        {
+            const ExpressionModel& exprarg = node.args[0];
+            int argmin, argmax;
+            if (!GetIntegerNodeRange(exprarg, exprarg.nodes[exprarg.root], argmin, argmax))
+                return false;
+            if (token.keyword == KeywordSGN)
+            {
+                minvalue = (argmin < 0) ? -1 : (argmin > 0 ? 1 : 0);
+                maxvalue = (argmax < 0) ? -1 : (argmax > 0 ? 1 : 0);
+                return true;
+            }
+            minvalue = (argmin <= 0 && argmax >= 0) ? 0 : std::min(std::abs(argmin), std::abs(argmax));
+            maxvalue = std::max(std::abs(argmin), std::abs(argmax));
+            return maxvalue <= SHRT_MAX;
+        }
+        return node.vtype == ValueTypeInteger;
+    }
+
+    if (token.type != TokenTypeOperation && !token.IsBinaryOperation())
+        return false;
+    const string& text = token.text;
+    if (text == "=" || text == "<>" || text == "><" || text == "<" || text == ">" ||
+        text == "<=" || text == "=<" || text == ">=" || text == "=>")
+    {
+        minvalue = -1;  maxvalue = 0;
+        return true;
+    }
+
+    int lmin = 0, lmax = 0, rmin, rmax;
+    if (node.right < 0 || !GetIntegerNodeRange(expr, expr.nodes[node.right], rmin, rmax))
+        return false;
+    if (node.left >= 0 && !GetIntegerNodeRange(expr, expr.nodes[node.left], lmin, lmax))
+        return false;
+    long long low, high;
+    if (node.left < 0)  // Unary operation
+    {
+        if (text == "-")
+        {
+            low = -(long long)rmax;  high = -(long long)rmin;
+        }
+        else if (text == "+")
+        {
+            low = rmin;  high = rmax;
+        }
+        else
+            return true;  // NOT
+    }
+    else if (text == "+")
+    {
+        low = (long long)lmin + rmin;  high = (long long)lmax + rmax;
+    }
+    else if (text == "-")
+    {
+        low = (long long)lmin - rmax;  high = (long long)lmax - rmin;
+    }
+    else if (text == "*")
+    {
+        long long products[4] = { (long long)lmin * rmin, (long long)lmin * rmax, (long long)lmax * rmin, (long long)lmax * rmax };
+        low = high = products[0];
+        for (long long product : products)
+        {
+            low = std::min(low, product);
+            high = std::max(high, product);
+        }
+    }
+    else if (text == "\\" || text == "MOD")  // The result is not greater than the dividend, MOD - than the divisor
+    {
+        long long dividend = std::max(std::llabs(lmin), std::llabs(lmax));
+        long long limit = (text == "MOD") ? std::min(dividend, std::max(std::llabs(rmin), std::llabs(rmax))) : dividend;
+        low = -limit;  high = limit;
+    }
+    else
+        return true;  // AND, OR, XOR, EQV, IMP work on 16 bits
+
+    if (low < SHRT_MIN || high > SHRT_MAX)
+        return false;
+    minvalue = (int)low;
+    maxvalue = (int)high;
+    return true;
+}
+
+// Collect the candidates used in the expression sub-tree
+void Analyzer::CollectCandidateNames(const ExpressionModel& expr, const ExpressionNode& node, std::set<string>& names) const
+{
+    if (node.token.type == TokenTypeIdentifier)
+    {
+        string canoname = GetCanonicVariableName(node.token.text);
+        if (IsCandidate(canoname))
+            names.insert(canoname);
+    }
+    for (const ExpressionModel& exprin : node.args)
+    {
+        if (exprin.root >= 0)
+            CollectCandidateNames(exprin, exprin.nodes[exprin.root], names);
+    }
+    if (node.left >= 0)
+        CollectCandidateNames(expr, expr.nodes[node.left], names);
+    if (node.right >= 0)
+        CollectCandidateNames(expr, expr.nodes[node.right], names);
+}
+
+void Analyzer::RenameStatement(StatementModel& statement)
+{
+    if (statement.ident.type == TokenTypeIdentifier && statement.token.keyword != KeywordDEF)
+        RenameToken(statement.ident);
+    for (Token& param : statement.params)
+    {
+        if (param.type == TokenTypeIdentifier)
+            RenameToken(param);
+    }
+    for (VariableModel& variable : statement.variables)
+    {
+        if (IsCandidate(variable.name))
+            variable.name = variable.name.substr(0, variable.name.length() - 1) + "%";
+    }
+    for (VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        if (IsCandidate(varexpr.name))
+            varexpr.name = varexpr.name.substr(0, varexpr.name.length() - 1) + "%";
+        for (ExpressionModel& expr : varexpr.args)
+            RenameExpression(expr);
+    }
+    for (ExpressionModel& expr : statement.args)
+        RenameExpression(expr);
+
+    if (statement.stthen != nullptr)
+        RenameStatement(*statement.stthen);
+    if (statement.stelse != nullptr)
+        RenameStatement(*statement.stelse);
+}
+
+void Analyzer::RenameExpression(ExpressionModel& expr)
+{
+    for (ExpressionNode& node : expr.nodes)
+    {
+        if (node.token.type == TokenTypeIdentifier && RenameToken(node.token))
+            node.vtype = ValueTypeInteger;
+        for (ExpressionModel& exprin : node.args)
+            RenameExpression(exprin);
+    }
+
+    // Integer constants next to the demoted variables should be Integer too, to avoid Single operation
+    for (ExpressionNode& node : expr.nodes)
+    {
+        if (node.left < 0 || node.right < 0)
+            continue;
+        const string& text = node.token.text;
+        if (text != "+" && text != "-" && text != "*" && text != "\\" && text != "MOD" &&
+            text != "=" && text != "<>" && text != "><" && text != "<" && text != ">" &&
+            text != "<=" && text != "=<" && text != ">=" && text != "=>")
+            continue;
+        ExpressionNode& nodeleft = expr.nodes[node.left];
+        ExpressionNode& noderight = expr.nodes[node.right];
+        if (IsIntegerNode(expr, nodeleft) && IsDemotedNode(expr, nodeleft))
+            RetypeConstant(noderight);
+        if (IsIntegerNode(expr, noderight) && IsDemotedNode(expr, noderight))
+            RetypeConstant(nodeleft);
+    }
+}
+
+// Check if the expression sub-tree uses any of the demoted variables
+bool Analyzer::IsDemotedNode(const ExpressionModel& expr, const ExpressionNode& node) const
+{
+    if (node.token.type == TokenTypeIdentifier && m_demoted.find(GetCanonicVariableName(node.token.text)) != m_demoted.end())
+        return true;
+    if (node.left >= 0 && IsDemotedNode(expr, expr.nodes[node.left]))
+        return true;
+    if (node.right >= 0 && IsDemotedNode(expr, expr.nodes[node.right]))
+        return true;
+    return false;
+}
+
+void Analyzer::RetypeConstant(ExpressionNode& node)
+{
+    Token& token = node.token;
+    if (token.type != TokenTypeNumber || token.vtype != ValueTypeSingle ||
+        !token.IsDValueInteger() || token.dvalue < -32768 || token.dvalue > 32767)
+        return;
+
+    token.vtype = ValueTypeInteger;
+    node.vtype = ValueTypeInteger;
+}
+
+bool Analyzer::RenameToken(Token& token)
+{
+    string canoname = GetCanonicVariableName(token.text);
+    if (!IsCandidate(canoname))
+        return false;
+
+    token.text = canoname.substr(0, canoname.length() - 1) + "%";
+    token.vtype = ValueTypeInteger;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Compile-time READ
+
+static bool HasStatement(const StatementModel& statement, KeywordIndex keyword)
+{
+    return statement.token.keyword == keyword ||
+        (statement.stthen != nullptr && HasStatement(*statement.stthen, keyword)) ||
+        (statement.stelse != nullptr && HasStatement(*statement.stelse, keyword));
+}
+
+// Const expression with the DATA element value, if the variable could get the value without a conversion at run time
+static bool GetDataValueExpression(const DataElementModel& dataelem, ValueType vtype, ExpressionModel& expr)
+{
+    if ((vtype == ValueTypeString) != (dataelem.vtype == ValueTypeString))
+        return false;  // type mismatch error at run time
+    if (vtype == ValueTypeInteger && (dataelem.dvalue != std::floor(dataelem.dvalue) ||
+                                      dataelem.dvalue < SHRT_MIN || dataelem.dvalue > SHRT_MAX))
+        return false;  // FTOI rounding or overflow error at run time
+
+    ExpressionNode node;
+    node.token.line = dataelem.srclinenum;
+    node.token.type = (dataelem.vtype == ValueTypeString) ? TokenTypeString : TokenTypeNumber;
+    node.token.vtype = dataelem.vtype;
+    node.token.dvalue = dataelem.dvalue;
+    node.token.svalue = dataelem.svalue;
+    std::ostringstream text;
+    if (dataelem.vtype == ValueTypeString)
+        text << '"' << dataelem.svalue << '"';
+    else
+        text << dataelem.dvalue;
+    node.token.text = text.str();
+    node.vtype = dataelem.vtype;
+    node.constval = true;
+    expr.nodes.clear();
+    expr.nodes.push_back(node);
+    expr.root = 0;
+    return true;
+}
+
+// READ statements running once, in the straight-line code at the program start, take the DATA values at compile time:
+// the statement gets the values as the const expressions, one per variable, and the generator makes the assignments.
+// The straight-line code ends at the first line with jumps to it, loop, IF, jump, RESTORE, CALL, or READ with
+// the value needing the conversion. The DATA elements taken are removed, or skipped if the program has RESTORE.
+void Analyzer::ResolveStaticReads()
+{
+    if (m_source->data.empty())
+        return;
+
+    std::set<int> targets;
+    bool hasrestore = false;
+    for (const SourceLineModel& line : m_source->lines)
+    {
+        CollectJumpTargets(line.statement, targets);
+        hasrestore |= HasStatement(line.statement, KeywordRESTORE);
+    }
+
+    size_t dataindex = 0;
+    size_t lineindex = 0;
+    for (; lineindex < m_source->lines.size(); lineindex++)
+    {
+        SourceLineModel& line = m_source->lines[lineindex];
+        StatementModel& statement = line.statement;
+        KeywordIndex keyword = statement.token.keyword;
+        if (targets.find(line.linenum) != targets.end() || statement.IsControlTransfer() ||
+            keyword == KeywordFOR || keyword == KeywordNEXT || keyword == KeywordIF ||
+            keyword == KeywordRESTORE || keyword == KeywordCALL)
+            break;
+        if (keyword != KeywordREAD)
+            continue;
+
+        std::vector<ExpressionModel> values(statement.varexprs.size());
+        size_t index = dataindex;
+        bool resolved = true;
+        for (size_t i = 0; i < statement.varexprs.size() && resolved; i++)
+        {
+            resolved = index < m_source->data.size() &&
+                GetDataValueExpression(m_source->data[index], statement.varexprs[i].GetValueType(), values[i]);
+            index++;
+        }
+        if (!resolved)
+            break;
+
+        for (const ExpressionModel& value : values)
+        {
+            if (value.GetExpressionValueType() == ValueTypeString)
+                m_source->RegisterConstString(value.GetConstExpressionSValue());
+        }
+        statement.args = values;
+        dataindex = index;
+    }
+    if (dataindex == 0)
+        return;
+
+    // READ at run time after the data ends gives the error, so the DATA block is needed even if all taken
+    bool hasreads = false;
+    for (; lineindex < m_source->lines.size(); lineindex++)
+        hasreads |= HasStatement(m_source->lines[lineindex].statement, KeywordREAD);
+    if (!hasrestore && (dataindex < m_source->data.size() || !hasreads))
+        m_source->data.erase(m_source->data.begin(), m_source->data.begin() + dataindex);
+    else
+        m_source->datastart = (int)dataindex;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Constant propagation
+
+void Analyzer::BuildLineMap()
+{
+    m_linemap.clear();
+    m_returnpoints.clear();
+    for (int i = 0; i < (int)m_source->lines.size(); i++)
+    {
+        const SourceLineModel& line = m_source->lines[i];
+        if (line.linenum != 0)
+            m_linemap[line.linenum] = i;
+
+        // Lines after GOSUB, where RETURN could pass control to
+        const StatementModel& statement = line.statement;
+        bool gosub = statement.token.keyword == KeywordGOSUB ||
+            (statement.token.keyword == KeywordON && !statement.gotogosub) ||
+            (statement.stthen != nullptr && statement.stthen->token.keyword == KeywordGOSUB) ||
+            (statement.stelse != nullptr && statement.stelse->token.keyword == KeywordGOSUB);
+        if (gosub && i + 1 < (int)m_source->lines.size())
+            m_returnpoints.push_back(i + 1);
+    }
+}
+
+// Get list of line indices the line could pass control to; consts is used to skip IF branches, could be nullptr
+void Analyzer::GetSuccessors(int index, const AnalyzerConstants* consts, std::vector<int>& successors)
+{
+    const SourceLineModel& line = m_source->lines[index];
+    bool fallthrough = GetStatementSuccessors(line.statement, consts, successors);
+
+    // FOR could skip the loop body, NEXT goes to the loop body
+    if (line.statement.token.keyword == KeywordFOR)
+    {
+        for (int i = index + 1; i < (int)m_source->lines.size(); i++)
+        {
+            const StatementModel& statement = m_source->lines[i].statement;
+            if (statement.token.keyword != KeywordNEXT)
+                continue;
+            for (const VariableModel& variable : statement.variables)
+            {
+                if (variable.psourceline == &line && i + 1 < (int)m_source->lines.size())
+                    successors.push_back(i + 1);
+            }
+        }
+    }
+    if (line.statement.token.keyword == KeywordNEXT)
+    {
+        for (const VariableModel& variable : line.statement.variables)
+        {
+            if (variable.psourceline == nullptr)
+                continue;
+            int forindex = (int)(variable.psourceline - &m_source->lines[0]);
+            if (forindex + 1 < (int)m_source->lines.size())
+                successors.push_back(forindex + 1);
+        }
+    }
+
+    if (fallthrough && index + 1 < (int)m_source->lines.size())
+        successors.push_back(index + 1);
+}
+
+// Returns true if the control could pass to the next line
+bool Analyzer::GetStatementSuccessors(const StatementModel& statement, const AnalyzerConstants* consts, std::vector<int>& successors)
+{
+    switch (statement.token.keyword)
+    {
+    case KeywordGOTO:
+    case KeywordGOSUB:  // RETURN will pass control to the next line
+    {
+        auto it = m_linemap.find(statement.paramline);
+        if (it != m_linemap.end())
+            successors.push_back(it->second);
+        return false;
+    }
+    case KeywordON:
+        for (const Token& param : statement.params)
+        {
+            auto it = m_linemap.find((int)param.dvalue);
+            if (it != m_linemap.end())
+                successors.push_back(it->second);
+        }
+        return true;  // the index is out of range, both for ON GOTO and ON GOSUB
+    case KeywordRETURN:
+        successors.insert(successors.end(), m_returnpoints.begin(), m_returnpoints.end());
+        return false;
+    case KeywordEND:
+    case KeywordSTOP:
+        return false;
+    case KeywordIF:
+    {
+        bool condition;
+        bool constcond = consts != nullptr && GetConstCondition(statement.args[0], *consts, condition);
+        bool fallthrough = false;
+        for (int branch = 0; branch < 2; branch++)
+        {
+            if (constcond && condition != (branch == 0))
+                continue;
+            const StatementModel* pstatement = branch == 0 ? statement.stthen : statement.stelse;
+            if (pstatement != nullptr)
+            {
+                if (GetStatementSuccessors(*pstatement, consts, successors))
+                    fallthrough = true;
+            }
+            else if ((int)statement.params.size() > branch)  // THEN linenum or ELSE linenum
+            {
+                auto it = m_linemap.find((int)statement.params[branch].dvalue);
+                if (it != m_linemap.end())
+                    successors.push_back(it->second);
+            }
+            else  // no ELSE
+                fallthrough = true;
+        }
+        return fallthrough;
+    }
+    default:
+        return true;
+    }
+}
+
+void Analyzer::CollectAssignedVariables(const StatementModel& statement, std::set<string>& names, bool& clobberall)
+{
+    switch (statement.token.keyword)
+    {
+    case KeywordLET:
+    case KeywordREAD:
+        for (const VariableExpressionModel& varexpr : statement.varexprs)
+            names.insert(varexpr.name);
+        break;
+    case KeywordFOR:
+        names.insert(GetCanonicVariableName(statement.ident.text));
+        break;
+    case KeywordNEXT:
+    case KeywordINPUT:
+        for (const VariableModel& variable : statement.variables)
+            names.insert(variable.name);
+        break;
+    case KeywordCALL:  // Machine code could change anything
+        clobberall = true;
+        break;
+    default:
+        break;
+    }
+
+    if (statement.stthen != nullptr)
+        CollectAssignedVariables(*statement.stthen, names, clobberall);
+    if (statement.stelse != nullptr)
+        CollectAssignedVariables(*statement.stelse, names, clobberall);
+}
+
+// Calculate the constant variables after the statement
+void Analyzer::TransferStatement(const StatementModel& statement, AnalyzerConstants& consts)
+{
+    if (statement.token.keyword == KeywordIF)
+    {
+        bool condition;
+        if (GetConstCondition(statement.args[0], consts, condition))
+        {
+            const StatementModel* pstatement = condition ? statement.stthen : statement.stelse;
+            if (pstatement != nullptr)
+                TransferStatement(*pstatement, consts);
+            return;
+        }
+
+        AnalyzerConstants conststhen = consts;
+        if (statement.stthen != nullptr)
+            TransferStatement(*statement.stthen, conststhen);
+        if (statement.stelse != nullptr)
+            TransferStatement(*statement.stelse, consts);
+        MergeConstants(consts, conststhen);
+        return;
+    }
+
+    // Assignment of constant value to simple numeric variable
+    if (statement.token.keyword == KeywordLET && statement.ident.type == TokenTypeIdentifier &&
+        statement.varexprs.size() == 1 && statement.varexprs[0].args.empty() && statement.args.size() == 1)
+    {
+        const string& canoname = statement.varexprs[0].name;
+        ValueType vtype = statement.varexprs[0].GetValueType();
+        consts.erase(canoname);
+
+        ExpressionModel expr = statement.args[0];
+        SubstituteConstants(expr, consts);
+        if (vtype != ValueTypeString && expr.IsConstExpression() && expr.GetExpressionValueType() != ValueTypeString)
+        {
+            double dvalue = expr.GetConstExpressionDValue();
+            if (vtype == ValueTypeInteger)
+            {
+                dvalue = std::floor(dvalue);
+                if (dvalue >= -32768 && dvalue <= 32767)
+                    consts[canoname] = dvalue;
+            }
+            else
+                consts[canoname] = (double)(float)dvalue;
+        }
+        return;
+    }
+
+    // READ at compile time assigns the const values
+    if (statement.token.keyword == KeywordREAD && statement.args.size() == statement.varexprs.size())
+    {
+        for (size_t i = 0; i < statement.varexprs.size(); i++)
+        {
+            const VariableExpressionModel& varexpr = statement.varexprs[i];
+            consts.erase(varexpr.name);
+            ValueType vtype = varexpr.GetValueType();
+            if (varexpr.args.empty() && vtype != ValueTypeString)
+            {
+                double dvalue = statement.args[i].GetConstExpressionDValue();
+                consts[varexpr.name] = (vtype == ValueTypeInteger) ? dvalue : (double)(float)dvalue;
+            }
+        }
+        return;
+    }
+
+    std::set<string> names;
+    bool clobberall = false;
+    CollectAssignedVariables(statement, names, clobberall);
+    if (clobberall)
+        consts.clear();
+    for (const string& name : names)
+        consts.erase(name);
+}
+
+// Variable is constant only if it has the same constant value on both paths
+void Analyzer::MergeConstants(AnalyzerConstants& consts, const AnalyzerConstants& other)
+{
+    for (auto it = consts.begin(); it != consts.end(); )
+    {
+        auto itother = other.find(it->first);
+        if (itother == other.end() || itother->second != it->second)
+            it = consts.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool Analyzer::GetConstCondition(const ExpressionModel& expr, const AnalyzerConstants& consts, bool& condition)
+{
+    ExpressionModel exprcopy = expr;
+    SubstituteConstants(exprcopy, consts);
+    if (!exprcopy.IsConstExpression() || exprcopy.GetExpressionValueType() == ValueTypeString)
+        return false;
+    condition = (int)exprcopy.GetConstExpressionDValue() != 0;
+    return true;
+}
+
+// Replace the constant variables with their values, then re-calculate the expression; returns true if changed
+bool Analyzer::SubstituteConstants(ExpressionModel& expr, const AnalyzerConstants& consts)
+{
+    const ExpressionModel original = expr;
+    bool changed = false;
+    for (ExpressionNode& node : expr.nodes)
+    {
+        for (ExpressionModel& exprin : node.args)
+        {
+            if (SubstituteConstants(exprin, consts))
+                changed = true;
+        }
+        if (node.token.type != TokenTypeIdentifier || !node.args.empty())
+            continue;
+
+        string canoname = GetCanonicVariableName(node.token.text);
+        auto it = consts.find(canoname);
+        if (it == consts.end())
+            continue;
+
+        ValueType vtype = node.vtype;
+        Token token;
+        token.line = node.token.line;
+        token.pos = node.token.pos;
+        token.type = TokenTypeNumber;
+        token.vtype = vtype;
+        token.dvalue = it->second;
+        std::ostringstream text;
+        text << it->second;
+        token.text = text.str();
+        node.token = token;
+        node.constval = true;
+        changed = true;
+    }
+
+    // AT, TAB and SPC are validated as a part of PRINT statement
+    const ExpressionNode& root = expr.nodes[expr.root];
+    if (changed && root.token.type == TokenTypeKeyword && root.vtype == ValueTypeNone)
+        return changed;
+
+    // The substituted values could make an error in code that never runs, like 1/A under IF A<>0; keep it as is then
+    if (changed && !m_validator->FoldExpression(expr))
+    {
+        expr = original;
+        return false;
+    }
+    return changed;
+}
+
+bool Analyzer::SubstituteStatement(StatementModel& statement, const AnalyzerConstants& consts)
+{
+    if (statement.token.keyword == KeywordDEF)  // DEF FN expression is calculated at FN call
+        return false;
+
+    bool changed = false;
+    for (ExpressionModel& expr : statement.args)
+    {
+        if (SubstituteConstants(expr, consts))
+            changed = true;
+    }
+    for (VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        for (ExpressionModel& expr : varexpr.args)
+        {
+            if (SubstituteConstants(expr, consts))
+                changed = true;
+        }
+    }
+    if (statement.stthen != nullptr && SubstituteStatement(*statement.stthen, consts))
+        changed = true;
+    if (statement.stelse != nullptr && SubstituteStatement(*statement.stelse, consts))
+        changed = true;
+    return changed;
+}
+
+// Find variables having constant values, using data flow over the lines; substitute the values into expressions.
+void Analyzer::PropagateConstants(Validator* validator)
+{
+    assert(validator != nullptr);
+    m_validator = validator;
+
+    if (m_source->lines.empty())
+        return;
+    BuildLineMap();
+
+    // Variables are unknown at the program start
+    std::vector<AnalyzerLineState> states(m_source->lines.size());
+    states[0].reached = true;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = 0; i < (int)m_source->lines.size(); i++)
+        {
+            if (!states[i].reached)
+                continue;
+
+            AnalyzerConstants consts = states[i].consts;
+            TransferStatement(m_source->lines[i].statement, consts);
+
+            std::vector<int> successors;
+            GetSuccessors(i, &states[i].consts, successors);
+            for (int next : successors)
+            {
+                AnalyzerLineState& state = states[next];
+                if (!state.reached)
+                {
+                    state.reached = true;
+                    state.consts = consts;
+                    changed = true;
+                    continue;
+                }
+                size_t count = state.consts.size();
+                MergeConstants(state.consts, consts);
+                if (state.consts.size() != count)
+                    changed = true;
+            }
+        }
+    }
+
+    for (int i = 0; i < (int)m_source->lines.size(); i++)
+    {
+        if (states[i].reached && !states[i].consts.empty())
+            SubstituteStatement(m_source->lines[i].statement, states[i].consts);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Unreachable code elimination
+
+// Lines that produce no code by themselves
+bool Analyzer::IsDeclarativeLine(const SourceLineModel& line)
+{
+    KeywordIndex keyword = line.statement.token.keyword;
+    return keyword == KeywordREM || keyword == KeywordDATA || keyword == KeywordDIM || keyword == KeywordDEF;
+}
+
+// FOR and NEXT refer to the labels of each other, so they should be generated together
+void Analyzer::GetForNextLinks(int index, std::vector<int>& links) const
+{
+    const SourceLineModel& line = m_source->lines[index];
+    if (line.statement.token.keyword == KeywordFOR)
+    {
+        for (int i = index + 1; i < (int)m_source->lines.size(); i++)
+        {
+            const StatementModel& statement = m_source->lines[i].statement;
+            if (statement.token.keyword != KeywordNEXT)
+                continue;
+            for (const VariableModel& variable : statement.variables)
+            {
+                if (variable.psourceline == &line)
+                    links.push_back(i);
+            }
+        }
+    }
+    if (line.statement.token.keyword == KeywordNEXT)
+    {
+        for (const VariableModel& variable : line.statement.variables)
+        {
+            if (variable.psourceline != nullptr)
+                links.push_back((int)(variable.psourceline - &m_source->lines[0]));
+        }
+    }
+}
+
+// Find the lines the control never gets to, and exclude them from the code generation.
+// Should be called after constant propagation, so IF with constant condition passes control to one branch only.
+void Analyzer::EliminateUnreachableLines()
+{
+    if (m_source->lines.empty())
+        return;
+    BuildLineMap();
+
+    std::vector<bool> reached(m_source->lines.size(), false);
+    std::vector<int> worklist;
+    reached[0] = true;
+    worklist.push_back(0);
+    const AnalyzerConstants noconsts;
+    while (!worklist.empty())
+    {
+        int index = worklist.back();
+        worklist.pop_back();
+
+        std::vector<int> successors;
+        GetSuccessors(index, &noconsts, successors);
+        for (int next : successors)
+        {
+            if (reached[next])
+                continue;
+            reached[next] = true;
+            worklist.push_back(next);
+        }
+    }
+
+    // Keep the unreachable FOR or NEXT paired with the reachable one
+    std::vector<bool> kept = reached;
+    for (int i = 0; i < (int)m_source->lines.size(); i++)
+    {
+        if (kept[i])
+            worklist.push_back(i);
+    }
+    while (!worklist.empty())
+    {
+        int index = worklist.back();
+        worklist.pop_back();
+
+        std::vector<int> links;
+        GetForNextLinks(index, links);
+        for (int link : links)
+        {
+            if (kept[link])
+                continue;
+            kept[link] = true;
+            worklist.push_back(link);
+        }
+    }
+
+    for (int i = 0; i < (int)m_source->lines.size(); i++)
+    {
+        SourceLineModel& line = m_source->lines[i];
+        if (kept[i] || IsDeclarativeLine(line))
+            continue;
+
+        line.unreachable = true;
+        Token token;  // the statement token could be empty for LET, so point to the line start
+        token.line = line.srclinenum;
+        token.pos = 1;
+        Warning(line, token, "Unreachable line removed.");
+    }
+}
+
+// Write the line control flow graph in Graphviz DOT format
+void Analyzer::WriteControlFlowGraph(std::ostream& out)
+{
+    BuildLineMap();
+
+    out << "digraph CFG {" << std::endl;
+    out << "\tnode [shape=box, fontname=\"Courier\"];" << std::endl;
+
+    const AnalyzerConstants noconsts;
+    for (int i = 0; i < (int)m_source->lines.size(); i++)
+    {
+        const SourceLineModel& line = m_source->lines[i];
+        string label = line.GetLineNumberLabel();
+
+        string text;
+        for (char ch : line.text)
+        {
+            if (ch == '"' || ch == '\\')
+                text += '\\';
+            text += ch;
+        }
+        out << "\t" << label << " [label=\"" << text << "\"";
+        if (line.unreachable)
+            out << ", style=dashed, color=gray";
+        out << "];" << std::endl;
+
+        std::vector<int> successors;
+        GetSuccessors(i, &noconsts, successors);
+        for (int next : successors)
+            out << "\t" << label << " -> " << m_source->lines[next].GetLineNumberLabel() << ";" << std::endl;
+
+        // RESTORE sets the DATA position, shown as a dotted edge
+        if (line.statement.token.keyword == KeywordRESTORE && line.statement.paramline > 0)
+        {
+            auto it = m_linemap.find(line.statement.paramline);
+            if (it != m_linemap.end())
+                out << "\t" << label << " -> " << m_source->lines[it->second].GetLineNumberLabel() << " [style=dotted];" << std::endl;
+        }
+    }
+
+    out << "}" << std::endl;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Line labels
+
+// Collect line numbers the statement refers to
+void Analyzer::CollectJumpTargets(const StatementModel& statement, std::set<int>& targets)
+{
+    switch (statement.token.keyword)
+    {
+    case KeywordGOTO:
+    case KeywordGOSUB:
+    case KeywordRESTORE:
+        if (statement.paramline > 0)
+            targets.insert(statement.paramline);
+        break;
+    case KeywordON:
+    case KeywordIF:  // THEN linenum, ELSE linenum
+        for (const Token& param : statement.params)
+            targets.insert((int)param.dvalue);
+        break;
+    default:
+        break;
+    }
+
+    if (statement.stthen != nullptr)
+        CollectJumpTargets(*statement.stthen, targets);
+    if (statement.stelse != nullptr)
+        CollectJumpTargets(*statement.stelse, targets);
+}
+
+// Keep the line number labels only for the lines that are jump targets; so the straight-line runs of lines
+// become one block of code for the optimizer, and the assembler symbol table gets shorter.
+void Analyzer::RemoveUnusedLineLabels()
+{
+    std::set<int> targets;
+    for (const SourceLineModel& line : m_source->lines)
+    {
+        if (!line.unreachable)
+            CollectJumpTargets(line.statement, targets);
+    }
+
+    for (SourceLineModel& line : m_source->lines)
+        line.labeled = (line.linenum != 0 && targets.find(line.linenum) != targets.end());
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Common subexpression elimination
+
+// Functions without side effects, returning the same value for the same arguments
+static const KeywordIndex AnalyzerPureFunctions[] = {
+    KeywordABS, KeywordSGN, KeywordINT, KeywordFIX, KeywordSIN, KeywordCOS, KeywordTAN, KeywordATN,
+    KeywordEXP, KeywordLOG, KeywordSQR, KeywordCINT, KeywordCSNG, KeywordCDBL, KeywordPI,
+};
+
+static bool IsPureFunction(KeywordIndex keyword)
+{
+    for (KeywordIndex pure : AnalyzerPureFunctions)
+    {
+        if (keyword == pure)
+            return true;
+    }
+    return false;
+}
+
+// Statements after which the control could go elsewhere, or the variables could change unnoticed
+bool Analyzer::IsBlockEnd(const StatementModel& statement)
+{
+    switch (statement.token.keyword)
+    {
+    case KeywordLET:
+    case KeywordPRINT:
+    case KeywordREM:
+    case KeywordDATA:
+    case KeywordDIM:
+    case KeywordREAD:
+    case KeywordINPUT:
+    case KeywordCLS:
+    case KeywordCOLOR:
+    case KeywordLOCATE:
+    case KeywordBEEP:
+        return false;
+    default:  // POKE and OUT could change any variable, CALL could change anything
+        return true;
+    }
+}
+
+// Is it worth to keep the value instead of calculating it again: has a runtime call or a multiplication/division
+bool Analyzer::IsCostlyNode(const ExpressionModel& expr, const ExpressionNode& node)
+{
+    if (node.token.type == TokenTypeKeyword)
+        return true;  // function
+    if (node.token.type != TokenTypeOperation)
+        return false;
+    const string& text = node.token.text;
+    if (node.vtype == ValueTypeSingle || text == "*" || text == "/" || text == "\\" || text == "MOD" || text == "^")
+        return true;
+    return (node.left >= 0 && IsCostlyNode(expr, expr.nodes[node.left])) ||
+        (node.right >= 0 && IsCostlyNode(expr, expr.nodes[node.right]));
+}
+
+// Build the text key for the sub-tree, and collect the variables; returns false if the sub-tree is not a pure calculation
+bool Analyzer::GetSubexpressionKey(const ExpressionModel& expr, const ExpressionNode& node, string& key, std::set<string>& names)
+{
+    if (node.vtype != ValueTypeInteger && node.vtype != ValueTypeSingle)
+        return false;
+
+    key += (node.vtype == ValueTypeInteger) ? '%' : '!';
+    if (node.constval)
+    {
+        std::ostringstream text;
+        text << node.token.dvalue;
+        key += text.str();
+        return true;
+    }
+    if (node.token.type == TokenTypeIdentifier)
+    {
+        string canoname = GetCanonicVariableName(node.token.text);
+        names.insert(canoname);
+        key += canoname;
+    }
+    else if (node.token.type == TokenTypeKeyword)
+    {
+        if (!IsPureFunction(node.token.keyword))
+            return false;
+        key += GetKeywordString(node.token.keyword);
+    }
+    else if (node.token.type == TokenTypeOperation)
+    {
+        if (node.token.keyword == KeywordNOT || node.token.keyword == KeywordAND || node.token.keyword == KeywordOR ||
+            node.token.keyword == KeywordXOR || node.token.keyword == KeywordEQV)
+            return false;  // IF conditions are generated as jumps
+        key += node.token.text;
+    }
+    else
+        return false;
+
+    key += '(';
+    if (node.left >= 0 && !GetSubexpressionKey(expr, expr.nodes[node.left], key, names))
+        return false;
+    key += ',';
+    if (node.right >= 0 && !GetSubexpressionKey(expr, expr.nodes[node.right], key, names))
+        return false;
+    for (const ExpressionModel& arg : node.args)
+    {
+        key += ',';
+        if (!arg.IsEmpty() && !GetSubexpressionKey(arg, arg.nodes[arg.root], key, names))
+            return false;
+    }
+    key += ')';
+    return true;
+}
+
+void Analyzer::NumberExpression(ExpressionModel& expr, ExpressionNode& node, bool candefine)
+{
+    if (node.constval || (node.token.type == TokenTypeIdentifier && node.args.empty()))
+        return;
+    if (node.cseid != 0)  // Loop invariant
+        return;
+
+    string key;
+    std::set<string> names;
+    bool candidate = IsCostlyNode(expr, node) && GetSubexpressionKey(expr, node, key, names);
+    const string& text = node.token.text;
+    if (text == "=" || text == "<>" || text == "><" || text == "<" || text == ">" ||
+        text == "<=" || text == ">=" || text == "=<" || text == "=>")
+        candidate = false;  // comparisons are generated as jumps
+    if (candidate)
+    {
+        auto it = m_available.find(key);
+        if (it != m_available.end())  // Calculated already, use the saved value
+        {
+            AnalyzerSubexpression& subexpr = it->second;
+            if (subexpr.csetemp == 0)
+            {
+                subexpr.csetemp = ++m_csetemps;
+                subexpr.pnode->cseid = subexpr.cseid;
+                subexpr.pnode->csetemp = subexpr.csetemp;
+                subexpr.pnode->csedef = true;
+            }
+            node.cseid = subexpr.cseid;
+            node.csetemp = subexpr.csetemp;
+            return;
+        }
+    }
+
+    // Operands are calculated before the node
+    if (node.left >= 0)
+        NumberExpression(expr, expr.nodes[node.left], candefine);
+    if (node.right >= 0)
+        NumberExpression(expr, expr.nodes[node.right], candefine);
+    for (ExpressionModel& arg : node.args)
+    {
+        if (!arg.IsEmpty())
+            NumberExpression(arg, arg.nodes[arg.root], candefine);
+    }
+
+    if (candidate && candefine)
+    {
+        AnalyzerSubexpression& subexpr = m_available[key];
+        subexpr.pnode = &node;
+        subexpr.cseid = ++m_csecount;
+        subexpr.names = names;
+    }
+}
+
+// Find the subexpressions calculated before; candefine is false for the code that could be skipped
+void Analyzer::NumberStatement(StatementModel& statement, bool candefine)
+{
+    if (statement.token.keyword == KeywordDEF)  // DEF FN expression is calculated at FN call
+        return;
+
+    if (statement.token.keyword == KeywordIF)  // The condition could be calculated partially
+        candefine = false;
+    for (ExpressionModel& expr : statement.args)
+    {
+        if (!expr.IsEmpty())
+            NumberExpression(expr, expr.nodes[expr.root], candefine);
+    }
+    for (VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        for (ExpressionModel& expr : varexpr.args)
+        {
+            if (!expr.IsEmpty())
+                NumberExpression(expr, expr.nodes[expr.root], candefine);
+        }
+    }
+    if (statement.stthen != nullptr)
+        NumberStatement(*statement.stthen, false);
+    if (statement.stelse != nullptr)
+        NumberStatement(*statement.stelse, false);
+}
+
+// Forget the subexpressions depending on the variables assigned in the statement
+void Analyzer::KillSubexpressions(const StatementModel& statement)
+{
+    std::set<string> names;
+    bool clobberall = false;
+    CollectAssignedVariables(statement, names, clobberall);
+    if (clobberall)
+    {
+        m_available.clear();
+        return;
+    }
+
+    for (auto it = m_available.begin(); it != m_available.end(); )
+    {
+        bool killed = false;
+        for (const string& name : names)
+        {
+            if (it->second.names.find(name) != it->second.names.end())
+                killed = true;
+        }
+        if (killed)
+            it = m_available.erase(it);
+        else
+            ++it;
+    }
+}
+
+// Local value numbering: within a block of lines without jumps into it, a pure subexpression calculated again
+// with the same variable values takes the value saved to a temporary variable by the first calculation.
+// Should be called after HoistLoopInvariants, the block temporaries go after the loop invariant temporaries.
+void Analyzer::EliminateCommonSubexpressions()
+{
+    m_available.clear();
+    m_csetemps = m_looptemps;
+    for (SourceLineModel& line : m_source->lines)
+    {
+        if (line.unreachable)
+            continue;
+        if (line.labeled)  // Block start
+        {
+            m_available.clear();
+            m_csetemps = m_looptemps;
+        }
+
+        StatementModel& statement = line.statement;
+        NumberStatement(statement, true);
+        KillSubexpressions(statement);
+
+        if (IsBlockEnd(statement))
+        {
+            m_available.clear();
+            m_csetemps = m_looptemps;
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Loop-invariant code motion
+
+// Sub-tree could stop the program with an error, like division by zero
+bool Analyzer::IsFaultingNode(const ExpressionModel& expr, const ExpressionNode& node)
+{
+    const string& text = node.token.text;
+    if (node.token.type == TokenTypeOperation && (text == "/" || text == "\\" || text == "MOD" || text == "^"))
+        return true;
+    if (node.token.type == TokenTypeKeyword &&
+        (node.token.keyword == KeywordLOG || node.token.keyword == KeywordSQR || node.token.keyword == KeywordEXP))
+        return true;
+
+    for (const ExpressionModel& arg : node.args)
+    {
+        if (!arg.IsEmpty() && IsFaultingNode(arg, arg.nodes[arg.root]))
+            return true;
+    }
+    return (node.left >= 0 && IsFaultingNode(expr, expr.nodes[node.left])) ||
+        (node.right >= 0 && IsFaultingNode(expr, expr.nodes[node.right]));
+}
+
+// Find the only NEXT for the FOR; returns false if the loop body is not suitable for the code motion:
+// the body has GOSUB, CALL, POKE or OUT, or there are jumps into the body from outside
+bool Analyzer::GetLoopBody(int forindex, int& nextindex)
+{
+    const SourceLineModel& forline = m_source->lines[forindex];
+    nextindex = -1;
+    for (int i = forindex + 1; i < (int)m_source->lines.size(); i++)
+    {
+        for (const VariableModel& variable : m_source->lines[i].statement.variables)
+        {
+            if (m_source->lines[i].statement.token.keyword != KeywordNEXT || variable.psourceline != &forline)
+                continue;
+            if (nextindex >= 0)
+                return false;  // NEXT is not the only one
+            nextindex = i;
+        }
+    }
+    if (nextindex < 0)
+        return false;
+
+    std::set<int> bodylines;
+    for (int i = forindex + 1; i < nextindex; i++)
+    {
+        const StatementModel& statement = m_source->lines[i].statement;
+        KeywordIndex keyword = statement.token.keyword;
+        if (keyword == KeywordGOSUB || keyword == KeywordCALL || keyword == KeywordPOKE || keyword == KeywordOUT ||
+            (keyword == KeywordON && !statement.gotogosub) ||
+            (statement.stthen != nullptr && statement.stthen->token.keyword == KeywordGOSUB) ||
+            (statement.stelse != nullptr && statement.stelse->token.keyword == KeywordGOSUB))
+            return false;
+        bodylines.insert(m_source->lines[i].linenum);
+    }
+    bodylines.insert(m_source->lines[nextindex].linenum);
+
+    for (int i = 0; i < (int)m_source->lines.size(); i++)
+    {
+        if (i > forindex && i <= nextindex)
+            continue;
+        std::vector<int> targets;
+        m_source->lines[i].statement.GetJumpTargets(targets);
+        for (int target : targets)
+        {
+            if (bodylines.find(target) != bodylines.end())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void Analyzer::HoistExpression(ExpressionModel& expr, ExpressionNode& node, StatementModel& forstatement, const std::set<string>& assigned, bool canfault)
+{
+    if (node.constval || (node.token.type == TokenTypeIdentifier && node.args.empty()))
+        return;
+    if (node.cseid != 0)  // Invariant of the outer loop
+        return;
+
+    string key;
+    std::set<string> names;
+    bool candidate = IsCostlyNode(expr, node) && GetSubexpressionKey(expr, node, key, names) &&
+        (canfault || !IsFaultingNode(expr, node));
+    for (const string& name : names)
+    {
+        if (assigned.find(name) != assigned.end())
+            candidate = false;
+    }
+    const string& text = node.token.text;
+    if (text == "=" || text == "<>" || text == "><" || text == "<" || text == ">" ||
+        text == "<=" || text == ">=" || text == "=<" || text == "=>")
+        candidate = false;  // comparisons are generated as jumps
+    if (candidate)
+    {
+        auto it = m_invariants.find(key);
+        if (it == m_invariants.end())
+        {
+            // Copy the sub-tree to calculate it before the loop
+            ExpressionModel exprcalc = expr;
+            exprcalc.root = (int)(&node - &expr.nodes[0]);
+            ExpressionNode& nodecalc = exprcalc.nodes[exprcalc.root];
+            AnalyzerSubexpression& subexpr = m_invariants[key];
+            subexpr.cseid = ++m_csecount;
+            subexpr.csetemp = ++m_looptemps;
+            nodecalc.cseid = subexpr.cseid;
+            nodecalc.csetemp = subexpr.csetemp;
+            nodecalc.csedef = true;
+            forstatement.invariants.push_back(exprcalc);
+            it = m_invariants.find(key);
+        }
+        node.cseid = it->second.cseid;
+        node.csetemp = it->second.csetemp;
+        return;
+    }
+
+    if (node.left >= 0)
+        HoistExpression(expr, expr.nodes[node.left], forstatement, assigned, canfault);
+    if (node.right >= 0)
+        HoistExpression(expr, expr.nodes[node.right], forstatement, assigned, canfault);
+    for (ExpressionModel& arg : node.args)
+    {
+        if (!arg.IsEmpty())
+            HoistExpression(arg, arg.nodes[arg.root], forstatement, assigned, canfault);
+    }
+}
+
+// canfault is true for the statements calculated on every iteration of the loop running at least once
+void Analyzer::HoistStatement(StatementModel& statement, StatementModel& forstatement, const std::set<string>& assigned, bool canfault)
+{
+    if (statement.token.keyword == KeywordDEF)
+        return;
+
+    if (statement.token.keyword == KeywordIF)  // The condition could be calculated partially
+        canfault = false;
+    for (ExpressionModel& expr : statement.args)
+    {
+        if (!expr.IsEmpty())
+            HoistExpression(expr, expr.nodes[expr.root], forstatement, assigned, canfault);
+    }
+    for (VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        for (ExpressionModel& expr : varexpr.args)
+        {
+            if (!expr.IsEmpty())
+                HoistExpression(expr, expr.nodes[expr.root], forstatement, assigned, canfault);
+        }
+    }
+    if (statement.stthen != nullptr)
+        HoistStatement(*statement.stthen, forstatement, assigned, false);
+    if (statement.stelse != nullptr)
+        HoistStatement(*statement.stelse, forstatement, assigned, false);
+}
+
+// Move the pure subexpressions not depending on the variables changed in the loop body, out of the loop:
+// the values are calculated before the loop and kept in temporary variables.
+// The subexpressions that could fail are moved only when the loop body runs at least once and has no jumps.
+void Analyzer::HoistLoopInvariants()
+{
+    for (int forindex = 0; forindex < (int)m_source->lines.size(); forindex++)
+    {
+        SourceLineModel& forline = m_source->lines[forindex];
+        StatementModel& forstatement = forline.statement;
+        if (forline.unreachable || forstatement.token.keyword != KeywordFOR)
+            continue;
+        int nextindex;
+        if (!GetLoopBody(forindex, nextindex))
+            continue;
+
+        // Variables changed in the loop
+        std::set<string> assigned;
+        bool clobberall = false;
+        assigned.insert(GetCanonicVariableName(forstatement.ident.text));
+        bool hasjumps = false;
+        for (int i = forindex + 1; i <= nextindex; i++)
+        {
+            const StatementModel& statement = m_source->lines[i].statement;
+            CollectAssignedVariables(statement, assigned, clobberall);
+            if (statement.IsControlTransfer())
+                hasjumps = true;
+        }
+        if (clobberall)
+            continue;
+
+        // Loop body runs at least once
+        bool runsonce = false;
+        const ExpressionModel& exprfrom = forstatement.args[0];
+        const ExpressionModel& exprto = forstatement.args[1];
+        if (exprfrom.IsConstExpression() && exprto.IsConstExpression())
+        {
+            double step = 1.0;
+            if (forstatement.args.size() > 2)
+            {
+                const ExpressionModel& exprstep = forstatement.args[2];
+                step = exprstep.IsConstExpression() ? exprstep.GetConstExpressionDValue() : 0.0;
+            }
+            double from = exprfrom.GetConstExpressionDValue();
+            double to = exprto.GetConstExpressionDValue();
+            runsonce = (step > 0 && from <= to) || (step < 0 && from >= to);
+        }
+
+        m_invariants.clear();
+        for (int i = forindex + 1; i < nextindex; i++)
+        {
+            SourceLineModel& line = m_source->lines[i];
+            if (!line.unreachable)
+                HoistStatement(line.statement, forstatement, assigned, runsonce && !hasjumps);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// String length inference
+
+const int AnalyzerStringMaxLength = 255;
+
+// Upper bound for the length of the string sub-tree value; lengths has the bounds for the variables
+int Analyzer::GetStringLengthBound(const ExpressionModel& expr, const ExpressionNode& node, const std::map<string, int>& lengths)
+{
+    if (node.constval)
+        return (int)node.GetConstStringValue().length();
+
+    if (node.token.type == TokenTypeIdentifier && node.args.empty())
+    {
+        auto it = lengths.find(GetCanonicVariableName(node.token.text));
+        return (it == lengths.end()) ? 0 : it->second;  // never assigned: empty string
+    }
+
+    if (node.token.type == TokenTypeOperation && node.token.text == "+" && node.left >= 0 && node.right >= 0)
+    {
+        int bound = GetStringLengthBound(expr, expr.nodes[node.left], lengths) +
+                    GetStringLengthBound(expr, expr.nodes[node.right], lengths);
+        return std::min(bound, AnalyzerStringMaxLength);
+    }
+
+    if (node.token.type == TokenTypeKeyword)
+    {
+        switch (node.token.keyword)
+        {
+        case KeywordCHR:
+        case KeywordINKEY:
+            return 1;
+        case KeywordSTRING:
+            if (!node.args.empty() && node.args[0].IsConstExpression())
+            {
+                int count = (int)std::floor(node.args[0].GetConstExpressionDValue());
+                return std::max(0, std::min(count, AnalyzerStringMaxLength));
+            }
+            break;
+        case KeywordMID:
+            if (!node.args.empty())
+            {
+                const ExpressionModel& argexpr = node.args[0];
+                int bound = GetStringLengthBound(argexpr, argexpr.nodes[argexpr.root], lengths);
+                if (node.args.size() > 2 && node.args[2].IsConstExpression())
+                {
+                    int count = (int)std::floor(node.args[2].GetConstExpressionDValue());
+                    bound = std::min(bound, std::max(0, count));
+                }
+                return bound;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return AnalyzerStringMaxLength;
+}
+
+// Raise the bounds for the String variables assigned in the statement; returns true if any bound changed.
+// lengths has the bounds for all the values, copies has the bounds for the values copied into the variable storage.
+bool Analyzer::InferStringStatement(const StatementModel& statement, int datalength, std::map<string, int>& lengths, std::map<string, int>& copies)
+{
+    bool changed = false;
+    auto raise = [&changed](std::map<string, int>& bounds, const string& name, int bound)
+    {
+        auto it = bounds.find(name);
+        if (it == bounds.end())
+        {
+            bounds[name] = bound;
+            changed = true;
+        }
+        else if (it->second < bound)
+        {
+            it->second = bound;
+            changed = true;
+        }
+    };
+
+    switch (statement.token.keyword)
+    {
+    case KeywordLET:
+        if (!statement.varexprs.empty() && !statement.args.empty() &&
+            statement.varexprs[0].GetValueType() == ValueTypeString && statement.varexprs[0].args.empty())
+        {
+            const ExpressionModel& expr = statement.args[0];
+            int bound = GetStringLengthBound(expr, expr.nodes[expr.root], lengths);
+            raise(lengths, statement.varexprs[0].name, bound);
+            if (!expr.IsConstExpression())  // const strings are not copied, the variable points to the const
+                raise(copies, statement.varexprs[0].name, bound);
+        }
+        break;
+    case KeywordREAD:  // the variable points to the DATA string, or to the const string for READ at compile time
+        for (size_t i = 0; i < statement.varexprs.size(); i++)
+        {
+            const VariableExpressionModel& varexpr = statement.varexprs[i];
+            if (varexpr.GetValueType() != ValueTypeString || !varexpr.args.empty())
+                continue;
+            if (i < statement.args.size())
+                raise(lengths, varexpr.name, (int)statement.args[i].GetConstExpressionSValue().length());
+            else
+                raise(lengths, varexpr.name, datalength);
+        }
+        break;
+    case KeywordINPUT:
+        for (const VariableModel& variable : statement.variables)
+        {
+            if (variable.GetValueType() == ValueTypeString)
+            {
+                raise(lengths, variable.name, AnalyzerStringMaxLength);
+                raise(copies, variable.name, AnalyzerStringMaxLength);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (statement.stthen != nullptr)
+        changed |= InferStringStatement(*statement.stthen, datalength, lengths, copies);
+    if (statement.stelse != nullptr)
+        changed |= InferStringStatement(*statement.stelse, datalength, lengths, copies);
+
+    return changed;
+}
+
+// Find the upper bound for the length of each String variable, from all the assignments to the variable.
+// The variable with the bounded values gets its own buffer of that size, instead of the heap blocks;
+// the variable assigned only with the const strings or by READ needs no buffer at all.
+// Should be called after EliminateUnreachableLines, the unreachable assignments do not count.
+void Analyzer::InferStringLengths()
+{
+    int datalength = 0;  // READ gives the longest string of the DATA block at most
+    for (const DataElementModel& dataelem : m_source->data)
+    {
+        if (dataelem.vtype == ValueTypeString)
+            datalength = std::max(datalength, (int)dataelem.svalue.length());
+    }
+
+    std::map<string, int> lengths;
+    std::map<string, int> copies;
+    bool changed = true;
+    while (changed)  // the bounds only grow and are limited, so it stops
+    {
+        changed = false;
+        for (const SourceLineModel& line : m_source->lines)
+        {
+            if (!line.unreachable)
+                changed |= InferStringStatement(line.statement, datalength, lengths, copies);
+        }
+    }
+
+    for (VariableModel& var : m_source->vars)
+    {
+        if (var.GetValueType() != ValueTypeString || !var.indices.empty())
+            continue;
+        auto it = copies.find(var.name);
+        if (it == copies.end())
+            var.strbuffer = 0;
+        else if (it->second < AnalyzerStringMaxLength)
+            var.strbuffer = it->second;
+        // else keep the values in the heap
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Array bounds check elimination
+
+// Source-like text of the index expression, for the report
+static string GetIndexText(const ExpressionModel& expr, const ExpressionNode& node)
+{
+    string text;
+    if (node.constval && node.vtype != ValueTypeString)
+    {
+        std::ostringstream oss;
+        oss << node.token.dvalue;
+        text = oss.str();
+    }
+    else if (node.token.type == TokenTypeIdentifier || node.token.type == TokenTypeKeyword)
+    {
+        text = (node.token.type == TokenTypeIdentifier) ? GetCanonicVariableName(node.token.text) : GetKeywordString(node.token.keyword);
+        if (!node.args.empty())
+        {
+            text += "(";
+            for (size_t i = 0; i < node.args.size(); i++)
+            {
+                if (i > 0)
+                    text += ",";
+                if (!node.args[i].IsEmpty())
+                    text += GetIndexText(node.args[i], node.args[i].nodes[node.args[i].root]);
+            }
+            text += ")";
+        }
+    }
+    else
+    {
+        if (node.left >= 0)
+            text += GetIndexText(expr, expr.nodes[node.left]);
+        text += node.token.text;
+        if (node.right >= 0)
+            text += GetIndexText(expr, expr.nodes[node.right]);
+    }
+    return node.brackets ? "(" + text + ")" : text;
+}
+
+// Value range of the loop variable for the lines of the loop body: the loop has the only NEXT, no jumps into the body,
+// does not change the variable in the body, and has const integer FROM, TO and STEP
+void Analyzer::AddLoopRange(int forindex, std::vector<AnalyzerRanges>& ranges)
+{
+    const StatementModel& forstatement = m_source->lines[forindex].statement;
+    int nextindex;
+    if (!GetLoopBody(forindex, nextindex))
+        return;
+
+    const ExpressionModel& exprfrom = forstatement.args[0];
+    const ExpressionModel& exprto = forstatement.args[1];
+    if (!exprfrom.IsConstExpression() || !exprto.IsConstExpression())
+        return;
+    double from = exprfrom.GetConstExpressionDValue();
+    double to = exprto.GetConstExpressionDValue();
+    double step = 1.0;
+    if (forstatement.args.size() > 2)
+    {
+        const ExpressionModel& exprstep = forstatement.args[2];
+        if (!exprstep.IsConstExpression())
+            return;
+        step = exprstep.GetConstExpressionDValue();
+    }
+    if (from != std::floor(from) || step != std::floor(step) || step == 0 ||
+        std::fabs(from) > SHRT_MAX || std::fabs(to) > SHRT_MAX)
+        return;
+    int minvalue = (int)from;
+    int maxvalue = (int)std::floor(to);
+    if (step < 0)
+    {
+        minvalue = (int)std::ceil(to);
+        maxvalue = (int)from;
+    }
+    if (minvalue > maxvalue)
+        return;  // the body never runs
+
+    string canoname = GetCanonicVariableName(forstatement.ident.text);
+    std::set<string> assigned;
+    bool clobberall = false;
+    for (int i = forindex + 1; i < nextindex; i++)
+        CollectAssignedVariables(m_source->lines[i].statement, assigned, clobberall);
+    if (clobberall || assigned.find(canoname) != assigned.end())
+        return;
+
+    for (int i = forindex + 1; i < nextindex; i++)
+        ranges[i][canoname] = std::make_pair(minvalue, maxvalue);
+}
+
+// Calculate the value range for the index expression made of consts, loop variables, '+', '-' and '*';
+// returns false with the reason if the range is unknown
+bool Analyzer::GetIndexRange(const ExpressionModel& expr, const ExpressionNode& node, const AnalyzerRanges& ranges,
+                             int& minvalue, int& maxvalue, string& reason)
+{
+    if (node.constval && node.vtype != ValueTypeString)
+    {
+        if (node.token.dvalue != std::floor(node.token.dvalue))
+        {
+            reason = "non-integer const";
+            return false;
+        }
+        minvalue = maxvalue = (int)node.token.dvalue;
+        return true;
+    }
+    if (node.token.type == TokenTypeIdentifier)
+    {
+        string canoname = GetCanonicVariableName(node.token.text);
+        if (!node.args.empty())
+        {
+            reason = canoname + "() element value is not known";
+            return false;
+        }
+        auto it = ranges.find(canoname);
+        if (it == ranges.end())
+        {
+            reason = canoname + " is not a FOR variable with const bounds";
+            return false;
+        }
+        minvalue = it->second.first;
+        maxvalue = it->second.second;
+        return true;
+    }
+    if (node.token.type == TokenTypeOperation && node.left < 0 && node.right >= 0 && node.token.text == "-")
+    {
+        int rmin, rmax;
+        if (!GetIndexRange(expr, expr.nodes[node.right], ranges, rmin, rmax, reason))
+            return false;
+        minvalue = -rmax;
+        maxvalue = -rmin;
+        return true;
+    }
+    const string& text = node.token.text;
+    if (node.token.type != TokenTypeOperation || node.left < 0 || node.right < 0 ||
+        (text != "+" && text != "-" && text != "*"))
+    {
+        reason = "the index is not a linear expression";
+        return false;
+    }
+
+    int lmin, lmax, rmin, rmax;
+    if (!GetIndexRange(expr, expr.nodes[node.left], ranges, lmin, lmax, reason) ||
+        !GetIndexRange(expr, expr.nodes[node.right], ranges, rmin, rmax, reason))
+        return false;
+    long long low, high;
+    if (text == "+")
+    {
+        low = (long long)lmin + rmin;
+        high = (long long)lmax + rmax;
+    }
+    else if (text == "-")
+    {
+        low = (long long)lmin - rmax;
+        high = (long long)lmax - rmin;
+    }
+    else  // "*"
+    {
+        long long products[4] = { (long long)lmin * rmin, (long long)lmin * rmax, (long long)lmax * rmin, (long long)lmax * rmax };
+        low = high = products[0];
+        for (long long product : products)
+        {
+            low = std::min(low, product);
+            high = std::max(high, product);
+        }
+    }
+    if (low < SHRT_MIN || high > SHRT_MAX)
+    {
+        reason = "the index could overflow";
+        return false;
+    }
+    minvalue = (int)low;
+    maxvalue = (int)high;
+    return true;
+}
+
+void Analyzer::CheckBoundsElement(const SourceLineModel& line, const string& canoname, std::vector<ExpressionModel>& args,
+                                  const AnalyzerRanges& ranges, std::ostream* report)
+{
+    const VariableModel* pvar = m_source->GetVariable(canoname);
+    if (pvar == nullptr || pvar->indices.size() != args.size())
+        return;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        ExpressionModel& arg = args[i];
+        if (arg.IsEmpty())
+            continue;
+        if (arg.IsConstExpression())  // checked by the validator, but could get here with the constant propagation
+        {
+            int index = (int)std::floor(arg.GetConstExpressionDValue());
+            if (index < 0 || index > pvar->indices[i])
+            {
+                Warning(line, arg.nodes[arg.root].token, "Array " + canoname + " index " + std::to_string(index) +
+                        " is out of range 0.." + std::to_string(pvar->indices[i]) + ", error at run time.");
+            }
+            continue;
+        }
+        CheckBoundsExpression(line, arg, arg.nodes[arg.root], ranges, report);
+
+        ExpressionNode& root = arg.nodes[arg.root];
+        int minvalue, maxvalue;
+        string reason;
+        if (GetIndexRange(arg, root, ranges, minvalue, maxvalue, reason))
+        {
+            if (minvalue >= 0 && maxvalue <= pvar->indices[i])
+            {
+                root.inbounds = true;
+                m_checksremoved++;
+                continue;
+            }
+            reason = "the index range " + std::to_string(minvalue) + ".." + std::to_string(maxvalue) +
+                " is out of 0.." + std::to_string(pvar->indices[i]);
+        }
+        m_checkskept++;
+        if (report != nullptr)
+        {
+            *report << "Line " << line.linenum << ": " << canoname << "() index " << GetIndexText(arg, root) <<
+                " is checked, " << reason << std::endl;
+        }
+    }
+}
+
+void Analyzer::CheckBoundsExpression(const SourceLineModel& line, ExpressionModel& expr, ExpressionNode& node,
+                                     const AnalyzerRanges& ranges, std::ostream* report)
+{
+    if (node.cseid != 0 && !node.csedef)
+        return;  // the value is calculated in other place
+    if (node.token.type == TokenTypeIdentifier && !node.args.empty())
+    {
+        CheckBoundsElement(line, GetCanonicVariableName(node.token.text), node.args, ranges, report);
+        return;
+    }
+    if (node.left >= 0)
+        CheckBoundsExpression(line, expr, expr.nodes[node.left], ranges, report);
+    if (node.right >= 0)
+        CheckBoundsExpression(line, expr, expr.nodes[node.right], ranges, report);
+    for (ExpressionModel& arg : node.args)
+    {
+        if (!arg.IsEmpty())
+            CheckBoundsExpression(line, arg, arg.nodes[arg.root], ranges, report);
+    }
+}
+
+void Analyzer::CheckBoundsStatement(const SourceLineModel& line, StatementModel& statement, const AnalyzerRanges& ranges, std::ostream* report)
+{
+    static const AnalyzerRanges noranges;
+    const AnalyzerRanges& current = (statement.token.keyword == KeywordDEF) ? noranges : ranges;  // function is called from anywhere
+
+    for (ExpressionModel& expr : statement.args)
+    {
+        if (!expr.IsEmpty())
+            CheckBoundsExpression(line, expr, expr.nodes[expr.root], current, report);
+    }
+    for (ExpressionModel& expr : statement.invariants)
+        CheckBoundsExpression(line, expr, expr.nodes[expr.root], current, report);
+    for (VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        if (!varexpr.args.empty())
+            CheckBoundsElement(line, varexpr.name, varexpr.args, current, report);
+    }
+    if (statement.stthen != nullptr)
+        CheckBoundsStatement(line, *statement.stthen, current, report);
+    if (statement.stelse != nullptr)
+        CheckBoundsStatement(line, *statement.stelse, current, report);
+}
+
+// Array elements get the runtime index checks; the checks are not needed for the indices made of the FOR variables
+// and consts, when the value range of the index is within the array bounds. The report lists the checks kept.
+void Analyzer::EliminateBoundsChecks(std::ostream* report)
+{
+    std::vector<AnalyzerRanges> ranges(m_source->lines.size());
+    for (int forindex = 0; forindex < (int)m_source->lines.size(); forindex++)
+    {
+        const SourceLineModel& forline = m_source->lines[forindex];
+        if (!forline.unreachable && forline.statement.token.keyword == KeywordFOR)
+            AddLoopRange(forindex, ranges);
+    }
+
+    m_checksremoved = m_checkskept = 0;
+    for (size_t i = 0; i < m_source->lines.size(); i++)
+    {
+        SourceLineModel& line = m_source->lines[i];
+        if (!line.unreachable)
+            CheckBoundsStatement(line, line.statement, ranges[i], report);
+    }
+
+    if (report != nullptr)
+        *report << "Array index checks: " << m_checksremoved << " removed, " << m_checkskept << " kept" << std::endl;
+}
+
+
+//////////////////////////////////////////////////////////////////////
@@ -0,0 +1,100 @@
+﻿
+#include <algorithm>
+
+#include "main.h"
+
+
+//////////////////////////////////////////////////////////////////////
+// LZ packing for the self-extracting image, see UNLZ block in the runtime template
+//
+// The stream: one flag byte for every 8 items, lower bit first; 1 = literal byte,
+// 0 = repeat coded with two bytes A and B: offset = (A & 0xF0) * 16 + B + 1, length = (A & 0x0F) + 3.
+
+const int LzWindowSize = 4096;
+const int LzMinMatch = 3;
+const int LzMaxMatch = 18;
+const int LzMaxChain = 256;  // Max candidates to check for one position
+
+static int LzHash(const uint8_t* p)
+{
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & 0xFFFF;
+}
+
+// Pack the data with greedy longest match.
+// margin = max of (bytes unpacked - bytes read) over the stream: when the packed data placed at address S
+// is unpacked to address A, the output never overwrites the unread packed bytes if A + margin <= S.
+void LzPack(const std::vector<uint8_t>& data, std::vector<uint8_t>& packed, int& margin)
+{
+    packed.clear();
+    margin = 0;
+
+    int size = (int)data.size();
+    std::vector<int> head(0x10000, -1);  // Last position for the hash
+    std::vector<int> prev(size, -1);  // Previous position with the same hash
+    auto insert = [&](int pos)
+    {
+        if (pos + LzMinMatch > size)
+            return;
+        int hash = LzHash(&data[pos]);
+        prev[pos] = head[hash];
+        head[hash] = pos;
+    };
+
+    size_t flagpos = 0;
+    int flagbit = 8;
+    int pos = 0;
+    while (pos < size)
+    {
+        if (flagbit == 8)
+        {
+            flagpos = packed.size();
+            packed.push_back(0);
+            flagbit = 0;
+        }
+
+        int bestlen = 0;
+        int bestoffset = 0;
+        if (pos + LzMinMatch <= size)
+        {
+            int maxlen = std::min(LzMaxMatch, size - pos);
+            int chain = 0;
+            for (int cand = head[LzHash(&data[pos])];
+                 cand >= 0 && pos - cand <= LzWindowSize && chain < LzMaxChain; cand = prev[cand], chain++)
+            {
+                int len = 0;
+                while (len < maxlen && data[cand + len] == data[pos + len])
+                    len++;
+                if (len > bestlen)
+                {
+                    bestlen = len;
+                    bestoffset = pos - cand;
+                    if (len == maxlen)
+                        break;
+                }
+            }
+        }
+
+        if (bestlen >= LzMinMatch)
+        {
+            int offset = bestoffset - 1;
+            packed.push_back((uint8_t)(((offset >> 4) & 0xF0) | (bestlen - LzMinMatch)));
+            packed.push_back((uint8_t)(offset & 0xFF));
+            for (int i = 0; i < bestlen; i++)
+                insert(pos + i);
+            pos += bestlen;
+        }
+        else
+        {
+            packed[flagpos] |= (uint8_t)(1 << flagbit);
+            packed.push_back(data[pos]);
+            insert(pos);
+            pos++;
+        }
+        flagbit++;
+
+        margin = std::max(margin, pos - (int)packed.size());
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
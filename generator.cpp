@@ -1,5 +1,7 @@
 ﻿
+#include <algorithm>
 #include <cassert>
+#include <iomanip>
 #include <sstream>
 
 #include "main.h"
@@ -91,6 +93,26 @@ const GeneratorOperSpec Generator::m_operspecs[] =
     //TODO: IMP
 };
 
+// Conditional branches for relational operations, used to jump on comparison result without calculating -1/0
+struct GeneratorRelationSpec
+{
+    const char* text;
+    const char* branch;     // branch if the relation is TRUE
+    const char* invbranch;  // branch if the relation is FALSE
+};
+static const GeneratorRelationSpec g_relationspecs[] =
+{
+    { "=",              "BEQ",  "BNE" },
+    { "<>",             "BNE",  "BEQ" },
+    { "><",             "BNE",  "BEQ" },
+    { "<",              "BLT",  "BGE" },
+    { ">",              "BGT",  "BLE" },
+    { "<=",             "BLE",  "BGT" },
+    { ">=",             "BGE",  "BLT" },
+    { "=<",             "BLE",  "BGT" },
+    { "=>",             "BGE",  "BLT" },
+};
+
 const GeneratorFuncSpec Generator::m_funcspecs[] =
 {
     { KeywordABS,       &Generator::GenerateFuncAbs },
@@ -116,6 +138,7 @@ const GeneratorFuncSpec Generator::m_funcspecs[] =
     { KeywordASC,       &Generator::GenerateFuncAsc },
     { KeywordCHR,       &Generator::GenerateFuncChr },
     { KeywordSTRING,    &Generator::GenerateFuncString },
+    { KeywordMID,       &Generator::GenerateFuncMid },
     { KeywordIIF,       &Generator::GenerateFuncIif },
 };
 
@@ -128,6 +151,12 @@ static bool CompareVariables(const VariableModel& a, const VariableModel& b)
     return deconamea < deconameb;
 }
 
+// Array element size in bytes: Integer value or String address takes one word, Single takes two words
+static int GetArrayElementSize(ValueType vtype)
+{
+    return (vtype == ValueTypeSingle) ? 4 : 2;
+}
+
 static string to_string_octal(uint16_t value)
 {
     string result;
@@ -200,7 +229,10 @@ static string GET_CONSTEXPR_INT_VALUE_AS_CLRMOV(ExpressionModel expr)
 Generator::Generator(SourceModel* source, FinalModel* final,
         const std::vector<string>* initlines, const std::vector<string>* termlines)
     : m_source(source), m_final(final), m_initlines(initlines), m_termlines(termlines),
-    m_lineindex(-1), m_line(nullptr), m_local(0), m_runtimeneeds(), m_notimplemented()
+    m_lineindex(-1), m_line(nullptr), m_local(0), m_runtimeneeds(), m_notimplemented(),
+    m_forspecs(), m_counterloops(0), m_usedstrings(), m_csedefined(), m_csetemps(0),
+    m_inlinespecs(), m_inlinemaxsize(0), m_inlinebudget(0), m_loopdepth(0), m_pointercount(0),
+    m_threaded(false), m_linespans(), m_nextnative(false), m_profile(false), m_profilelines()
 {
     assert(source != nullptr);
     assert(final != nullptr);
@@ -215,6 +247,9 @@ void Generator::AddRuntimeCall(RuntimeSymbol rtsymbol, string comment)
     // FIS implemented on hardware
     bool hardwarefis = (g_platform == PlatformUKNC) && 
         (rtsymbol >= RuntimeFADD && rtsymbol <= RuntimeFDIV);
+    if (!hardwarefis && InlineRuntimeCall(rtsymbol, comment))
+        return;
+
     string statement = hardwarefis
         ? "\t" + rtsymbolname + "\tSP"
         : "\tCALL\t" + rtsymbolname;
@@ -228,6 +263,128 @@ void Generator::AddRuntimeCall(RuntimeSymbol rtsymbol, string comment)
         m_runtimeneeds.insert(rtsymbol);
 }
 
+// Check if the operand refers to a label or to SP/PC; the inlined code could use R0..R7, numbers and local labels only
+static bool HasSymbolReference(const string& operand)
+{
+    size_t i = 0;
+    while (i < operand.size())
+    {
+        if (!isalpha((unsigned char)operand[i]))
+        {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < operand.size() && (isalnum((unsigned char)operand[i]) || operand[i] == '$' || operand[i] == '.'))
+            i++;
+        string name = operand.substr(start, i - start);
+        if (name.size() != 2 || name[0] != 'R' || name[1] < '0' || name[1] > '7')
+            return true;
+    }
+    return false;
+}
+
+// Expand the runtime routine in place of the call; returns false if the regular call is needed
+bool Generator::InlineRuntimeCall(RuntimeSymbol rtsymbol, const string& comment)
+{
+    auto itspec = m_inlinespecs.find(rtsymbol);
+    if (itspec == m_inlinespecs.end())
+        return false;
+    const GeneratorInlineSpec& spec = itspec->second;
+
+    const int callsize = 4;  // CALL with the address word
+    int extrasize = spec.size - callsize;
+    if (extrasize > 0)  // The code grows, so inline only in loops and within the budget; with the profile, on hot lines only
+    {
+        bool hotplace = m_line->hot || (m_loopdepth > 0 && m_line->runcount < 0);
+        if (!hotplace || spec.size > m_inlinemaxsize || extrasize > m_inlinebudget)
+            return false;
+        m_inlinebudget -= extrasize;
+    }
+
+    std::vector<AsmLineModel> body;
+    std::map<string, string> locals;  // Local labels of the routine => new local labels
+    for (const string& line : spec.lines)
+    {
+        AsmLineModel asmline;
+        asmline.Parse(line);
+        if (!asmline.label.empty())
+            locals[asmline.label] = GetNextLocalLabel();
+        body.push_back(asmline);
+    }
+
+    string inlinecomment = "; " + (comment.empty() ? "" : comment + ", ") + "inline " + GetRuntimeSymbolName(rtsymbol);
+    for (AsmLineModel& asmline : body)
+    {
+        if (!asmline.label.empty())
+            asmline.label = locals[asmline.label];
+        for (string& operand : asmline.operands)
+        {
+            auto itlocal = locals.find(operand);
+            if (itlocal != locals.end())
+                operand = itlocal->second;
+        }
+        asmline.comment = inlinecomment;
+        inlinecomment.clear();
+        AddLine(asmline.Format());
+    }
+
+    for (RuntimeSymbol need : spec.needs)
+        m_runtimeneeds.insert(need);
+    return true;
+}
+
+// Prepare the runtime blocks marked for inlining; a block is used only if it is a plain piece of code
+// with one entry label, local labels inside, no calls, no stack access or other labels, ending with RETURN
+void Generator::SetInlineBlocks(const std::vector<RuntimeBlock>& blocks, int maxsize, int budget)
+{
+    m_inlinemaxsize = maxsize;
+    m_inlinebudget = budget;
+
+    for (const RuntimeBlock& block : blocks)
+    {
+        string entryname = GetRuntimeSymbolName(block.rtsymbol);
+        std::vector<AsmLineModel> body;
+        bool suitable = true;
+        for (const string& line : block.lines)
+        {
+            AsmLineModel asmline;
+            asmline.Parse(line);
+            if (asmline.label == entryname)
+                asmline.label.clear();
+            if (asmline.parsed && asmline.label.empty() && asmline.opcode.empty())
+                continue;  // Comment line
+            if (!asmline.parsed || (!asmline.label.empty() && !AsmLineModel::IsLocalLabel(asmline.label)))
+                suitable = false;
+            asmline.comment.clear();
+            body.push_back(asmline);
+        }
+        if (!suitable || body.empty() || body.back().opcode != "RETURN" || !body.back().label.empty())
+            continue;
+        body.pop_back();
+
+        GeneratorInlineSpec spec;
+        for (const AsmLineModel& asmline : body)
+        {
+            int size = asmline.GetSize();
+            if (size < 0 || asmline.opcode == "RETURN" || asmline.opcode == "RTS" || asmline.opcode == "RTI" ||
+                asmline.opcode == "CALL" || asmline.opcode == "JSR" || asmline.opcode == "JMP")
+                suitable = false;
+            for (const string& operand : asmline.operands)
+            {
+                if (HasSymbolReference(operand))
+                    suitable = false;
+            }
+            spec.lines.push_back(asmline.Format());
+            spec.size += size;
+        }
+        if (!suitable)
+            continue;
+        spec.needs = block.needs;
+        m_inlinespecs[block.rtsymbol] = spec;
+    }
+}
+
 void Generator::ProcessBegin()
 {
     AddLine("START:");
@@ -237,10 +394,10 @@ void Generator::ProcessBegin()
         m_final->AddLine(line);
 }
 
-void Generator::ProcessEnd()
+// Enumerate the prepared lines to format them properly
+void Generator::FormatLines(std::vector<string>& lines)
 {
-    // Enumerate all the prepared lines to format them properly
-    for (string& line : m_final->lines)
+    for (string& line : lines)
     {
         int pos = 0;
         for (size_t i = 0; i < line.size(); i++)
@@ -263,17 +420,49 @@ void Generator::ProcessEnd()
                 pos++;
         }
     }
+}
 
+void Generator::ProcessEnd()
+{
     AddLine("LEND:");
 
+    // Peephole optimizations, then use short branches where the targets are close enough
+    Optimizer optimizer(m_final, &m_linespans);
+    optimizer.RemoveRedundantLoads();
+    std::vector<string> primitives;
+    if (m_threaded && optimizer.ThreadCode(primitives) > 0)
+        m_runtimeneeds.insert(RuntimeTHRD);
+    optimizer.RelaxBranches();
+
+    FormatLines(m_final->lines);
+
+    // Write the profile counters when the program ends
+    if (m_profile)
+    {
+        AddLine("\tCALL\tPDUMP\t\t; write the profile counters");
+        m_runtimeneeds.insert(RuntimePDUMP);
+    }
+
     // Copy termination code from the runtime template
     for (const string& line : *m_termlines)
         m_final->AddLine(line);
 
+    // Primitives of the threaded code, shared by the threaded lines
+    if (!primitives.empty())
+    {
+        FormatLines(primitives);
+        AddComment("Threaded code primitives");
+        for (const string& line : primitives)
+            m_final->AddLine(line);
+    }
+
     GenerateStrings();
 
     GenerateVariables();
 
+    if (m_profile)
+        GenerateProfileTable();
+
     GenerateDataBlock();
 
     GenerateRuntimeNeeds();
@@ -361,12 +550,38 @@ void Generator::GenerateStrings()
 
     for (size_t stno = 0; stno < m_source->conststrings.size(); ++stno)
     {
+        if (m_usedstrings.find((int)stno + 1) == m_usedstrings.end())
+            continue;  // the string is used in removed lines only, or in DATA
         string strdeco = "ST" + std::to_string(stno + 1);
         string& str = m_source->conststrings[stno];
         GenerateConstString(strdeco, str);
     }
 }
 
+// Find the const string label index, and mark the string as used
+int Generator::GetConstStringIndex(const string& str)
+{
+    int index = m_source->GetConstStringIndex(str);
+    if (index == 0 && !str.empty())  // one-char string, not registered in validation
+    {
+        m_source->conststrings.push_back(str);
+        index = (int)m_source->conststrings.size();
+    }
+    m_usedstrings.insert(index);
+    return index;
+}
+
+// Buffer size for the String variable, see Analyzer::InferStringLengths; 0 or -1 if the variable has no buffer
+int Generator::GetStringBufferSize(const string& canoname) const
+{
+    for (const VariableModel& var : m_source->vars)
+    {
+        if (var.name == canoname)
+            return var.strbuffer;
+    }
+    return -1;
+}
+
 void Generator::GenerateVariables()
 {
     if (m_source->vars.empty())
@@ -380,21 +595,143 @@ void Generator::GenerateVariables()
     for (auto it = std::begin(m_source->vars); it != std::end(m_source->vars); ++it)
     {
         string deconame = DecorateVariableName(it->name);
-        //TODO: Calculate number of array elements multiplying all indices
         ValueType vtype = it->GetValueType();
+        if (!it->indices.empty())  // Array, indices are from 0 to the number in DIM
+        {
+            int count = 1;
+            string dims;
+            for (int index : it->indices)
+            {
+                count *= index + 1;
+                dims += (dims.empty() ? "" : ",") + std::to_string(index);
+            }
+            string comment = "\t; " + it->name + "(" + dims + ")";
+            if (vtype == ValueTypeString)  // all elements point to the empty string
+            {
+                AddLine(deconame + ":\t.REPT\t" + std::to_string(count) + "." + comment);
+                AddLine("\t.WORD\tST0");
+                AddLine("\t.ENDR");
+            }
+            else
+                AddLine(deconame + ":\t.BLKW\t" + std::to_string(count * GetArrayElementSize(vtype) / 2) + "." + comment);
+            continue;
+        }
         switch (vtype)
         {
         case ValueTypeInteger:
             AddLine(deconame + ":\t.WORD\t0\t; " + it->name);
             break;
-        case ValueTypeString:
-            AddLine(deconame + ":\t.BLKB\t256.\t; " + it->name);
+        case ValueTypeString:  // address of the string: in the heap, in the buffer, or a const string
+            AddLine(deconame + ":\t.WORD\tST0\t; " + it->name);
+            if (it->strbuffer > 0)  // length byte and the chars
+                AddLine("\t.BLKB\t" + std::to_string((it->strbuffer + 2) & ~1) + ".\t; " + it->name + " buffer, up to " + std::to_string(it->strbuffer) + " chars");
             break;
         default:  // Single
             AddLine(deconame + ":\t.WORD\t0,0\t; " + it->name);
             break;
         }
     }
+
+    // TO and STEP values for FOR loops with Single loop variable
+    for (auto it = std::begin(m_forspecs); it != std::end(m_forspecs); ++it)
+    {
+        string forindex = std::to_string(it->first);
+        if (it->second.totemp)
+            AddLine("FT" + forindex + ":\t.WORD\t0,0\t; FOR TO value");
+        if (it->second.steptemp)
+            AddLine("FS" + forindex + ":\t.WORD\t0,0\t; FOR STEP value");
+    }
+
+    // Temporaries for common subexpressions, shared by all the blocks
+    for (int temp = 1; temp <= m_csetemps; temp++)
+        AddLine("CT" + std::to_string(temp) + ":\t.WORD\t0,0\t; common subexpression");
+
+    // Array element pointers for the loops, if not in registers
+    for (auto it = std::begin(m_pointerwords); it != std::end(m_pointerwords); ++it)
+        AddLine("P" + std::to_string(it->first) + ":\t.WORD\t0\t; pointer to " + it->second);
+}
+
+// Data descriptor types for Integer values besides the value types, see REAI in the runtime
+const int DataTypeIntegerBytes = 3;   // Signed bytes
+const int DataTypeIntegerRepeat = 5;  // The word value repeated
+const int DataTypeIntegerDelta = 6;   // The first value word, then signed byte increments, the first increment is 0
+const size_t DataMaxCount = 8000;     // Max element count for the descriptor
+
+// Numeric DATA element having integer value could be read as Integer, or as Single with the same result
+static bool IsDataElementInteger(const DataElementModel& elem)
+{
+    return elem.vtype != ValueTypeString && elem.dvalue == std::floor(elem.dvalue) &&
+        elem.dvalue >= SHRT_MIN && elem.dvalue <= SHRT_MAX;
+}
+
+static bool IsByteValue(int value)
+{
+    return value >= -128 && value <= 127;
+}
+
+static size_t GetDataRepeatCount(const std::vector<int>& values, size_t index)
+{
+    size_t count = 1;
+    while (index + count < values.size() && values[index + count] == values[index])
+        count++;
+    return count;
+}
+
+static size_t GetDataBytesCount(const std::vector<int>& values, size_t index)
+{
+    size_t count = 0;
+    while (index + count < values.size() && IsByteValue(values[index + count]))
+        count++;
+    return count;
+}
+
+static size_t GetDataDeltaCount(const std::vector<int>& values, size_t index)
+{
+    size_t count = 1;
+    while (index + count < values.size() && IsByteValue(values[index + count] - values[index + count - 1]))
+        count++;
+    return count;
+}
+
+// Split the Integer values into the runs of the descriptor types: repeats of 3 and more values, bytes,
+// byte increments for 4 and more values; the runs stop before the repeats of 8 and more values
+static void SplitDataIntegers(const std::vector<int>& values, std::vector<std::pair<int, size_t> >& runs)
+{
+    size_t index = 0;
+    while (index < values.size())
+    {
+        int type = ValueTypeInteger;
+        size_t count = GetDataRepeatCount(values, index);
+        if (count >= 3)
+            type = DataTypeIntegerRepeat;
+        else if (GetDataBytesCount(values, index) >= 2)
+        {
+            type = DataTypeIntegerBytes;
+            count = 1;
+            while (index + count < values.size() && IsByteValue(values[index + count]) &&
+                   GetDataRepeatCount(values, index + count) < 8)
+                count++;
+        }
+        else if (GetDataDeltaCount(values, index) >= 4)
+        {
+            type = DataTypeIntegerDelta;
+            count = 1;
+            while (index + count < values.size() && IsByteValue(values[index + count] - values[index + count - 1]) &&
+                   GetDataRepeatCount(values, index + count) < 8)
+                count++;
+        }
+        else
+        {
+            count = 1;
+            while (index + count < values.size() &&
+                   GetDataRepeatCount(values, index + count) < 3 && GetDataBytesCount(values, index + count) < 2 &&
+                   GetDataDeltaCount(values, index + count) < 4)
+                count++;
+        }
+        count = std::min(count, DataMaxCount);
+        runs.push_back(std::make_pair(type, count));
+        index += count;
+    }
 }
 
 void Generator::GenerateDataBlock()
@@ -406,80 +743,133 @@ void Generator::GenerateDataBlock()
     AddLine("\t.EVEN");
 
     size_t firstdatacount = 0;
-    ValueType firstdatatype = ValueTypeNone;
-    size_t datacount = 0;
-    for (size_t i = 0; i < m_source->data.size(); i++)
-    {
-        const DataElementModel& dataelem = m_source->data[i];
-        string label;
-
-        if (datacount == 0)
-            AddLine("D" + std::to_string(i) + ":");
-
-        datacount++;
-        if (datacount >= 8000 ||
-            i == m_source->data.size() - 1 ||
-            (m_source->data[i + 1].vtype != dataelem.vtype || m_source->data[i + 1].fixed))
+    int firstdatatype = ValueTypeNone;
+    string firstdatalabel = "D" + std::to_string(m_source->datastart);
+    int firstdatavalue = 0;
+    auto adddescriptor = [&](size_t index, int type, size_t count, const string& comment)
+    {
+        string label = "D" + std::to_string(index);
+        AddLine(label + ":");
+        uint16_t descriptor = (uint16_t)((type << 13) | count);
+        AddLine("\t.WORD\t" + to_string_octal(descriptor) + "\t\t; " + comment + " * " + std::to_string(count));
+        if (firstdatacount == 0 && (int)index >= m_source->datastart)
         {
-            if (firstdatacount == 0)
-            {
-                firstdatacount = datacount;  // for DATACN initialization
-                firstdatatype = dataelem.vtype;  // for DATATY
-            }
-
-            // write data descriptor
-            uint16_t descriptor = (uint16_t)((dataelem.vtype << 13) | datacount);
-            AddLine("\t.WORD\t" + to_string_octal(descriptor) + "\t\t; " + GetValueTypeStr(dataelem.vtype) + " * " + std::to_string(datacount));
-
-            string line;
-            for (size_t k = 0; k < datacount; k++)
+            firstdatacount = count;  // for DATACN initialization
+            firstdatatype = type;  // for DATATY
+            firstdatalabel = label;
+        }
+    };
+
+    size_t first = 0;
+    while (first < m_source->data.size())
+    {
+        // Run of the elements with the same type, up to the first element of DATA line RESTORE points to
+        const DataElementModel& dataelem = m_source->data[first];
+        bool isinteger = IsDataElementInteger(dataelem);
+        size_t end = first + 1;
+        while (end < m_source->data.size() && end - first < DataMaxCount &&
+               (isinteger ? IsDataElementInteger(m_source->data[end]) : m_source->data[end].vtype == dataelem.vtype) &&
+               !(m_source->data[end].fixed && m_source->data[end].srclinenum != m_source->data[end - 1].srclinenum) &&
+               (int)end != m_source->datastart)
+            end++;
+
+        if (isinteger)
+        {
+            std::vector<int> values;
+            for (size_t k = first; k < end; k++)
+                values.push_back((int)m_source->data[k].dvalue);
+            std::vector<std::pair<int, size_t> > runs;
+            SplitDataIntegers(values, runs);
+
+            size_t index = 0;
+            for (const std::pair<int, size_t>& run : runs)
             {
-                const DataElementModel& elem = m_source->data[i + 1 - datacount + k];
-                switch (elem.vtype)
+                int type = run.first;
+                size_t count = run.second;
+                string line;
+                switch (type)
                 {
-                case ValueTypeInteger:
-                    if (line.empty()) line = "\t.WORD\t"; else line += ", ";
-                    line += std::to_string((int)std::floor(elem.dvalue)) + ".";
-                    if (k % 8 == 7)
+                case DataTypeIntegerRepeat:
+                    adddescriptor(first + index, type, count, "Integer repeat");
+                    AddLine("\t.WORD\t" + std::to_string(values[index]) + ".");
+                    break;
+                case DataTypeIntegerBytes:
+                case DataTypeIntegerDelta:
+                    adddescriptor(first + index, type, count, type == DataTypeIntegerBytes ? "Integer bytes" : "Integer delta");
+                    if (type == DataTypeIntegerDelta)
+                    {
+                        AddLine("\t.WORD\t" + std::to_string(values[index]) + ".");
+                        if (firstdatalabel == "D" + std::to_string(first + index))
+                            firstdatavalue = values[index];
+                    }
+                    for (size_t k = 0; k < count; k++)
                     {
-                        AddLine(line);
-                        line.clear();
+                        int value = values[index + k];
+                        if (type == DataTypeIntegerDelta)
+                            value = (k == 0) ? 0 : value - values[index + k - 1];
+                        line += (line.empty() ? "\t.BYTE\t" : ", ") + std::to_string(value) + ".";
+                        if (k % 16 == 15 || k == count - 1)
+                        {
+                            AddLine(line);
+                            line.clear();
+                        }
                     }
+                    AddLine("\t.EVEN");
                     break;
-                case ValueTypeSingle:
-                {
-                    if (line.empty()) line = "\t.WORD\t"; else line += ", ";
-                    uint32_t wvalue = float_to_dec_float((float)elem.dvalue);
-                    line += to_string_octal(wvalue & 0xFFFF) + "," + to_string_octal(wvalue >> 16);
-                    if (k % 4 == 3)
+                default:
+                    adddescriptor(first + index, type, count, "Integer");
+                    for (size_t k = 0; k < count; k++)
                     {
-                        AddLine(line);
-                        line.clear();
+                        line += (line.empty() ? "\t.WORD\t" : ", ") + std::to_string(values[index + k]) + ".";
+                        if (k % 8 == 7 || k == count - 1)
+                        {
+                            AddLine(line);
+                            line.clear();
+                        }
                     }
                     break;
                 }
-                case ValueTypeString:
+                index += count;
+            }
+        }
+        else
+        {
+            size_t datacount = end - first;
+            adddescriptor(first, dataelem.vtype, datacount, GetValueTypeStr(dataelem.vtype));
+
+            string line;
+            for (size_t k = 0; k < datacount; k++)
+            {
+                const DataElementModel& elem = m_source->data[first + k];
+                if (elem.vtype == ValueTypeString)
+                {
                     GenerateConstString("", elem.svalue);
-                    break;
+                    continue;
                 }
-
-                if (!line.empty() && k == datacount - 1)
+                if (line.empty()) line = "\t.WORD\t"; else line += ", ";
+                uint32_t wvalue = float_to_dec_float((float)elem.dvalue);
+                line += to_string_octal(wvalue & 0xFFFF) + "," + to_string_octal(wvalue >> 16);
+                if (k % 4 == 3 || k == datacount - 1)
                 {
                     AddLine(line);
                     line.clear();
                 }
             }
-
-            datacount = 0;
         }
+
+        first = end;
     }
+    if (m_source->datastart == (int)m_source->data.size())  // all taken at compile time
+        AddLine(firstdatalabel + ":");
     AddLine("\t.WORD\t0\t\t; End of DATA");
 
     if (!g_turbo8)
-        AddLine("\t.GLOBL\tDATAPT, DATATY, DATACN");
-    AddLine("DATAPT:\t.WORD\tD0+2\t\t; Data pointer");
-    AddLine("DATATY:\t.WORD\t" + to_string_octal(firstdatatype << 13) + "\t\t; Data type");
+        AddLine("\t.GLOBL\tDATAPT, DATATY, DATACN, DATAVL");
+    string datapt = firstdatalabel + (firstdatatype == DataTypeIntegerDelta ? "+4" : "+2");
+    AddLine("DATAPT:\t.WORD\t" + datapt + "\t\t; Data pointer");
+    AddLine("DATATY:\t.WORD\t" + to_string_octal((uint16_t)(firstdatatype << 13)) + "\t\t; Data type");
     AddLine("DATACN:\t.WORD\t" + std::to_string(firstdatacount) + ".\t\t; Data counter");
+    AddLine("DATAVL:\t.WORD\t" + std::to_string(firstdatavalue) + ".\t\t; Data value for the increments");
 }
 
 void Generator::GenerateRuntimeNeeds()
@@ -507,6 +897,214 @@ void Generator::GenerateRuntimeNeeds()
         AddLine(line);
 }
 
+// Check the profile shows the loop started on the current line is cold: the NEXT line of the loop is cold
+bool Generator::IsColdLoop() const
+{
+    for (size_t i = m_lineindex; i < m_source->lines.size(); i++)
+    {
+        const StatementModel& statement = m_source->lines[i].statement;
+        if (statement.token.keyword != KeywordNEXT)
+            continue;
+        for (const VariableModel& variable : statement.variables)
+        {
+            if (variable.psourceline == m_line)
+                return m_source->lines[i].IsCold();
+        }
+    }
+    return false;
+}
+
+// Table of the profile counters: number of the lines, then for every line: line number, source line number,
+// and two-word counter of the line runs; see PDUMP in the runtime
+void Generator::GenerateProfileTable()
+{
+    AddComment("PROFILE COUNTERS");
+    AddLine("\t.EVEN");
+    if (!g_turbo8)
+        AddLine("\t.GLOBL\tPRFTAB");
+    AddLine("PRFTAB:\t.WORD\t" + std::to_string(m_profilelines.size()) + ".\t\t; number of the lines");
+    for (int lineindex : m_profilelines)
+    {
+        const SourceLineModel& line = m_source->lines[lineindex];
+        AddLine("\t.WORD\t" + std::to_string(line.linenum) + ".," + std::to_string(line.srclinenum) + ".,0,0\t; " +
+                (line.linenum != 0 ? "N" + std::to_string(line.linenum) : "L" + std::to_string(line.srclinenum)));
+    }
+}
+
+// Line-address map for the profile: the counter key, source line number, address of the line code, line text.
+// The address is unknown ('?') after the code of unknown size.
+void Generator::WriteLineMap(std::ostream& out, int loadaddr) const
+{
+    std::map<int, size_t> starts;  // Source line index => index of the first line of its code
+    for (const FinalLineSpan& span : m_linespans)
+        starts[span.lineindex] = span.start;
+
+    out << "; Counter key, source line number, address, line text" << std::endl;
+    std::vector<int> addrs;
+    GetAsmAddresses(m_final->lines, loadaddr, addrs);
+    for (int lineindex : m_profilelines)
+    {
+        const SourceLineModel& line = m_source->lines[lineindex];
+        out << (line.linenum != 0 ? "N" + std::to_string(line.linenum) : "L" + std::to_string(line.srclinenum));
+        out << "\t" << line.srclinenum << "\t";
+        auto it = starts.find(lineindex);
+        int lineaddr = (it == starts.end()) ? -1 : addrs[it->second];
+        if (lineaddr < 0)
+            out << "?";
+        else
+            out << std::oct << std::setw(6) << std::setfill('0') << lineaddr << std::dec << std::setfill(' ');
+        out << "\t" << line.text << std::endl;
+    }
+}
+
+// Write the map of the addresses: BASIC lines, code and data labels, runtime routines, variables.
+// The runtime module is linked right after the main one. Line format: octal address, kind, symbol, BASIC line text.
+// The last line is PEND, the end of the image.
+void Generator::WriteMap(std::ostream& out, int loadaddr) const
+{
+    const std::vector<string>& lines = m_final->lines;
+    const std::vector<string>& runtimelines = m_final->runtimelines;
+    std::vector<int> addrs, rtaddrs;
+    int endaddr = GetAsmAddresses(lines, loadaddr, addrs);
+    int rtendaddr = GetAsmAddresses(runtimelines, (endaddr < 0) ? -1 : (endaddr + 1) & ~1, rtaddrs);
+
+    // Kind of the label: "code" if the next instruction is, "var" for the variables, "data" otherwise
+    auto getlabelkind = [](const std::vector<string>& asmlines, size_t index) -> string
+    {
+        AsmLineModel asmline;
+        asmline.Parse(asmlines[index]);
+        if (asmline.label.compare(0, 3, "VAR") == 0)
+            return "var";
+        for (size_t i = index; i < asmlines.size(); i++)
+        {
+            asmline.Parse(asmlines[i]);
+            if (!asmline.opcode.empty())
+                return (asmline.opcode[0] == '.') ? "data" : "code";
+        }
+        return "data";
+    };
+    auto writeentry = [&out](int addr, const string& kind, const string& symbol, const string& text)
+    {
+        if (addr < 0)
+            out << "?";
+        else
+            out << std::oct << std::setw(6) << std::setfill('0') << addr << std::dec << std::setfill(' ');
+        out << "\t" << kind << "\t" << symbol;
+        if (!text.empty())
+            out << "\t" << text;
+        out << std::endl;
+    };
+
+    out << "; Address, kind, symbol, line text" << std::endl;
+
+    // Main module: the BASIC lines, then the labels after the program end; labels inside the lines are not listed
+    size_t nextspan = 0;
+    bool afterend = false;
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        for (; nextspan < m_linespans.size() && m_linespans[nextspan].start <= i; nextspan++)
+        {
+            const SourceLineModel& line = m_source->lines[m_linespans[nextspan].lineindex];
+            writeentry(addrs[i], "line", line.GetLineNumberLabel(), line.text);
+        }
+        AsmLineModel asmline;
+        asmline.Parse(lines[i]);
+        if (asmline.label.empty())
+            continue;
+        if (asmline.label == "LEND")
+            afterend = true;
+        if (asmline.label == "START" || afterend)
+            writeentry(addrs[i], getlabelkind(lines, i), asmline.label, "");
+    }
+
+    // Runtime module: the routines and data, local labels like "1$" are skipped
+    for (size_t i = 0; i < runtimelines.size(); i++)
+    {
+        AsmLineModel asmline;
+        asmline.Parse(runtimelines[i]);
+        if (asmline.label.empty() || AsmLineModel::IsLocalLabel(asmline.label))
+            continue;
+        writeentry(rtaddrs[i], getlabelkind(runtimelines, i), asmline.label, "");
+    }
+
+    // End of the image, the addresses from here are out of the program
+    writeentry(rtendaddr, "end", "PEND", "");
+}
+
+// Note the code size and the estimated time for every BASIC line in the listing, show the most expensive lines.
+// Should be called when the runtime is generated, to count the routines called.
+void Generator::AnnotateCosts(int topcount)
+{
+    Optimizer optimizer(m_final, &m_linespans);
+    std::vector<FinalLineCost> costs;
+    optimizer.EstimateLineCosts(g_platform, costs);
+
+    // The note goes after the comment with the line text; going from the end, the span starts stay valid
+    std::vector<string>& lines = m_final->lines;
+    for (size_t k = costs.size(); k-- > 0; )
+    {
+        if (costs[k].words == 0)
+            continue;
+        size_t index = m_linespans[k].start;
+        if (index < lines.size() && !lines[index].empty() && lines[index][0] == ';')
+            index++;
+        std::ostringstream note;
+        note << "; " << costs[k].words << (costs[k].words == 1 ? " word" : " words") << ", ~" << costs[k].cycles << " cycles";
+        lines.insert(lines.begin() + index, note.str());
+    }
+    size_t shift = 0;
+    for (size_t k = 0; k < costs.size(); k++)
+    {
+        m_linespans[k].start += shift;
+        if (costs[k].words > 0)
+            shift++;
+    }
+
+    std::vector<size_t> order;
+    for (size_t k = 0; k < costs.size(); k++)
+    {
+        if (costs[k].words > 0)
+            order.push_back(k);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return costs[a].cycles > costs[b].cycles; });
+    if (order.size() > (size_t)topcount)
+        order.resize(topcount);
+    if (order.empty())
+        return;
+    std::cerr << "Most expensive lines, estimated CPU cycles for one run:" << std::endl;
+    for (size_t k : order)
+    {
+        std::cerr << std::setw(8) << costs[k].cycles << " cycles" << std::setw(6) << costs[k].words << " words  "
+                  << m_source->lines[m_linespans[k].lineindex].text << std::endl;
+    }
+}
+
+// Check for "$NATIVE" pragma in the comment: REM $NATIVE, or ' $NATIVE
+static bool HasNativePragma(const string& text)
+{
+    bool quotes = false;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char ch = text[i];
+        if (ch == '\"')
+            quotes = !quotes;
+        if (quotes)
+            continue;
+        size_t pos;
+        if (ch == '\'')
+            pos = i + 1;
+        else if (text.compare(i, 3, "REM") == 0)
+            pos = i + 3;
+        else
+            continue;
+        while (pos < text.size() && text[pos] == ' ')
+            pos++;
+        return text.compare(pos, 7, "$NATIVE") == 0;
+    }
+    return false;
+}
+
 bool Generator::ProcessLine()
 {
     if (m_lineindex == INT_MAX)
@@ -526,19 +1124,52 @@ bool Generator::ProcessLine()
     }
 
     m_line = &(m_source->lines[m_lineindex]);
-    m_local = 0;  // reset local labels counter
+
+    // "REM $NATIVE" alone marks the next line, as a trailing comment it marks its own line; hot lines from the profile
+    // stay in machine code as well
+    bool native = m_nextnative || m_line->hot;
+    bool remline = (m_line->statement.token.keyword == KeywordREM);
+    if (HasNativePragma(m_line->text))
+    {
+        if (remline)
+            m_nextnative = true;
+        else
+            native = true;
+    }
 
     // Skip DATA lines completely, will process them in GenerateDataBlock
     if (m_line->statement.token.keyword == KeywordDATA)
         return true;
+    // Skip lines the control never gets to
+    if (m_line->unreachable)
+        return true;
+
+    if (!remline)
+        m_nextnative = false;
+    m_linespans.push_back({ m_final->lines.size(), m_lineindex, native });
 
     // Show the line text and line number, unless it's a comment line without line number
     if (m_line->linenum != 0 ||
         m_line->statement.token.keyword != KeywordREM)
     {
         AddComment(m_line->text);
-        string linenumlabel = m_line->GetLineNumberLabel() + ":";
-        AddLine(linenumlabel);
+        // Line number label only for jump targets; without the label, the local labels scope continues
+        if (m_line->labeled)
+        {
+            string linenumlabel = m_line->GetLineNumberLabel() + ":";
+            AddLine(linenumlabel);
+            m_local = 0;  // reset local labels counter
+        }
+
+        // Count the line runs, two-word counter to not wrap in long runs
+        if (m_profile)
+        {
+            int offset = 2 + (int)m_profilelines.size() * 8 + 4;
+            m_profilelines.push_back(m_lineindex);
+            AddLine("\tINC\tPRFTAB+" + std::to_string(offset) + ".\t; profile counter");
+            AddLine("\tBNE\t.+6");
+            AddLine("\tINC\tPRFTAB+" + std::to_string(offset + 2) + ".");
+        }
     }
 
     GenerateStatement(m_line->statement);
@@ -566,6 +1197,46 @@ void Generator::Warning(const Token& token, const string& message)
     std::cerr << " - " << message << std::endl;
 }
 
+// Check if the expression allocates temporary strings
+static bool HasStringTemporaries(const ExpressionModel& expr)
+{
+    for (const ExpressionNode& node : expr.nodes)
+    {
+        if (node.constval)
+            continue;
+        if (node.vtype == ValueTypeString && node.token.type == TokenTypeOperation && node.token.text == "+")
+            return true;  // concatenation
+        if (node.token.type == TokenTypeKeyword &&
+            (node.token.keyword == KeywordCHR || node.token.keyword == KeywordSTRING || node.token.keyword == KeywordMID))
+            return true;
+        for (const ExpressionModel& arg : node.args)
+        {
+            if (HasStringTemporaries(arg))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Check if the statement allocates temporary strings, not counting the inner THEN/ELSE statements
+static bool HasStringTemporaries(const StatementModel& statement)
+{
+    for (const ExpressionModel& expr : statement.args)
+    {
+        if (HasStringTemporaries(expr))
+            return true;
+    }
+    for (const VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        for (const ExpressionModel& expr : varexpr.args)
+        {
+            if (HasStringTemporaries(expr))
+                return true;
+        }
+    }
+    return false;
+}
+
 void Generator::GenerateStatement(StatementModel& statement)
 {
     // Find keyword generator implementation
@@ -577,6 +1248,10 @@ void Generator::GenerateStatement(StatementModel& statement)
         return;
     }
 
+    // Temporary strings of the previous statement are not needed anymore
+    if (HasStringTemporaries(statement))
+        AddRuntimeCall(RuntimeSSFR, "free temporary strings");
+
     (this->*methodref)(statement);
 }
 
@@ -594,6 +1269,12 @@ void Generator::GenerateExpression(const ExpressionModel& expr, const Expression
 {
     assert(!expr.IsEmpty());
 
+    if (node.cseid != 0)
+    {
+        GenerateCommonSubexpression(expr, node);
+        return;
+    }
+
     if (node.constval)
     {
         switch (node.vtype)
@@ -611,20 +1292,15 @@ void Generator::GenerateExpression(const ExpressionModel& expr, const Expression
             return;
         }
         case ValueTypeSingle:
-        {
-            float fvalue = static_cast<float>(node.token.dvalue);
-            string comment = "const " + to_string_float(fvalue);
-            uint32_t bits = float_to_dec_float(fvalue);
-            uint16_t wordlo = bits & 0xFFFF;
-            uint16_t wordhi = bits >> 16;
-            AddLine((wordlo == 0 ? "\tCLR\t" : "\tMOV\t#" + to_string_octal(wordlo) + ", ") + "-(SP)\t; " + comment);
-            AddLine((wordhi == 0 ? "\tCLR\t" : "\tMOV\t#" + to_string_octal(wordhi) + ", ") + "-(SP)");
+            GenerateSingleConstPush(static_cast<float>(node.token.dvalue));
             return;
-        }
         case ValueTypeString:
-            AddComment("TODO constval String");
+        {
+            int sindex = GetConstStringIndex(node.GetConstStringValue());
+            AddLine("\tMOV\t#ST" + std::to_string(sindex) + ", R0\t; const string");
             return;
         }
+        }
     }
 
     // Function
@@ -634,6 +1310,13 @@ void Generator::GenerateExpression(const ExpressionModel& expr, const Expression
         return;
     }
 
+    // Array element
+    if (node.token.type == TokenTypeIdentifier && !node.args.empty())
+    {
+        GenerateArrayElement(node);
+        return;
+    }
+
     // Variable
     if (node.token.type == TokenTypeIdentifier)
     {
@@ -690,6 +1373,68 @@ void Generator::GenerateExpression(const ExpressionModel& expr, const Expression
     }
 }
 
+// Calculate the value and save it to the temporary, or take the value saved before
+void Generator::GenerateCommonSubexpression(const ExpressionModel& expr, const ExpressionNode& node)
+{
+    assert(node.csetemp > 0);
+    string temp = "CT" + std::to_string(node.csetemp);
+    if (node.csetemp > m_csetemps)
+        m_csetemps = node.csetemp;
+
+    if (!node.csedef && m_csedefined.find(node.cseid) != m_csedefined.end())
+    {
+        if (node.vtype == ValueTypeSingle)
+        {
+            AddLine("\tMOV\t" + temp + ",   -(SP)\t; common subexpression");  // lower
+            AddLine("\tMOV\t" + temp + "+2, -(SP)");  // higher
+        }
+        else
+            AddLine("\tMOV\t" + temp + ", R0\t; common subexpression");
+        return;
+    }
+
+    // Not saved yet, calculate the value
+    ExpressionNode nodecalc = node;
+    nodecalc.cseid = 0;
+    GenerateExpression(expr, nodecalc);
+    if (!node.csedef)
+        return;
+
+    if (node.vtype == ValueTypeSingle)
+    {
+        AddLine("\tMOV\t2(SP), " + temp + "\t; save common subexpression");  // lower
+        AddLine("\tMOV\t(SP), " + temp + "+2");  // higher
+    }
+    else
+        AddLine("\tMOV\tR0, " + temp + "\t; save common subexpression");
+    m_csedefined.insert(node.cseid);
+}
+
+// Calculate the loop-invariant expressions and save the values to the temporaries
+void Generator::GenerateLoopInvariants(const StatementModel& statement)
+{
+    for (const ExpressionModel& expr : statement.invariants)
+    {
+        const ExpressionNode& node = expr.nodes[expr.root];
+        assert(node.csedef && node.csetemp > 0);
+        string temp = "CT" + std::to_string(node.csetemp);
+        if (node.csetemp > m_csetemps)
+            m_csetemps = node.csetemp;
+
+        ExpressionNode nodecalc = node;
+        nodecalc.cseid = 0;
+        GenerateExpression(expr, nodecalc);
+        if (node.vtype == ValueTypeSingle)
+        {
+            AddLine("\tMOV\t(SP)+, " + temp + "+2\t; save loop invariant");  // higher
+            AddLine("\tMOV\t(SP)+, " + temp);  // lower
+        }
+        else
+            AddLine("\tMOV\tR0, " + temp + "\t; save loop invariant");
+        m_csedefined.insert(node.cseid);
+    }
+}
+
 void Generator::GenerateExprUnaryNot(const ExpressionModel& expr, const ExpressionNode& node)
 {
     assert(node.left == -1);
@@ -785,10 +1530,27 @@ void Generator::GenerateExprFunction(const ExpressionModel& expr, const Expressi
     (this->*methodref)(expr, node);
 }
 
-// Calculate expression and assign the result to variable
-// To use in LET and FOR
+// Push Single constant on stack
+void Generator::GenerateSingleConstPush(float fvalue)
+{
+    string comment = "const " + to_string_float(fvalue);
+    uint32_t bits = float_to_dec_float(fvalue);
+    uint16_t wordlo = bits & 0xFFFF;
+    uint16_t wordhi = bits >> 16;
+    AddLine((wordlo == 0 ? "\tCLR\t" : "\tMOV\t#" + to_string_octal(wordlo) + ", ") + "-(SP)\t; " + comment);
+    AddLine((wordhi == 0 ? "\tCLR\t" : "\tMOV\t#" + to_string_octal(wordhi) + ", ") + "-(SP)");
+}
+
+// Calculate expression and assign the result to variable
+// To use in LET and FOR
 void Generator::GenerateAssignment(VariableExpressionModel& var, ExpressionModel& expr)
 {
+    if (!var.args.empty())
+    {
+        GenerateArrayAssignment(var, expr);
+        return;
+    }
+
     ValueType vtype = var.GetValueType();
     string canoname = var.GetVariableCanonicName();
     string deconame = var.GetVariableDecoratedName();
@@ -822,23 +1584,10 @@ void Generator::GenerateAssignment(VariableExpressionModel& var, ExpressionModel
         }
         if (vtype == ValueTypeString)  // const String
         {
+            // The variable points to the const string, no need to copy it to the heap
             string svalue = expr.GetConstExpressionSValue();
-            if (svalue == "")  // Special case for empty string
-            {
-                AddLine("\tCLR\t" + deconame + "\t; var " + canoname + " assignment");
-                return;
-            }
-            if (svalue.size() == 1)  // Special case for one-char string
-            {
-                //NOTE: Character conversion depends on encoding
-                uint16_t value = (1 << 8) | svalue[0];
-                AddLine("\tMOV\t#" + to_string_octal(value) + ", " + deconame + "\t; var " + canoname + " assignment");
-                return;
-            }
-            int sindex = m_source->GetConstStringIndex(svalue);
-            AddLine("\tMOV\t#ST" + std::to_string(sindex) + ", R0");
-            AddLine("\tMOV\t#" + deconame + ", R1");
-            AddRuntimeCall(RuntimeSTCP, "var " + canoname + " assignment");
+            int sindex = GetConstStringIndex(svalue);
+            AddLine("\tMOV\t#ST" + std::to_string(sindex) + ", " + deconame + "\t; var " + canoname + " assignment");
             return;
         }
     }
@@ -863,7 +1612,7 @@ void Generator::GenerateAssignment(VariableExpressionModel& var, ExpressionModel
     // Convert "A% = A% + N" and "A% = A% - N" assignments into INC/DEC/ADD/SUB
     if (vtype == ValueTypeInteger && root.token.IsBinaryOperation() &&
         (root.token.text == "-" || root.token.text == "+") &&
-        expr.nodes[root.left].token.type == TokenTypeIdentifier &&
+        expr.nodes[root.left].token.type == TokenTypeIdentifier && expr.nodes[root.left].args.empty() &&
         GetCanonicVariableName(expr.nodes[root.left].token.text) == var.name &&
         expr.nodes[root.right].constval &&
         (expr.nodes[root.right].vtype == ValueTypeInteger || expr.nodes[root.right].vtype == ValueTypeSingle))
@@ -894,12 +1643,370 @@ void Generator::GenerateAssignment(VariableExpressionModel& var, ExpressionModel
             AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
         AddLine("\tMOV\tR0, " + deconame + comment);
     }
-    else  // non-const non-variable String
+    else if (GetStringBufferSize(canoname) > 0)  // non-const String with the bounded length
+    {
+        GenerateExpression(expr);  // R0 = string address
+        AddLine("\tMOV\t#" + deconame + "+2, R1");
+        AddRuntimeCall(RuntimeSTCP, "var " + canoname + " assignment");  // copy to the variable buffer
+        AddLine("\tMOV\t#" + deconame + "+2, " + deconame);
+    }
+    else  // non-const String
+    {
+        GenerateExpression(expr);  // R0 = string address
+        AddLine("\tMOV\t#" + deconame + ", R1");
+        AddRuntimeCall(RuntimeSTAS, "var " + canoname + " assignment");  // copy to the heap
+    }
+}
+
+// Operand for the second word of the array element Single value
+static string GetSecondWordOperand(const string& operand)
+{
+    if (operand == "(R0)")
+        return "2(R0)";
+    return operand + "+2";
+}
+
+// Calculate the array index, result is Integer in R0
+void Generator::GenerateArrayIndex(const ExpressionModel& expr)
+{
+    GenerateExpression(expr);
+    if (expr.GetExpressionValueType() == ValueTypeSingle)
+        AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
+}
+
+// Multiply R0 by the const value with shifts, and adds for up to three bits set; R1 keeps the partial sum
+void Generator::GenerateMultiplyByConst(int value)
+{
+    assert(value > 1);
+    int bits = 0;
+    for (int v = value; v != 0; v >>= 1)
+        bits += (v & 1);
+    if (bits > 3)
+    {
+        AddLine("\tMOV\t#" + std::to_string(value) + "., R1");
+        AddRuntimeCall(RuntimeIMUL, "*" + std::to_string(value));  // result in R0
+        return;
+    }
+
+    bool first = true;
+    while (true)
+    {
+        if (value & 1)
+        {
+            if (value == 1)
+            {
+                if (!first)
+                    AddLine("\tADD\tR1, R0");
+                break;
+            }
+            AddLine(first ? "\tMOV\tR0, R1" : "\tADD\tR0, R1");
+            first = false;
+        }
+        value >>= 1;
+        AddLine("\tASL\tR0");
+    }
+}
+
+// Compare the index in the register with the upper bound; negative index is big as unsigned so one compare is enough
+void Generator::GenerateArrayIndexCheck(const string& canoname, int maxindex, const string& reg)
+{
+    string labelok = GetNextLocalLabel();
+    AddLine("\tCMP\t" + reg + ", #" + std::to_string(maxindex) + ".\t; " + canoname + "() index check");
+    AddLine("\tBLOS\t" + labelok);
+    AddRuntimeCall(RuntimeARRE, "index out of bounds");
+    AddLine(labelok + ":");
+}
+
+// All the variable indices of the array element are proven to be within the bounds, so no checks needed
+static bool AreArrayIndicesInBounds(const std::vector<ExpressionModel>& args)
+{
+    for (const ExpressionModel& arg : args)
+    {
+        if (!arg.IsConstExpression() && !arg.nodes[arg.root].inbounds)
+            return false;
+    }
+    return true;
+}
+
+// Calculate the array element address into R0; elements are in row-major order, the last index changes fastest
+void Generator::GenerateArrayElementAddress(const string& canoname, const std::vector<ExpressionModel>& args)
+{
+    const VariableModel* pvar = m_source->GetVariable(canoname);
+    assert(pvar != nullptr && pvar->indices.size() == args.size());
+
+    int constnumber = 0;    // Const part of the element number
+    bool hasnumber = false;  // R0 has the variable part of the element number
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (i > 0)
+        {
+            int dimsize = pvar->indices[i] + 1;
+            constnumber *= dimsize;
+            if (hasnumber)
+                GenerateMultiplyByConst(dimsize);
+        }
+
+        const ExpressionModel& arg = args[i];
+        bool checked = !arg.IsConstExpression() && !arg.nodes[arg.root].inbounds;
+        if (arg.IsConstExpression())
+        {
+            int index = (int)std::floor(arg.GetConstExpressionDValue());
+            if (index < 0 || index > pvar->indices[i])  // const after the constant propagation
+                AddRuntimeCall(RuntimeARRE, "index out of bounds");
+            constnumber += index;
+        }
+        else if (!hasnumber)
+        {
+            GenerateArrayIndex(arg);
+            if (checked)
+                GenerateArrayIndexCheck(canoname, pvar->indices[i], "R0");
+            hasnumber = true;
+        }
+        else if (arg.IsVariableExpression() && arg.GetExpressionValueType() == ValueTypeInteger)
+        {
+            if (!checked)
+                AddLine("\tADD\t" + arg.GetVariableExpressionDecoratedName() + ", R0");
+            else
+            {
+                AddLine("\tMOV\t" + arg.GetVariableExpressionDecoratedName() + ", R1");
+                GenerateArrayIndexCheck(canoname, pvar->indices[i], "R1");
+                AddLine("\tADD\tR1, R0");
+            }
+        }
+        else
+        {
+            AddLine("\tMOV\tR0, -(SP)\t; PUSH R0");
+            GenerateArrayIndex(arg);
+            if (checked)
+                GenerateArrayIndexCheck(canoname, pvar->indices[i], "R0");
+            AddLine("\tADD\t(SP)+, R0");
+        }
+    }
+
+    int elemsize = GetArrayElementSize(pvar->GetValueType());
+    string address = DecorateVariableName(canoname);
+    if (constnumber != 0)
+        address += "+" + std::to_string(constnumber * elemsize) + ".";
+    if (!hasnumber)
+    {
+        AddLine("\tMOV\t#" + address + ", R0\t; " + canoname + "() element address");
+        return;
+    }
+    GenerateMultiplyByConst(elemsize);
+    AddLine("\tADD\t#" + address + ", R0\t; " + canoname + "() element address");
+}
+
+// Key for the array element with the last index like "I%", "I%+1" or "I%-1", and the other indices const or variables;
+// returns false if the element could not have the pointer moving with the loop variable
+static bool GetArrayPointerKey(const string& canoname, const std::vector<ExpressionModel>& args, string& loopvar, string& key)
+{
+    key = canoname + "(";
+    for (size_t i = 0; i + 1 < args.size(); i++)
+    {
+        const ExpressionModel& arg = args[i];
+        if (arg.IsConstExpression())
+            key += std::to_string((int)std::floor(arg.GetConstExpressionDValue()));
+        else if (arg.IsVariableExpression() && arg.nodes[arg.root].cseid == 0)
+            key += GetCanonicVariableName(arg.nodes[arg.root].token.text);
+        else
+            return false;
+        key += ",";
+    }
+
+    const ExpressionModel& last = args.back();
+    const ExpressionNode& root = last.nodes[last.root];
+    if (root.cseid != 0)
+        return false;
+    const ExpressionNode* pvarnode = &root;
+    int offset = 0;
+    if (root.token.IsBinaryOperation() && (root.token.text == "+" || root.token.text == "-") && root.left >= 0 && root.right >= 0)
+    {
+        const ExpressionNode& nodeleft = last.nodes[root.left];
+        const ExpressionNode& noderight = last.nodes[root.right];
+        if (noderight.constval && noderight.vtype != ValueTypeString && noderight.token.dvalue == std::floor(noderight.token.dvalue))
+        {
+            pvarnode = &nodeleft;
+            offset = (int)noderight.token.dvalue;
+            if (root.token.text == "-")
+                offset = -offset;
+        }
+        else if (root.token.text == "+" && nodeleft.constval && nodeleft.vtype != ValueTypeString &&
+                 nodeleft.token.dvalue == std::floor(nodeleft.token.dvalue))
+        {
+            pvarnode = &noderight;
+            offset = (int)nodeleft.token.dvalue;
+        }
+        else
+            return false;
+    }
+    if (pvarnode->token.type != TokenTypeIdentifier || !pvarnode->args.empty() ||
+        pvarnode->vtype != ValueTypeInteger || pvarnode->cseid != 0)
+        return false;
+
+    loopvar = GetCanonicVariableName(pvarnode->token.text);
+    key += loopvar;
+    if (offset > 0)
+        key += "+" + std::to_string(offset);
+    else if (offset < 0)
+        key += std::to_string(offset);
+    key += ")";
+    return true;
+}
+
+// Operand for the first word of the array element, without any code: the element with const indices,
+// or the element with the pointer moving with the loop variable; empty string if the address should be calculated
+string Generator::GetArrayElementOperand(const string& canoname, const std::vector<ExpressionModel>& args) const
+{
+    string loopvar, key;
+    if (!m_pointers.empty() && AreArrayIndicesInBounds(args) && GetArrayPointerKey(canoname, args, loopvar, key))
+    {
+        auto it = m_pointers.find(key);
+        if (it != m_pointers.end())
+            return "@P" + std::to_string(it->second.number);
+    }
+
+    const VariableModel* pvar = m_source->GetVariable(canoname);
+    assert(pvar != nullptr && pvar->indices.size() == args.size());
+    int constnumber = 0;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        if (!args[i].IsConstExpression())
+            return string();
+        int index = (int)std::floor(args[i].GetConstExpressionDValue());
+        if (index < 0 || index > pvar->indices[i])
+            return string();  // the address calculation gives the error
+        constnumber = constnumber * (pvar->indices[i] + 1) + index;
+    }
+    string operand = DecorateVariableName(canoname);
+    if (constnumber != 0)
+        operand += "+" + std::to_string(constnumber * GetArrayElementSize(pvar->GetValueType())) + ".";
+    return operand;
+}
+
+// Get the array element address into the register; R0 is used if the address should be calculated
+void Generator::GenerateArrayElementPointer(const string& canoname, const std::vector<ExpressionModel>& args, const string& reg)
+{
+    string operand = GetArrayElementOperand(canoname, args);
+    if (operand.empty())
+    {
+        GenerateArrayElementAddress(canoname, args);
+        if (reg != "R0")
+            AddLine("\tMOV\tR0, " + reg);
+    }
+    else if (operand[0] == '@')  // pointer
+        AddLine("\tMOV\t" + operand.substr(1) + ", " + reg + "\t; " + canoname + "() element address");
+    else
+        AddLine("\tMOV\t#" + operand + ", " + reg + "\t; " + canoname + "() element address");
+}
+
+// Array element value: Integer value or String address in R0, Single value on stack
+void Generator::GenerateArrayElement(const ExpressionNode& node)
+{
+    string canoname = GetCanonicVariableName(node.token.text);
+    string comment = "\t; " + canoname + "() element";
+
+    string operand = GetArrayElementOperand(canoname, node.args);
+    if (node.vtype != ValueTypeSingle)  // Integer, String
+    {
+        if (operand.empty())
+        {
+            GenerateArrayElementAddress(canoname, node.args);
+            operand = "(R0)";
+        }
+        AddLine("\tMOV\t" + operand + ", R0" + comment);
+        return;
+    }
+
+    if (operand.empty() || operand[0] == '@')
+    {
+        GenerateArrayElementPointer(canoname, node.args, "R0");
+        AddLine("\tMOV\t(R0)+, -(SP)" + comment);  // lower
+        AddLine("\tMOV\t(R0), -(SP)");  // higher
+        return;
+    }
+    AddLine("\tMOV\t" + operand + ", -(SP)" + comment);  // lower
+    AddLine("\tMOV\t" + GetSecondWordOperand(operand) + ", -(SP)");  // higher
+}
+
+void Generator::GenerateArrayAssignment(VariableExpressionModel& var, ExpressionModel& expr)
+{
+    ValueType vtype = var.GetValueType();
+    string canoname = var.GetVariableCanonicName();
+    ValueType exprvtype = expr.GetExpressionValueType();
+    const string comment = "\t; " + canoname + "() assignment";
+
+    string operand = GetArrayElementOperand(canoname, var.args);
+    if (vtype == ValueTypeString)
+    {
+        if (expr.IsConstExpression())  // the element points to the const string
+        {
+            int sindex = GetConstStringIndex(expr.GetConstExpressionSValue());
+            if (operand.empty())
+            {
+                GenerateArrayElementAddress(canoname, var.args);
+                operand = "(R0)";
+            }
+            AddLine("\tMOV\t#ST" + std::to_string(sindex) + ", " + operand + comment);
+            return;
+        }
+        if (operand.empty())  // the address first, heap compaction could move the value calculated
+        {
+            GenerateArrayElementAddress(canoname, var.args);
+            AddLine("\tMOV\tR0, -(SP)\t; PUSH R0");
+            GenerateExpression(expr);  // R0 = string address
+            AddLine("\tMOV\t(SP)+, R1");
+        }
+        else
+        {
+            GenerateExpression(expr);  // R0 = string address
+            GenerateArrayElementPointer(canoname, var.args, "R1");
+        }
+        AddRuntimeCall(RuntimeSTAS, canoname + "() assignment");  // copy to the heap
+        return;
+    }
+
+    if (vtype == ValueTypeSingle)
     {
         GenerateExpression(expr);
-        AddLine("\tMOV\t" + deconame + ", R1");
-        AddRuntimeCall(RuntimeSTCP, "var " + canoname + " assignment");
+        if (exprvtype == ValueTypeInteger)
+            AddRuntimeCall(RuntimeITOF, "to Single");  // result on stack
+        if (operand.empty() || operand[0] == '@')
+        {
+            GenerateArrayElementPointer(canoname, var.args, "R0");
+            operand = "(R0)";
+        }
+        AddLine("\tMOV\t(SP)+, " + GetSecondWordOperand(operand) + comment);  // higher
+        AddLine("\tMOV\t(SP)+, " + operand);  // lower
+        return;
+    }
+
+    // Integer
+    string value;
+    if (expr.IsConstExpression())
+        value = "#" + std::to_string((int)std::floor(expr.GetConstExpressionDValue())) + ".";
+    else if (expr.IsVariableExpression() && exprvtype == ValueTypeInteger)
+        value = expr.GetVariableExpressionDecoratedName();
+    else
+    {
+        GenerateExpression(expr);
+        if (exprvtype == ValueTypeSingle)
+            AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
+        value = "R0";
+        if (operand.empty())
+        {
+            AddLine("\tMOV\tR0, -(SP)\t; PUSH R0");
+            value = "(SP)+";
+        }
     }
+    if (operand.empty())
+    {
+        GenerateArrayElementAddress(canoname, var.args);
+        operand = "(R0)";
+    }
+    if (value == "#0.")
+        AddLine("\tCLR\t" + operand + comment);
+    else
+        AddLine("\tMOV\t" + value + ", " + operand + comment);
 }
 
 void Generator::GenerateIgnoredStatement(StatementModel& statement)
@@ -1038,11 +2145,48 @@ void Generator::GenerateFor(StatementModel& statement)
     assert(expr1.GetExpressionValueType() != ValueTypeString);
 
     assert(statement.forindex != 0);
+    string forindex = std::to_string(statement.forindex);
+
+    // Loop invariants go before the loop, they don't depend on the loop variable
+    GenerateLoopInvariants(statement);
+
+    m_loopdepth++;
 
     assert(statement.ident.type == TokenTypeIdentifier);
     VariableExpressionModel var;
     var.name = statement.ident.text;
     string deconame = var.GetVariableDecoratedName();
+    bool isinteger = (var.GetValueType() == ValueTypeInteger);
+
+    GeneratorForSpec forspec;
+
+    // Down-counting loop: the loop variable is not used in the loop body, it gets the final value after the loop
+    if (IsCounterLoop(statement, forspec.trips, forspec.finalvalue))
+    {
+        forspec.counter = true;
+        forspec.cold = IsColdLoop();  // The registers are left to the hot loops
+        if (m_counterloops < 3 && !forspec.cold)
+            forspec.reg = "R" + std::to_string(5 - m_counterloops);  // R5, R4, R3 are not used in the generated code
+        if (m_threaded && m_counterloops < 2 && !forspec.cold)
+            forspec.reg = "R" + std::to_string(4 - m_counterloops);  // R5 is the threaded code pointer
+        else if (m_threaded)
+            forspec.reg.clear();
+        if (!forspec.cold)
+            m_counterloops++;
+        forspec.initline = m_final->lines.size();
+        m_forspecs[statement.forindex] = forspec;
+
+        //NOTE: the counter could be moved to the register in NEXT statement
+        AddLine("\tMOV\t#" + std::to_string(forspec.trips) + "., " + deconame + "\t; loop counter");
+        AddLine("B" + forindex + ":\t; loop body");
+        return;
+    }
+
+    if (!isinteger)  // Single loop variable
+    {
+        GenerateForSingle(statement, forspec);
+        return;
+    }
 
     // Assign the expression to the loop variable
     GenerateAssignment(var, expr1);
@@ -1059,36 +2203,379 @@ void Generator::GenerateFor(StatementModel& statement)
     {
         //TODO: register variable
         string svalue = expr2.GetVariableExpressionDecoratedName();
-        AddLine("\tMOV\t" + svalue + ", @#<F" + std::to_string(statement.forindex) + "+2>");
+        AddLine("\tMOV\t" + svalue + ", @#<F" + forindex + "+2>");
     }
     else
     {
-        GenerateExpression(expr2);
-        if (expr2.GetExpressionValueType() == ValueTypeSingle)
-            AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
-        AddLine("\tMOV\tR0, @#<F" + std::to_string(statement.forindex) + "+2>");  //  Save "to" value
+        GenerateExpression(expr2);
+        if (expr2.GetExpressionValueType() == ValueTypeSingle)
+            AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
+        AddLine("\tMOV\tR0, @#<F" + forindex + "+2>");  //  Save "to" value
+    }
+
+    // Constant STEP: rotated loop with the condition check at the bottom, in NEXT statement
+    if (isinteger && (statement.args.size() < 3 || statement.args[2].IsConstExpression()))
+    {
+        forspec.rotated = true;
+        m_forspecs[statement.forindex] = forspec;
+
+        // No need to check the condition on entry if we know the loop body runs at least once
+        int stepvalue = statement.args.size() < 3 ? 1 : (int)std::floor(statement.args[2].GetConstExpressionDValue());
+        bool runsonce = false;
+        if (expr1.IsConstExpression() && expr2.IsConstExpression())
+        {
+            int fromvalue = (int)std::floor(expr1.GetConstExpressionDValue());
+            int tovalue = (int)std::floor(expr2.GetConstExpressionDValue());
+            runsonce = stepvalue >= 0 ? fromvalue <= tovalue : fromvalue >= tovalue;
+        }
+        GenerateArrayPointers(statement, forspec);
+        if (!runsonce)
+            AddLine("\tJMP\tF" + forindex + "\t; to loop condition");
+        AddLine("B" + forindex + ":\t; loop body");
+        forspec.bodyline = m_final->lines.size();
+        m_forspecs[statement.forindex] = forspec;
+        return;
+    }
+
+    if (statement.args.size() > 2)  // has STEP expression
+    {
+        ExpressionModel& expr3 = statement.args[2];
+        assert(expr3.GetExpressionValueType() != ValueTypeString);
+        if (expr3.IsConstExpression())
+            ;  //NOTE: const STEP expression will be set in NEXT statement
+        else
+        {
+            // Calculate expression for "step"
+            GenerateExpression(expr3);
+            if (expr3.GetExpressionValueType() == ValueTypeSingle)
+                AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
+            // Save "step" value
+            AddLine("\tMOV\tR0, @#<S" + forindex + "+2>");
+        }
+    }
+
+    AddLine("F" + forindex + ":\tCMP\t" + tovalue + ", " + deconame);
+    AddLine("\tBGE\t.+6\t; to loop body");
+    AddLine("\tJMP\tX" + forindex);  // label after NEXT
+}
+
+// Check if FOR loop could be a down-counting loop: FROM, TO and STEP are constants,
+// the loop variable is not used in the loop body, no jumps into or out of the loop body
+bool Generator::IsCounterLoop(const StatementModel& statement, int& trips, int& finalvalue)
+{
+    if (&statement != &m_line->statement)  // FOR under IF
+        return false;
+
+    const ExpressionModel& expr1 = statement.args[0];
+    const ExpressionModel& expr2 = statement.args[1];
+    if (!expr1.IsConstExpression() || !expr2.IsConstExpression())
+        return false;
+    int stepvalue = 1;
+    if (statement.args.size() > 2)
+    {
+        if (!statement.args[2].IsConstExpression())
+            return false;
+        stepvalue = (int)std::floor(statement.args[2].GetConstExpressionDValue());
+    }
+    int fromvalue = (int)std::floor(expr1.GetConstExpressionDValue());
+    int tovalue = (int)std::floor(expr2.GetConstExpressionDValue());
+    // Single loop variable runs on Integer counter only for integer-valued FROM, TO and STEP
+    VariableModel var;
+    var.name = statement.ident.text;
+    if (var.GetValueType() == ValueTypeSingle &&
+        (fromvalue != expr1.GetConstExpressionDValue() || tovalue != expr2.GetConstExpressionDValue() ||
+         (statement.args.size() > 2 && stepvalue != statement.args[2].GetConstExpressionDValue())))
+        return false;
+    if (stepvalue == 0 || (stepvalue > 0 && tovalue < fromvalue) || (stepvalue < 0 && tovalue > fromvalue))
+        return false;
+    int count = (tovalue - fromvalue) / stepvalue + 1;
+    if (count > 32767)
+        return false;
+
+    // Find NEXT line for the loop, check the loop body
+    string canoname = GetCanonicVariableName(statement.ident.text);
+    int nextindex = -1;
+    for (int i = m_lineindex + 1; i < (int)m_source->lines.size() && nextindex < 0; i++)
+    {
+        const StatementModel& st = m_source->lines[i].statement;
+        if (st.token.keyword == KeywordNEXT)
+        {
+            for (const VariableModel& variable : st.variables)
+            {
+                if (variable.psourceline == m_line)
+                {
+                    nextindex = i;
+                    break;
+                }
+                if (variable.GetVariableCanonicName() == canoname)
+                    return false;
+            }
+            continue;
+        }
+        if (st.IsVariableUsed(canoname) || st.IsControlTransfer())
+            return false;
+    }
+    if (nextindex < 0 || HasJumpsIntoLoop(nextindex))
+        return false;
+
+    trips = count;
+    finalvalue = fromvalue + count * stepvalue;
+    return true;
+}
+
+// Check for jumps into the loop body, from the line after FOR in the current line up to the NEXT line
+bool Generator::HasJumpsIntoLoop(int nextindex) const
+{
+    for (const SourceLineModel& line : m_source->lines)
+    {
+        std::vector<int> linenums;
+        line.statement.GetJumpTargets(linenums);
+        for (int linenum : linenums)
+        {
+            for (int i = m_lineindex + 1; i <= nextindex; i++)
+            {
+                if (m_source->lines[i].linenum == linenum)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Collect the names of the variables assigned in the statement; returns false for CALL, as the machine code could change anything
+static bool CollectAssignedNames(const StatementModel& statement, std::set<string>& names)
+{
+    switch (statement.token.keyword)
+    {
+    case KeywordLET:
+    case KeywordREAD:
+        for (const VariableExpressionModel& varexpr : statement.varexprs)
+            names.insert(varexpr.name);
+        break;
+    case KeywordFOR:
+        names.insert(GetCanonicVariableName(statement.ident.text));
+        break;
+    case KeywordINPUT:
+        for (const VariableModel& variable : statement.variables)
+            names.insert(variable.name);
+        break;
+    case KeywordCALL:
+        return false;
+    default:
+        break;
+    }
+
+    if (statement.stthen != nullptr && !CollectAssignedNames(*statement.stthen, names))
+        return false;
+    if (statement.stelse != nullptr && !CollectAssignedNames(*statement.stelse, names))
+        return false;
+    return true;
+}
+
+typedef std::pair<string, const std::vector<ExpressionModel>*> GeneratorArrayElement;  // Array name and indices
+
+static void CollectArrayElements(const ExpressionModel& expr, std::vector<GeneratorArrayElement>& elements)
+{
+    for (const ExpressionNode& node : expr.nodes)
+    {
+        if (node.token.type == TokenTypeIdentifier && !node.args.empty())
+            elements.push_back(GeneratorArrayElement(GetCanonicVariableName(node.token.text), &node.args));
+        for (const ExpressionModel& arg : node.args)
+            CollectArrayElements(arg, elements);
+    }
+}
+
+static void CollectArrayElements(const StatementModel& statement, std::vector<GeneratorArrayElement>& elements)
+{
+    for (const ExpressionModel& expr : statement.args)
+        CollectArrayElements(expr, elements);
+    for (const VariableExpressionModel& varexpr : statement.varexprs)
+    {
+        if (!varexpr.args.empty())
+            elements.push_back(GeneratorArrayElement(varexpr.name, &varexpr.args));
+        for (const ExpressionModel& arg : varexpr.args)
+            CollectArrayElements(arg, elements);
+    }
+    if (statement.stthen != nullptr)
+        CollectArrayElements(*statement.stthen, elements);
+    if (statement.stelse != nullptr)
+        CollectArrayElements(*statement.stelse, elements);
+}
+
+// Array elements indexed by the loop variable get the pointers: the pointer is set before the loop and moves
+// to the next element in NEXT, so the access in the loop body takes the value by the pointer instead of
+// calculating the address. Only for the loop body without jumps and not changing the loop variable, and for
+// the elements with the indices proven to be within the bounds, as the pointer has no index checks.
+void Generator::GenerateArrayPointers(const StatementModel& statement, GeneratorForSpec& forspec)
+{
+    if (&statement != &m_line->statement)  // FOR under IF
+        return;
+
+    string canoname = GetCanonicVariableName(statement.ident.text);
+    int stepvalue = statement.args.size() < 3 ? 1 : (int)std::floor(statement.args[2].GetConstExpressionDValue());
+
+    // Find NEXT line for the loop, check the loop body
+    std::set<string> assigned;
+    std::vector<GeneratorArrayElement> elements;
+    int nextindex = -1;
+    for (int i = m_lineindex + 1; i < (int)m_source->lines.size() && nextindex < 0; i++)
+    {
+        const StatementModel& st = m_source->lines[i].statement;
+        if (st.token.keyword == KeywordNEXT)
+        {
+            for (const VariableModel& variable : st.variables)
+            {
+                if (variable.psourceline == m_line)
+                {
+                    nextindex = i;
+                    break;
+                }
+                if (variable.GetVariableCanonicName() == canoname)
+                    return;
+            }
+            continue;
+        }
+        if (st.IsControlTransfer() || !CollectAssignedNames(st, assigned))
+            return;
+        CollectArrayElements(st, elements);
+    }
+    if (nextindex < 0 || assigned.find(canoname) != assigned.end() || HasJumpsIntoLoop(nextindex))
+        return;
+
+    forspec.pointerline = m_final->lines.size();
+    for (const GeneratorArrayElement& element : elements)
+    {
+        string loopvar, key;
+        if (!AreArrayIndicesInBounds(*element.second) ||
+            !GetArrayPointerKey(element.first, *element.second, loopvar, key) || loopvar != canoname)
+            continue;
+        if (m_pointers.find(key) != m_pointers.end())
+            continue;  // already have the pointer
+        bool invariant = true;  // Other indices do not change in the loop
+        for (size_t i = 0; i + 1 < element.second->size(); i++)
+        {
+            const ExpressionModel& arg = (*element.second)[i];
+            if (arg.IsVariableExpression() && (arg.IsVariableUsed(canoname) ||
+                assigned.find(GetCanonicVariableName(arg.nodes[arg.root].token.text)) != assigned.end()))
+                invariant = false;
+        }
+        if (!invariant)
+            continue;
+
+        GeneratorPointerSpec pointer;
+        pointer.number = ++m_pointercount;
+        pointer.elemsize = GetArrayElementSize(m_source->GetVariable(element.first)->GetValueType());
+        pointer.stride = stepvalue * pointer.elemsize;
+        pointer.key = key;
+
+        GenerateArrayElementAddress(element.first, *element.second);
+        AddLine("\tMOV\tR0, P" + std::to_string(pointer.number) + "\t; pointer to " + key);
+
+        m_pointers[key] = pointer;
+        forspec.pointers.push_back(key);
+    }
+}
+
+// Replace the symbol in the code part of the assembly line, not touching the longer names
+static string ReplaceSymbol(const string& line, const string& symbol, const string& replacement)
+{
+    size_t end = line.find(';');
+    if (end == string::npos)
+        end = line.length();
+    string result;
+    size_t pos = 0;
+    while (true)
+    {
+        size_t found = line.find(symbol, pos);
+        if (found == string::npos || found >= end)
+            break;
+        size_t after = found + symbol.length();
+        bool before = (found > 0 && (isalnum(line[found - 1]) || line[found - 1] == '$'));
+        bool follow = (after < line.length() && (isalnum(line[after]) || line[after] == '$'));
+        result += line.substr(pos, found - pos);
+        result += (before || follow) ? symbol : replacement;
+        pos = after;
+    }
+    return result + line.substr(pos);
+}
+
+// Move the array element pointers of the loop to the next elements; the pointer goes to the register
+// if the loop body has no calls and does not use the register. The only access in the loop body without
+// branches becomes the autoincrement, like MOV (R3)+, R0.
+void Generator::GenerateArrayPointersNext(GeneratorForSpec& forspec)
+{
+    if (forspec.pointers.empty())
+        return;
+
+    bool hascalls = false;
+    bool hasbranches = false;
+    std::set<string> usedregs;
+    if (m_threaded)
+        usedregs.insert("R5");  // the threaded code pointer
+    for (size_t i = forspec.pointerline; i < m_final->lines.size(); i++)
+    {
+        AsmLineModel asmline;
+        asmline.Parse(m_final->lines[i]);
+        if (asmline.opcode == "CALL" || asmline.opcode == "JSR" || asmline.opcode == "EMT" || asmline.opcode == "TRAP")
+            hascalls = true;
+        if (i >= forspec.bodyline && !asmline.opcode.empty() &&
+            ((asmline.opcode[0] == 'B' && asmline.opcode.compare(0, 2, "BI") != 0) ||  // not BIC, BIS, BIT
+             asmline.opcode == "JMP" || asmline.opcode == "SOB"))
+            hasbranches = true;
+        for (const string& operand : asmline.operands)
+        {
+            for (const char* reg : { "R3", "R4", "R5" })
+            {
+                size_t pos = operand.find(reg);
+                if (pos != string::npos && (pos == 0 || !isalnum(operand[pos - 1])))
+                    usedregs.insert(reg);
+            }
+        }
     }
 
-    if (statement.args.size() > 2)  // has STEP expression
+    for (const string& key : forspec.pointers)
     {
-        ExpressionModel& expr3 = statement.args[2];
-        assert(expr3.GetExpressionValueType() != ValueTypeString);
-        if (expr3.IsConstExpression())
-            ;  //NOTE: const STEP expression will be set in NEXT statement
-        else
+        GeneratorPointerSpec pointer = m_pointers[key];
+        m_pointers.erase(key);
+        string symbol = "P" + std::to_string(pointer.number);
+        string comment = "\t; " + key + " next";
+
+        string reg;
+        if (!hascalls)
         {
-            // Calculate expression for "step"
-            GenerateExpression(expr3);
-            if (expr3.GetExpressionValueType() == ValueTypeSingle)
-                AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
-            // Save "step" value
-            AddLine("\tMOV\tR0, @#<S" + std::to_string(statement.forindex) + "+2>");
+            for (const char* r : { "R3", "R4", "R5" })
+            {
+                if (usedregs.find(r) == usedregs.end())
+                {
+                    reg = r;
+                    break;
+                }
+            }
         }
-    }
+        if (reg.empty())  // pointer stays in memory
+        {
+            m_pointerwords[pointer.number] = key;
+            AddLine("\tADD\t#" + std::to_string(pointer.stride) + "., " + symbol + comment);
+            continue;
+        }
+        usedregs.insert(reg);
 
-    AddLine("F" + std::to_string(statement.forindex) + ":\tCMP\t" + tovalue + ", " + deconame);
-    AddLine("\tBGE\t.+6\t; to loop body");
-    AddLine("\tJMP\tX" + std::to_string(statement.forindex));  // label after NEXT
+        int accesses = 0;
+        for (size_t i = forspec.bodyline; i < m_final->lines.size(); i++)
+        {
+            if (ReplaceSymbol(m_final->lines[i], symbol, "") != m_final->lines[i])
+                accesses++;
+        }
+        bool autoincrement = (accesses == 1 && !hasbranches && pointer.elemsize == 2 && pointer.stride == 2);
+        for (size_t i = forspec.pointerline; i < m_final->lines.size(); i++)
+        {
+            string& line = m_final->lines[i];
+            line = ReplaceSymbol(line, "@" + symbol, autoincrement ? "(" + reg + ")+" : "(" + reg + ")");
+            line = ReplaceSymbol(line, symbol, reg);
+        }
+        if (!autoincrement)
+            AddLine("\tADD\t#" + std::to_string(pointer.stride) + "., " + reg + comment);
+    }
 }
 
 // NEXT [<ПАРАМЕТР>[,< ПАРАМЕТР >...]]
@@ -1102,13 +2589,109 @@ void Generator::GenerateNext(StatementModel& statement)
         assert(plinefor != nullptr);
         StatementModel& forstatement = plinefor->statement;
         assert(forstatement.forindex != 0);
+        string forindex = std::to_string(forstatement.forindex);
 
         string canoname = variable.GetVariableCanonicName();
         string deconame = DecorateVariableName(canoname);
         string comment = "NEXT " + canoname;
 
+        if (m_loopdepth > 0)
+            m_loopdepth--;
+
+        GeneratorForSpec forspec;
+        auto itforspec = m_forspecs.find(forstatement.forindex);
+        if (itforspec != m_forspecs.end())
+            forspec = itforspec->second;
+
+        if (forspec.counter)  // Down-counting loop
+        {
+            if (!forspec.cold)
+                m_counterloops--;
+
+            // The counter could be in the register if the loop body has no calls and does not use the register
+            bool inregister = !forspec.reg.empty();
+            int bodysize = 0;
+            for (size_t i = forspec.initline + 2; i < m_final->lines.size(); i++)
+            {
+                AsmLineModel asmline;
+                asmline.Parse(m_final->lines[i]);
+                int size = asmline.GetSize();
+                bodysize = (size < 0 || bodysize < 0) ? -1 : bodysize + size;
+                if (asmline.opcode == "CALL" || asmline.opcode == "JSR" || asmline.opcode == "EMT" || asmline.opcode == "TRAP")
+                    inregister = false;
+                for (const string& operand : asmline.operands)
+                {
+                    size_t pos = operand.find(forspec.reg);
+                    if (pos != string::npos && (pos == 0 || !isalnum(operand[pos - 1])))
+                        inregister = false;
+                }
+            }
+
+            if (inregister)
+            {
+                m_final->lines[forspec.initline] = "\tMOV\t#" + std::to_string(forspec.trips) + "., " + forspec.reg + "\t; loop counter";
+                if (bodysize >= 0 && bodysize <= 124)  // SOB offset is up to 63 words back
+                    AddLine("\tSOB\t" + forspec.reg + ", B" + forindex + "\t; " + comment);
+                else
+                {
+                    AddLine("\tDEC\t" + forspec.reg + "\t; " + comment);
+                    AddLine("\tBNE\tB" + forindex);
+                }
+            }
+            else
+            {
+                AddLine("\tDEC\t" + deconame + "\t; " + comment);
+                AddLine("\tBNE\tB" + forindex);
+            }
+
+            // Value of the loop variable after the loop
+            if (variable.GetValueType() == ValueTypeSingle)
+            {
+                uint32_t bits = float_to_dec_float(static_cast<float>(forspec.finalvalue));
+                uint16_t wordlo = bits & 0xFFFF;
+                uint16_t wordhi = bits >> 16;
+                AddLine((wordlo == 0 ? "\tCLR\t" : "\tMOV\t#" + to_string_octal(wordlo) + ", ") + deconame + "\t; " + canoname + " after the loop");
+                AddLine((wordhi == 0 ? "\tCLR\t" : "\tMOV\t#" + to_string_octal(wordhi) + ", ") + deconame + "+2");
+            }
+            else if ((int16_t)forspec.finalvalue == 0)
+                AddLine("\tCLR\t" + deconame + "\t; " + canoname + " after the loop");
+            else
+                AddLine("\tMOV\t#" + std::to_string((int16_t)forspec.finalvalue) + "., " + deconame + "\t; " + canoname + " after the loop");
+            AddLine("X" + forindex + ":\t; FOR exit addr");
+            continue;
+        }
+
+        if (forspec.single)  // Single loop variable
+        {
+            GenerateNextSingle(forstatement, forspec);
+            continue;
+        }
+
+        if (forspec.rotated)  // Loop with the condition at the bottom
+        {
+            GenerateArrayPointersNext(forspec);
+            int stepvalue = 1;
+            if (forstatement.args.size() > 2)
+                stepvalue = (int)std::floor(forstatement.args[2].GetConstExpressionDValue());
+            if (stepvalue == 1)
+                AddLine("\tINC\t" + deconame + "\t; " + comment);
+            else if (stepvalue == -1)
+                AddLine("\tDEC\t" + deconame + "\t; " + comment);
+            else
+                AddLine("\tADD\t#" + std::to_string(stepvalue) + "., " + deconame + "\t; " + comment);
+
+            //NOTE: "#0" here will be replaced at run-time with calculated TO value
+            string tovalue = "#0";
+            ExpressionModel& forexpr2 = forstatement.args[1];
+            if (forexpr2.IsConstExpression())
+                tovalue = "#" + std::to_string((int)std::floor(forexpr2.GetConstExpressionDValue())) + ".";
+            AddLine("F" + forindex + ":\tCMP\t" + tovalue + ", " + deconame);
+            AddLine((stepvalue >= 0 ? "\tBGE\tB" : "\tBLE\tB") + forindex + "\t; continue loop");
+            AddLine("X" + forindex + ":\t; FOR exit addr");
+            continue;
+        }
+
         // Increment FOR variable by 1 or by STEP value
-        //TODO: Single variable increment or STEP
         if (forstatement.args.size() < 3)
             AddLine("\tINC\t" + deconame + "\t; " + comment);
         else
@@ -1123,15 +2706,149 @@ void Generator::GenerateNext(StatementModel& statement)
             else
             {
                 //NOTE: "#1" here will be replaced at run-time with calculated STEP value
-                AddLine("S" + std::to_string(forstatement.forindex) + ":\tADD\t#1, " + deconame + "\t; " + comment);
+                AddLine("S" + forindex + ":\tADD\t#1, " + deconame + "\t; " + comment);
             }
         }
 
         // JMP to continue loop
-        AddLine("\tJMP\tF" + std::to_string(forstatement.forindex) + "\t; continue loop");
+        AddLine("\tJMP\tF" + forindex + "\t; continue loop");
         // Label after NEXT
-        AddLine("X" + std::to_string(forstatement.forindex) + ":\t; FOR exit addr");
+        AddLine("X" + forindex + ":\t; FOR exit addr");
+    }
+}
+
+// FOR with Single loop variable; TO and STEP values are calculated once and kept in FTn/FSn unless constant
+void Generator::GenerateForSingle(StatementModel& statement, GeneratorForSpec& forspec)
+{
+    string forindex = std::to_string(statement.forindex);
+
+    VariableExpressionModel var;
+    var.name = statement.ident.text;
+    ExpressionModel& expr1 = statement.args[0];
+    GenerateAssignment(var, expr1);
+
+    forspec.rotated = true;
+    forspec.single = true;
+
+    ExpressionModel& expr2 = statement.args[1];
+    if (!expr2.IsConstExpression())
+    {
+        forspec.totemp = true;
+        GenerateForSingleValue(expr2, "FT" + forindex, "save TO value");
+    }
+
+    bool stepconst = true;
+    double stepvalue = 1.0;
+    if (statement.args.size() > 2)  // has STEP expression
+    {
+        ExpressionModel& expr3 = statement.args[2];
+        if (expr3.IsConstExpression())
+            stepvalue = expr3.GetConstExpressionDValue();
+        else
+        {
+            stepconst = false;
+            forspec.steptemp = true;
+            GenerateForSingleValue(expr3, "FS" + forindex, "save STEP value");
+        }
+    }
+
+    m_forspecs[statement.forindex] = forspec;
+
+    // No need to check the condition on entry if we know the loop body runs at least once
+    bool runsonce = false;
+    if (expr1.IsConstExpression() && expr2.IsConstExpression() && stepconst)
+    {
+        double fromvalue = expr1.GetConstExpressionDValue();
+        double tovalue = expr2.GetConstExpressionDValue();
+        runsonce = stepvalue >= 0 ? fromvalue <= tovalue : fromvalue >= tovalue;
+    }
+    if (!runsonce)
+        AddLine("\tJMP\tF" + forindex + "\t; to loop condition");
+    AddLine("B" + forindex + ":\t; loop body");
+}
+
+// Calculate TO or STEP value for FOR with Single loop variable, and save it in the temporary
+void Generator::GenerateForSingleValue(ExpressionModel& expr, const string& temp, const string& comment)
+{
+    if (expr.IsVariableExpression() && expr.GetExpressionValueType() == ValueTypeSingle)
+    {
+        string svalue = expr.GetVariableExpressionDecoratedName();
+        AddLine("\tMOV\t" + svalue + ", " + temp + "\t; " + comment);
+        AddLine("\tMOV\t" + svalue + "+2, " + temp + "+2");
+        return;
+    }
+    GenerateExpression(expr);
+    if (expr.GetExpressionValueType() == ValueTypeInteger)
+        AddRuntimeCall(RuntimeITOF, "to Single");  // result on stack
+    AddLine("\tMOV\t(SP)+, " + temp + "+2\t; " + comment);
+    AddLine("\tMOV\t(SP)+, " + temp);
+}
+
+// NEXT for Single loop variable: add STEP to the variable, then compare with TO value
+void Generator::GenerateNextSingle(const StatementModel& forstatement, const GeneratorForSpec& forspec)
+{
+    string forindex = std::to_string(forstatement.forindex);
+    string canoname = GetCanonicVariableName(forstatement.ident.text);
+    string deconame = DecorateVariableName(canoname);
+
+    double stepvalue = 1.0;
+    if (forstatement.args.size() > 2 && !forspec.steptemp)
+        stepvalue = forstatement.args[2].GetConstExpressionDValue();
+
+    // Increment the loop variable by STEP value
+    AddLine("\tMOV\t" + deconame + ",   -(SP)\t; NEXT " + canoname);
+    AddLine("\tMOV\t" + deconame + "+2, -(SP)");
+    if (forspec.steptemp)
+    {
+        AddLine("\tMOV\tFS" + forindex + ",   -(SP)\t; STEP value");
+        AddLine("\tMOV\tFS" + forindex + "+2, -(SP)");
+    }
+    else
+        GenerateSingleConstPush(static_cast<float>(stepvalue));
+    AddRuntimeCall(RuntimeFADD, "add STEP");  // result on stack
+    AddLine("\tMOV\t(SP)+, " + deconame + "+2");
+    AddLine("\tMOV\t(SP)+, " + deconame);
+
+    // Compare the loop variable with TO value; for negative STEP, compare in reverse order
+    string labelreverse, labelcompare;
+    if (forspec.steptemp)
+    {
+        labelreverse = GetNextLocalLabel();
+        labelcompare = GetNextLocalLabel();
+        AddLine("F" + forindex + ":\tTST\tFS" + forindex + "+2\t; STEP sign");
+        AddLine("\tBMI\t" + labelreverse);
+    }
+    else
+        AddLine("F" + forindex + ":\t; loop condition");
+    for (int pass = 0; pass < (forspec.steptemp ? 2 : 1); pass++)
+    {
+        bool reverse = (pass == 1) || (!forspec.steptemp && stepvalue < 0);
+        if (pass == 1)
+            AddLine(labelreverse + ":");
+        for (int arg = 0; arg < 2; arg++)
+        {
+            if ((arg == 0) != reverse)  // the loop variable
+            {
+                AddLine("\tMOV\t" + deconame + ",   -(SP)\t; var " + canoname);
+                AddLine("\tMOV\t" + deconame + "+2, -(SP)");
+            }
+            else if (forspec.totemp)  // TO value
+            {
+                AddLine("\tMOV\tFT" + forindex + ",   -(SP)\t; TO value");
+                AddLine("\tMOV\tFT" + forindex + "+2, -(SP)");
+            }
+            else
+                GenerateSingleConstPush(static_cast<float>(forstatement.args[1].GetConstExpressionDValue()));
+        }
+        if (pass == 0 && forspec.steptemp)
+            AddLine("\tBR\t" + labelcompare);
     }
+    if (forspec.steptemp)
+        AddLine(labelcompare + ":");
+    AddRuntimeCall(RuntimeFCMP, "compare floats");  // result in flags
+    AddLine("\tBLE\tB" + forindex + "\t; continue loop");
+
+    AddLine("X" + forindex + ":\t; FOR exit addr");
 }
 
 void Generator::GenerateGosub(StatementModel& statement)
@@ -1214,11 +2931,7 @@ void Generator::GenerateIf(StatementModel& statement)
     string labelelse = GetNextLocalLabel();  // local label for ELSE branch
     string labelend = GetNextLocalLabel();  // local label for end of IF statement address
 
-    GenerateExpression(expr);
-    if (expr.GetExpressionValueType() == ValueTypeSingle)
-        AddLine("\tTST\t(SP)");  // check float value high word for 0
-    // set flags: Z=0 for TRUE, Z=1 for FALSE
-    AddLine("\tBEQ\t" + (haveelse ? labelelse : labelend));
+    GenerateConditionJump(expr, expr.nodes[expr.root], false, haveelse ? labelelse : labelend);
     AddComment("THEN");
 
     if (statement.stthen == nullptr)  // no THEN statement, so it's THEN linenum
@@ -1255,12 +2968,74 @@ void Generator::GenerateIf(StatementModel& statement)
     AddLine(labelend + ":\t; end IF");
 }
 
+// Calculate the condition and jump to the label if the condition is TRUE (jumpiftrue) or FALSE (!jumpiftrue)
+void Generator::GenerateConditionJump(const ExpressionModel& expr, const ExpressionNode& node, bool jumpiftrue, const string& label)
+{
+    // Boolean AND/OR: short-circuit evaluation, the right part is skipped when the result is known from the left part
+    if (node.token.type == TokenTypeOperation && node.left >= 0 && node.right >= 0 &&
+        (node.token.text == "AND" || node.token.text == "OR") &&
+        expr.IsBooleanNode(node) && !expr.IsSideEffectNode(expr.nodes[node.right]))
+    {
+        const ExpressionNode& nodeleft = expr.nodes[node.left];
+        const ExpressionNode& noderight = expr.nodes[node.right];
+        bool isand = (node.token.text == "AND");
+        if (isand != jumpiftrue)  // AND jumps on FALSE, OR jumps on TRUE: both parts jump to the label
+        {
+            GenerateConditionJump(expr, nodeleft, jumpiftrue, label);
+            GenerateConditionJump(expr, noderight, jumpiftrue, label);
+        }
+        else  // the left part decides to skip the right part
+        {
+            string labelskip = GetNextLocalLabel();
+            GenerateConditionJump(expr, nodeleft, !jumpiftrue, labelskip);
+            GenerateConditionJump(expr, noderight, jumpiftrue, label);
+            AddLine(labelskip + ":\t; Operation \'" + node.token.text + "\' skip");
+        }
+        return;
+    }
+    // Boolean NOT: jump on the inverted condition
+    if (node.token.type == TokenTypeOperation && node.left == -1 && node.right >= 0 &&
+        node.token.keyword == KeywordNOT && expr.IsBooleanNode(node))
+    {
+        GenerateConditionJump(expr, expr.nodes[node.right], !jumpiftrue, label);
+        return;
+    }
+
+    // Relational operation: compare and branch, no need for -1/0 value in R0
+    if (node.token.type == TokenTypeOperation && node.left >= 0 && node.right >= 0)
+    {
+        const ExpressionNode& nodeleft = expr.nodes[node.left];
+        const ExpressionNode& noderight = expr.nodes[node.right];
+        if (((nodeleft.vtype == ValueTypeInteger || nodeleft.vtype == ValueTypeSingle) &&
+             (noderight.vtype == ValueTypeInteger || noderight.vtype == ValueTypeSingle)) ||
+            (nodeleft.vtype == ValueTypeString && noderight.vtype == ValueTypeString))
+        {
+            for (auto it = std::begin(g_relationspecs); it != std::end(g_relationspecs); ++it)
+            {
+                if (node.token.text != it->text)
+                    continue;
+
+                GenerateLogicOperArguments(expr, nodeleft, noderight);  // set flags
+                string branch = jumpiftrue ? it->branch : it->invbranch;
+                AddLine("\t" + branch + "\t" + label + "\t; Operation \'" + node.token.text + "\'");
+                return;
+            }
+        }
+    }
+
+    GenerateExpression(expr, node);
+    if (node.vtype == ValueTypeSingle)
+        AddLine("\tTST\t(SP)");  // check float value high word for 0
+    // set flags: Z=0 for TRUE, Z=1 for FALSE
+    AddLine((jumpiftrue ? "\tBNE\t" : "\tBEQ\t") + label);
+}
+
 void Generator::GenerateInput(StatementModel& statement)
 {
     if (statement.params.size() > 0)  // Write the const string prompt
     {
         Token& param = statement.params[0];
-        int strindex = m_source->GetConstStringIndex(param.text);
+        int strindex = GetConstStringIndex(param.text);
         string strdeco = "#ST" + std::to_string(strindex);
         AddLine("\tMOV\t" + strdeco + ", R0");
         AddRuntimeCall(RuntimeWRST, "PRINT the prompt");
@@ -1800,7 +3575,7 @@ void Generator::GeneratePrintString(const ExpressionModel& expr)
             return;
         }
 
-        int sindex = m_source->GetConstStringIndex(svalue);
+        int sindex = GetConstStringIndex(svalue);
         if (sindex < 0)
         {
             Error("Failed to find index for const string \"" + svalue + "\".");
@@ -1813,22 +3588,29 @@ void Generator::GeneratePrintString(const ExpressionModel& expr)
     }
 
     // Variable
-    if (root.token.type == TokenTypeIdentifier)
+    if (root.token.type == TokenTypeIdentifier && root.args.empty())
     {
         string deconame = DecorateVariableName(GetCanonicVariableName(root.token.text));
-        AddLine("\tMOV\t#" + deconame + ", R0");
+        AddLine("\tMOV\t" + deconame + ", R0");
         AddRuntimeCall(RuntimeWRST, "PRINT string");
         return;
     }
 
-    //TODO
-    AddComment("TODO PRINT string expression");
+    GenerateExpression(expr);  // R0 = string address
+    AddRuntimeCall(RuntimeWRST, "PRINT string");
 }
 
 void Generator::GenerateRead(StatementModel& statement)
 {
     assert(!statement.varexprs.empty());
 
+    if (statement.args.size() == statement.varexprs.size())  // values taken at compile time
+    {
+        for (size_t i = 0; i < statement.varexprs.size(); i++)
+            GenerateAssignment(statement.varexprs[i], statement.args[i]);
+        return;
+    }
+
     if (m_source->data.empty())
     {
         Error("READ statement without any DATA to read.");
@@ -1837,20 +3619,22 @@ void Generator::GenerateRead(StatementModel& statement)
 
     for (const VariableExpressionModel& varexpr : statement.varexprs)
     {
-        string deconame = varexpr.GetVariableDecoratedName();
+        // R0 = address of the variable or of the array element
+        if (varexpr.args.empty())
+            AddLine("\tMOV\t#" + varexpr.GetVariableDecoratedName() + ", R0");
+        else
+            GenerateArrayElementPointer(varexpr.name, varexpr.args, "R0");
+
         ValueType vtype = varexpr.GetValueType();
         switch (vtype)
         {
         case ValueTypeInteger:
-            AddLine("\tMOV\t#" + deconame + ", R0");
             AddRuntimeCall(RuntimeREAI, "READ Integer");  // result in R0
             break;
         case ValueTypeSingle:
-            AddLine("\tMOV\t#" + deconame + ", R0");
             AddRuntimeCall(RuntimeREAF, "READ Single");  // result on 
             break;
         case ValueTypeString:
-            AddLine("\tMOV\t#" + deconame + ", R0");
             AddRuntimeCall(RuntimeREAS, "READ String");
             break;
         }
@@ -1969,13 +3753,10 @@ void Generator::GenerateOperPlus(const ExpressionModel& expr, const ExpressionNo
                 return;
             }
 
-            //TODO
         }
 
-        //TODO
-        AddRuntimeCall(RuntimeSSAL, "allocate string");
-        //TODO
-        AddComment("TODO String + String");
+        GenerateStringArguments(expr, nodeleft, noderight);  // R0 = left string, R1 = right string
+        AddRuntimeCall(RuntimeSTCAT, "concatenate strings");  // R0 = temporary string
         return;
     }
 
@@ -2017,7 +3798,7 @@ void Generator::GenerateOperPlus(const ExpressionModel& expr, const ExpressionNo
     }
 
     // Special case for noderight as variable
-    if (nodeleft.vtype == ValueTypeInteger && noderight.vtype == ValueTypeInteger && noderight.token.type == TokenTypeIdentifier)
+    if (nodeleft.vtype == ValueTypeInteger && noderight.vtype == ValueTypeInteger && noderight.token.type == TokenTypeIdentifier && noderight.args.empty())
     {
         string deconame = DecorateVariableName(GetCanonicVariableName(noderight.token.text));
         AddLine("\tADD\t" + deconame + ", R0" + comment);
@@ -2069,7 +3850,7 @@ void Generator::GenerateOperMinus(const ExpressionModel& expr, const ExpressionN
     }
 
     // Special case for noderight as variable
-    if (nodeleft.vtype == ValueTypeInteger && noderight.vtype == ValueTypeInteger && noderight.token.type == TokenTypeIdentifier)
+    if (nodeleft.vtype == ValueTypeInteger && noderight.vtype == ValueTypeInteger && noderight.token.type == TokenTypeIdentifier && noderight.args.empty())
     {
         string deconame = DecorateVariableName(GetCanonicVariableName(noderight.token.text));
         AddLine("\tSUB\t" + deconame + ", R0" + comment);
@@ -2232,7 +4013,7 @@ void Generator::GenerateOperDivInt(const ExpressionModel& expr, const Expression
         AddLine("\tMOV\tR0, R1");
         AddLine("\tMOV\t#" + std::to_string(ivalue) + "., R0");
     }
-    else if (noderight.token.type == TokenTypeIdentifier && (noderight.vtype == ValueTypeInteger || noderight.vtype == ValueTypeSingle))
+    else if (noderight.token.type == TokenTypeIdentifier && noderight.args.empty() && (noderight.vtype == ValueTypeInteger || noderight.vtype == ValueTypeSingle))
     {
         // Special case for variable at right
         string deconame = DecorateVariableName(GetCanonicVariableName(noderight.token.text));
@@ -2296,7 +4077,7 @@ void Generator::GenerateOperMod(const ExpressionModel& expr, const ExpressionNod
         AddLine("\tMOV\tR0, R1");
         AddLine("\tMOV\t#" + std::to_string(ivalue) + "., R0");
     }
-    else if (noderight.token.type == TokenTypeIdentifier && (noderight.vtype == ValueTypeInteger || noderight.vtype == ValueTypeSingle))
+    else if (noderight.token.type == TokenTypeIdentifier && noderight.args.empty() && (noderight.vtype == ValueTypeInteger || noderight.vtype == ValueTypeSingle))
     {
         // Variable at right
         string deconame = DecorateVariableName(GetCanonicVariableName(noderight.token.text));
@@ -2349,8 +4130,42 @@ void Generator::GenerateOperPower(const ExpressionModel& expr, const ExpressionN
         assert(false);
 }
 
+// Single constant with the value in Integer range, like 10 in A%<10
+static bool IsIntegerValueConstNode(const ExpressionNode& node)
+{
+    if (!node.constval || node.vtype != ValueTypeSingle)
+        return false;
+    double dvalue = node.token.dvalue;
+    return dvalue == std::floor(dvalue) && dvalue >= -32768.0 && dvalue <= 32767.0;
+}
+
 void Generator::GenerateLogicOperArguments(const ExpressionModel& expr, const ExpressionNode& nodeleft, const ExpressionNode& noderight)
 {
+    if (nodeleft.vtype == ValueTypeString)  // String <=> String
+    {
+        assert(noderight.vtype == ValueTypeString);  // Compare String <=> Integer/Single should be covered in validation
+
+        GenerateStringArguments(expr, nodeleft, noderight);  // R0 = left string, R1 = right string
+        AddRuntimeCall(RuntimeSTCM, "compare strings");  // result in flags
+        return;
+    }
+
+    // Integer <=> Single const with integer value, like A%<10: compare as integers, no ITOF and FCMP
+    if (nodeleft.vtype == ValueTypeInteger && IsIntegerValueConstNode(noderight))
+    {
+        GenerateExpression(expr, nodeleft);
+        int ivalue = (int)noderight.token.dvalue;
+        AddLine("\tCMP\tR0, #" + std::to_string(ivalue) + ".\t; compare integer to const");
+        return;
+    }
+    if (noderight.vtype == ValueTypeInteger && IsIntegerValueConstNode(nodeleft))
+    {
+        GenerateExpression(expr, noderight);
+        int ivalue = (int)nodeleft.token.dvalue;
+        AddLine("\tCMP\t#" + std::to_string(ivalue) + "., R0\t; compare const to integer");
+        return;
+    }
+
     // Code to calculate left sub-expression
     GenerateExpression(expr, nodeleft);
 
@@ -2363,7 +4178,7 @@ void Generator::GenerateLogicOperArguments(const ExpressionModel& expr, const Ex
                 int ivalue = (int)std::floor(noderight.token.dvalue);
                 AddLine("\tCMP\tR0, #" + std::to_string(ivalue) + ".\t; compare integer to const");
             }
-            else if (noderight.token.type == TokenTypeIdentifier)
+            else if (noderight.token.type == TokenTypeIdentifier && noderight.args.empty())
             {
                 string deconame = DecorateVariableName(GetCanonicVariableName(noderight.token.text));
                 AddLine("\tCMP\tR0, " + deconame + "\t; compare integer to var");
@@ -2406,16 +4221,44 @@ void Generator::GenerateLogicOperArguments(const ExpressionModel& expr, const Ex
             assert(false);  // Compare Single <=> String should be covered in validation
         }
     }
-    else if (nodeleft.vtype == ValueTypeString)
-    {
-        assert(noderight.vtype == ValueTypeString);  // Compare String <=> Integer/Single should be covered in validation
+}
 
-        AddRuntimeCall(RuntimeSTCM);
-        AddComment("TODO compare String to String");
-        //TODO
+// Calculate two String operands: R0 = left string, R1 = right string.
+// Strings of variables move in the heap when the garbage collector runs on allocation of a temporary string,
+// so the const or variable operand is loaded after the other operand is calculated.
+void Generator::GenerateStringArguments(const ExpressionModel& expr, const ExpressionNode& nodeleft, const ExpressionNode& noderight)
+{
+    if (noderight.constval || (noderight.token.type == TokenTypeIdentifier && noderight.args.empty()))
+    {
+        GenerateExpression(expr, nodeleft);  // R0 = left string
+        AddLine("\tMOV\t" + GetStringOperand(noderight) + ", R1");
+    }
+    else if (nodeleft.constval || (nodeleft.token.type == TokenTypeIdentifier && nodeleft.args.empty()))
+    {
+        GenerateExpression(expr, noderight);
+        AddLine("\tMOV\tR0, R1");
+        AddLine("\tMOV\t" + GetStringOperand(nodeleft) + ", R0");
+    }
+    else  // Both calculated; the left one is a temporary string, temporary strings stay in place
+    {
+        GenerateExpression(expr, nodeleft);
+        AddLine("\tMOV\tR0, -(SP)\t; PUSH R0");
+        GenerateExpression(expr, noderight);
+        AddLine("\tMOV\tR0, R1");
+        AddLine("\tMOV\t(SP)+, R0\t; POP R0");
     }
 }
 
+// Operand to get address of the const string or the variable string
+string Generator::GetStringOperand(const ExpressionNode& node)
+{
+    if (node.constval)
+        return "#ST" + std::to_string(GetConstStringIndex(node.GetConstStringValue()));
+
+    assert(node.token.type == TokenTypeIdentifier && node.args.empty());
+    return DecorateVariableName(GetCanonicVariableName(node.token.text));
+}
+
 void Generator::GenerateOperEqual(const ExpressionModel& expr, const ExpressionNode& node, const ExpressionNode& nodeleft, const ExpressionNode& noderight)
 {
     // Special case: String equals empty String
@@ -3238,7 +5081,6 @@ void Generator::GenerateFuncAsc(const ExpressionModel& expr, const ExpressionNod
 // result is String
 void Generator::GenerateFuncChr(const ExpressionModel& expr, const ExpressionNode& node)
 {
-    //TODO: Special case for const expression and variable expression
     const ExpressionModel& expr1 = node.args[0];
     assert(expr1.GetExpressionValueType() != ValueTypeString);
 
@@ -3246,9 +5088,7 @@ void Generator::GenerateFuncChr(const ExpressionModel& expr, const ExpressionNod
     if (expr1.GetExpressionValueType() == ValueTypeSingle)
         AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
 
-    //TODO: Allocate dynamic 1-char string
-    //TODO: String length = 1, MOVB R0 to first char of the string
-    AddComment("TODO CHR$");
+    AddRuntimeCall(RuntimeSTCHR, "CHR$");  // R0 = temporary string
 }
 
 // X¤=STRING¤(<АРГУМЕНТ1>,<АРГУМЕНТ2>)
@@ -3261,61 +5101,95 @@ void Generator::GenerateFuncString(const ExpressionModel& expr, const Expression
     assert(expr1.GetExpressionValueType() != ValueTypeString);
 
     const ExpressionModel& expr2 = node.args[1];
+    ValueType expr2vtype = expr2.GetExpressionValueType();
 
-    if (expr1.IsConstExpression())
+    if (expr1.IsConstExpression() && (int)std::floor(expr1.GetConstExpressionDValue()) == 0)
     {
-        int ivalue = (int)std::floor(expr1.GetConstExpressionDValue());
-        assert(ivalue >= 0 && ivalue <= 255);
-        if (ivalue == 0)
-        {
-            Warning(node.token, "STRING$(0, ...) reduced to empty string; consider to replace this expression with \"\".");
-            AddLine("\tMOV\tST0, R0");
-            return;
-        }
+        Warning(node.token, "STRING$(0, ...) reduced to empty string; consider to replace this expression with \"\".");
+        AddLine("\tMOV\t#ST0, R0");
+        return;
+    }
+    if (expr2.IsConstExpression() && expr2vtype == ValueTypeString && expr2.GetConstExpressionSValue() == "")
+    {
+        Warning(node.token, "STRING$(..., \"\") reduced to empty string; consider to replace this expression with \"\".");
+        AddLine("\tMOV\t#ST0, R0");
+        return;
+    }
+
+    if (!expr1.IsConstExpression())
+    {
+        GenerateExpression(expr1);
+        if (expr1.GetExpressionValueType() == ValueTypeSingle)
+            AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
+        AddLine("\tMOV\tR0, -(SP)\t; PUSH R0");
+    }
 
+    if (expr2.IsConstExpression())
+    {
+        //NOTE: Character conversion depends on encoding
+        int ivalue = (expr2vtype == ValueTypeString)
+            ? (unsigned char)expr2.GetConstExpressionSValue()[0]
+            : (int)std::floor(expr2.GetConstExpressionDValue());
+        AddLine("\tMOV\t#" + std::to_string(ivalue) + "., R0\t; char");
+    }
+    else
+    {
         GenerateExpression(expr2);
-        if (expr2.GetExpressionValueType() == ValueTypeSingle)
+        if (expr2vtype == ValueTypeString)
+            AddLine("\tMOVB\t1(R0), R0\t; first char of the string");
+        else if (expr2vtype == ValueTypeSingle)
             AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
-        //TODO: If the string is empty, result is empty string (already in R0)
+    }
 
-        //TODO: Allocate string with the given length
-        //TODO: Fill the string
-        AddComment("TODO STRING$");
-        return;
+    if (expr1.IsConstExpression())
+    {
+        int ivalue = (int)std::floor(expr1.GetConstExpressionDValue());
+        AddLine("\tMOV\t#" + std::to_string(ivalue) + "., R1\t; count");
     }
+    else
+        AddLine("\tMOV\t(SP)+, R1\t; count");
 
-    if (expr2.IsConstExpression())
+    AddRuntimeCall(RuntimeSTSTR, "STRING$");  // R0 = temporary string
+}
+
+// X¤=MID¤(<СТРОКА>,<ПОЗИЦИЯ>[,<ДЛИНА>])
+// result is String
+void Generator::GenerateFuncMid(const ExpressionModel& expr, const ExpressionNode& node)
+{
+    assert(node.args.size() == 2 || node.args.size() == 3);
+
+    const ExpressionModel& expr1 = node.args[0];
+    assert(expr1.GetExpressionValueType() == ValueTypeString);
+
+    // Numbers first: the string of a variable should not move in the heap before the call
+    std::vector<string> loads;
+    for (size_t i = node.args.size() - 1; i > 0; i--)
     {
-        ValueType expr2vtype = expr2.GetExpressionValueType();
-        if (expr2vtype == ValueTypeString && expr2.GetConstExpressionSValue() == "")
+        const ExpressionModel& exprnum = node.args[i];
+        assert(exprnum.GetExpressionValueType() != ValueTypeString);
+        string reg = (i == 1) ? "R1" : "R2";
+        string comment = (i == 1) ? "\t; position" : "\t; count";
+        if (exprnum.IsConstExpression())
         {
-            Warning(node.token, "STRING$(..., \"\") reduced to empty string; consider to replace this expression with \"\".");
-            AddLine("\tMOV\tST0, R0");
-            return;
+            int ivalue = (int)std::floor(exprnum.GetConstExpressionDValue());
+            loads.push_back("\tMOV\t#" + std::to_string(ivalue) + "., " + reg + comment);
+            continue;
         }
 
-        GenerateExpression(expr1);
-        if (expr1.GetExpressionValueType() == ValueTypeSingle)
+        GenerateExpression(exprnum);
+        if (exprnum.GetExpressionValueType() == ValueTypeSingle)
             AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
-
-        //TODO: Allocate string with the given length
-        //TODO: Fill the string
-        AddComment("TODO STRING$");
-        return;
+        AddLine("\tMOV\tR0, -(SP)\t; PUSH R0");
+        loads.insert(loads.begin(), "\tMOV\t(SP)+, " + reg + comment);
     }
+    if (node.args.size() == 2)
+        loads.push_back("\tMOV\t#255., R2\t; up to the end of the string");
 
-    GenerateExpression(expr1);
-    if (expr1.GetExpressionValueType() == ValueTypeSingle)
-        AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
-
-    GenerateExpression(expr2);
-    if (expr2.GetExpressionValueType() == ValueTypeSingle)
-        AddRuntimeCall(RuntimeFTOI, "to Integer");  // result in R0
-    //TODO: If the string is empty, result is empty string (already in R0)
+    GenerateExpression(expr1);  // R0 = string address
+    for (const string& line : loads)
+        AddLine(line);
 
-    //TODO: Allocate string with the given length
-    //TODO: Fill the string
-    AddComment("TODO STRING$");
+    AddRuntimeCall(RuntimeSTMID, "MID$");  // R0 = temporary string
 }
 
 // X=IIF(<ЛОГИЧЕСКОЕ ВЫРАЖЕНИЕ>,<АРИФМЕТИЧЕСКОЕ ВЫРАЖЕНИЕ>,<АРИФМЕТИЧЕСКОЕ ВЫРАЖЕНИЕ>)
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 
 #include "main.h"
 
@@ -13,6 +14,11 @@ string g_outfilename;   // Output .MAC file name
 string g_rttplfilename; // Runtime template file name, like "runtime-UKNC.tmac"
 string g_rttplfilepath; // Runtime template file path
 string g_rtfilename;    // Runtime .MAC file name
+string g_dotfilename;   // Control flow graph .dot file name
+string g_lmapfilename;  // Profile line map file name
+string g_mapfilename;   // Address map file name
+string g_profilefilename;  // Line run counts file name, for the profile-guided optimizations
+string g_samplesfilename;  // PC samples file name, to make the flat profile using the address map
 
 bool g_quiet = false;           // Be quiet
 TargetPlatform g_platform = PlatformUKNC;
@@ -22,6 +28,24 @@ bool g_tokenizeonly = false;    // Show tokenization and quit
 bool g_parsingonly = false;     // Show parsing result and quit
 bool g_validationonly = false;  // Show validation result and quit
 bool g_showgeneration = false;
+bool g_inferint = false;        // Demote Single variables holding only integer values to Integer
+bool g_staticread = true;       // Take the DATA values for READ at compile time, where possible
+bool g_constprop = true;        // Propagate constants across lines
+bool g_deadcode = true;         // Remove the lines the control never gets to
+bool g_licm = true;             // Calculate loop invariants before the loop
+bool g_cse = true;              // Keep the values of common subexpressions in temporaries
+bool g_cfgdot = false;          // Write the line control flow graph in DOT format
+bool g_strbuffers = true;       // Give the String variables with bounded length their own buffers
+bool g_stats = false;           // Show the statistics after the compilation
+bool g_boundsreport = false;    // Show the array index checks left in the code
+bool g_compress = false;        // Pack the assembled .BIN file into a self-extracting image
+bool g_threaded = false;        // Generate threaded code where it is shorter than machine code
+bool g_annotate = false;        // Note the code size and the estimated time of every line in the listing
+int g_annotatetop = 10;         // Number of the most expensive lines to show with the annotation
+bool g_profile = false;         // Count the runs of every line, write the counters when the program ends
+bool g_map = false;             // Write the address map of the lines, routines and variables
+int g_inlinesize = 16;          // Max size of the runtime routine to inline in loops, in bytes
+int g_inlinebudget = 256;       // Max code growth because of inlining, in bytes
 
 SourceModel g_source;
 FinalModel g_final;
@@ -50,6 +74,21 @@ TargetPlatform FindPlatformByName(const string& name)
     if (name == "UKNC") return PlatformUKNC;
     return PlatformNone;
 }
+// Address the program is loaded at
+int GetPlatformLoadAddress(TargetPlatform /*platform*/)
+{
+    return 01000;
+}
+// Upper bound of the memory free for the program, 0 = unknown
+int GetPlatformMemoryTop(TargetPlatform platform)
+{
+    switch (platform)
+    {
+    case PlatformBK0010: return 040000;  // Screen starts here
+    default:
+        return 0;
+    }
+}
 
 void RegisterError()
 {
@@ -208,6 +247,57 @@ void ShowValidation(Validator& validator)
     }
 }
 
+void PrintStatistics()
+{
+    // String variables, against the fixed 256-byte buffer for each variable
+    int stringvars = 0, heapvars = 0, bufferbytes = 0, savedbytes = 0;
+    for (const VariableModel& var : g_source.vars)
+    {
+        if (var.GetValueType() != ValueTypeString || !var.indices.empty())
+            continue;
+        stringvars++;
+        if (var.strbuffer < 0)
+        {
+            heapvars++;
+            continue;
+        }
+        int size = (var.strbuffer > 0) ? ((var.strbuffer + 2) & ~1) : 0;
+        bufferbytes += size;
+        savedbytes += 256 - size;
+    }
+    std::cout << "String variables: " << stringvars << ", in the heap: " << heapvars
+              << ", buffers: " << bufferbytes << " bytes, saved: " << savedbytes << " bytes" << std::endl;
+}
+
+// Read the line run counts written by the program built with --profile: "N100 1234" lines, other lines ignored
+void ReadProfile()
+{
+    std::ifstream profilestream;
+    profilestream.open(g_profilefilename);
+    if (!profilestream.is_open())
+    {
+        std::cerr << "Failed to open the profile file " + g_profilefilename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::map<string, int64_t> counts;
+    string line;
+    while (std::getline(profilestream, line))
+    {
+        std::istringstream linestream(line);
+        string key;
+        long long count;
+        if (!(linestream >> key >> count) || key.size() < 2 || (key[0] != 'N' && key[0] != 'L') ||
+            key.find_first_not_of("0123456789", 1) != string::npos || count < 0)
+            continue;
+        counts[key] += count;
+    }
+    profilestream.close();
+
+    int notfound = g_source.ApplyProfile(counts);
+    if (notfound > 0)
+        std::cerr << "WARNING: " << notfound << " lines of the profile are not found in the program." << std::endl;
+}
+
 void ProcessFiles()
 {
     std::ifstream instream;
@@ -255,6 +345,16 @@ void ProcessFiles()
 
     instream.close();
 
+    if (!g_profilefilename.empty())
+        ReadProfile();
+
+    // Type inference; before validation so that the expressions get typed with the new variable types
+    if (g_inferint)
+    {
+        Analyzer analyzer(&g_source);
+        analyzer.InferIntegerVariables();
+    }
+
     Validator validator(&g_source);
 
     if (g_validationonly)
@@ -274,6 +374,53 @@ void ProcessFiles()
         exit(EXIT_FAILURE);
     }
 
+    // READ at the program start takes the DATA values at compile time; the values become the constants to propagate
+    if (g_staticread)
+    {
+        Analyzer analyzer(&g_source);
+        analyzer.ResolveStaticReads();
+    }
+
+    // Constant propagation; after validation so that the substituted expressions get folded
+    if (g_constprop)
+    {
+        Analyzer analyzer(&g_source);
+        analyzer.PropagateConstants(&validator);
+    }
+
+    // Unreachable code elimination, the control flow graph for inspection, the line labels cleanup,
+    // then loop invariants, common subexpressions within the blocks of lines without labels, array index checks,
+    // and string lengths
+    {
+        Analyzer analyzer(&g_source);
+        if (g_deadcode)
+            analyzer.EliminateUnreachableLines();
+
+        if (g_cfgdot)
+        {
+            std::ofstream dotstream;
+            dotstream.open(g_dotfilename, std::ofstream::out | std::ofstream::trunc);
+            if (!dotstream.is_open())
+            {
+                std::cerr << "Failed to open the output file " << g_dotfilename << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            analyzer.WriteControlFlowGraph(dotstream);
+            dotstream.close();
+        }
+
+        analyzer.RemoveUnusedLineLabels();
+        if (g_licm)
+            analyzer.HoistLoopInvariants();
+        if (g_cse)
+            analyzer.EliminateCommonSubexpressions();
+
+        analyzer.EliminateBoundsChecks(g_boundsreport ? &std::cout : nullptr);
+
+        if (g_strbuffers)
+            analyzer.InferStringLengths();
+    }
+
     // Read and parse the runtime template
     std::ifstream rttplstream;
     rttplstream.open(g_rttplfilepath);
@@ -300,7 +447,13 @@ void ProcessFiles()
     assert(!initlines.empty());
     assert(!termlines.empty());
 
+    std::vector<RuntimeBlock> inlineblocks;
+    runtimegen.GetInlineBlocks(inlineblocks);
+
     Generator generator(&g_source, &g_final, &initlines, &termlines);
+    generator.SetInlineBlocks(inlineblocks, g_inlinesize, g_inlinebudget);
+    generator.SetThreaded(g_threaded);
+    generator.SetProfile(g_profile);
     g_errorcount = 0;
     while (generator.ProcessLine())
         ;
@@ -309,12 +462,46 @@ void ProcessFiles()
     const std::set<RuntimeSymbol> runtimeneeds = generator.GetRuntimeNeeds();
     runtimegen.GenerateRuntime(runtimeneeds);
 
+    if (g_annotate)
+        generator.AnnotateCosts(g_annotatetop);
+
     if (g_errorcount > 0)
     {
         std::cerr << "Generation ERRORS: " << g_errorcount << std::endl;
         exit(EXIT_FAILURE);
     }
 
+    if (g_stats)
+        PrintStatistics();
+
+    // Write the line map to correlate the profile counters with the code
+    if (g_profile)
+    {
+        std::ofstream lmapstream;
+        lmapstream.open(g_lmapfilename, std::ofstream::out | std::ofstream::trunc);
+        if (!lmapstream.is_open())
+        {
+            std::cerr << "Failed to open the output file " << g_lmapfilename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        generator.WriteLineMap(lmapstream, GetPlatformLoadAddress(g_platform));
+        lmapstream.close();
+    }
+
+    // Write the address map for the debuggers and the sampling profilers
+    if (g_map)
+    {
+        std::ofstream mapstream;
+        mapstream.open(g_mapfilename, std::ofstream::out | std::ofstream::trunc);
+        if (!mapstream.is_open())
+        {
+            std::cerr << "Failed to open the output file " << g_mapfilename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        generator.WriteMap(mapstream, GetPlatformLoadAddress(g_platform));
+        mapstream.close();
+    }
+
     // Write to the output file
     std::ofstream outstream;
     outstream.open(g_outfilename, std::ofstream::out | std::ofstream::trunc);
@@ -380,6 +567,119 @@ void ProcessFiles()
     }
 }
 
+// Pack the assembled program image into a self-extracting one: the packed data plus UNLZ block from the runtime template
+void ProcessCompress()
+{
+    // Read the .BIN file: load address word, size word, then the program bytes
+    std::ifstream instream;
+    instream.open(g_infilename, std::ifstream::in | std::ifstream::binary);
+    if (!instream.is_open())
+    {
+        std::cerr << "Failed to open the input file " + g_infilename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(instream)), std::istreambuf_iterator<char>());
+    instream.close();
+    int loadaddr = image.size() < 4 ? 0 : image[0] | (image[1] << 8);
+    int size = image.size() < 4 ? 0 : image[2] | (image[3] << 8);
+    if (size == 0 || (loadaddr & 1) != 0 || image.size() < (size_t)size + 4)
+    {
+        std::cerr << "Input file " << g_infilename << " is not a valid .BIN file." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<uint8_t> data(image.begin() + 4, image.begin() + 4 + size);
+
+    // Read the decompressor from the runtime template
+    std::ifstream rttplstream;
+    rttplstream.open(g_rttplfilepath);
+    if (!rttplstream.is_open())
+    {
+        std::cerr << "Failed to open runtime template file " + g_rttplfilepath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    RuntimeGenerator runtimegen(&g_final);
+    runtimegen.ParseRuntimeTemplate(&rttplstream);
+    rttplstream.close();
+    std::vector<string> stublines;
+    runtimegen.GetRuntimeBlock(RuntimeUNLZ, stublines);
+    if (g_errorcount > 0)
+    {
+        std::cerr << "Generation ERRORS: " << g_errorcount << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The decompressor part starting from UNLZ label is moved to the top of memory, above the packed data
+    int stubsize = 0, decodersize = 0;
+    bool decoder = false;
+    for (const string& line : stublines)
+    {
+        AsmLineModel asmline;
+        asmline.Parse(line);
+        if (asmline.label == "UNLZ")
+            decoder = true;
+        int linesize = asmline.GetSize();
+        if (linesize < 0)
+        {
+            std::cerr << "Failed to get the code size of the runtime template line: " << line << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        stubsize += linesize;
+        if (decoder)
+            decodersize += linesize;
+    }
+
+    std::vector<uint8_t> packed;
+    int margin;
+    LzPack(data, packed, margin);
+    int packedsize = ((int)packed.size() + 1) & ~1;
+
+    // The program is unpacked in place, from the load address up to the packed data.
+    // The packed data is moved up starting from its end, so it should not go below its place in the image.
+    int memtop = GetPlatformMemoryTop(g_platform);
+    int needed = loadaddr + std::max(margin, stubsize) + packedsize + decodersize;
+    if (needed > memtop)
+    {
+        std::cerr << "Packed image does not fit in memory: " << (needed - memtop) << " bytes more needed." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Packed " << size << " bytes to " << packedsize << " bytes ("
+              << (packedsize * 100 / size) << "%), decompressor " << decodersize << " bytes." << std::endl;
+
+    // Write to the output file
+    std::ofstream outstream;
+    outstream.open(g_outfilename, std::ofstream::out | std::ofstream::trunc);
+    if (!outstream.is_open())
+    {
+        std::cerr << "Failed to open the output file " << g_outfilename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    outstream << "; Generated with vibasc [" << __DATE__ << "] on " << g_infilename << std::endl;
+    outstream << "; Self-extracting image: " << size << " bytes packed to " << packedsize << " bytes" << std::endl;
+    outstream << std::endl;
+    outstream << COMMENT_LINE_SEPARATOR << std::endl;
+    outstream << "LZADDR = " << std::oct << loadaddr << "\t\t; Load address of the program" << std::endl;
+    outstream << "LZSIZE = " << std::dec << size << ".\t\t; Size of the program" << std::endl;
+    outstream << "LZTOP = " << std::oct << memtop << std::dec << "\t\t; Top of memory" << std::endl;
+    outstream << "START:" << std::endl;
+    for (const string& line : stublines)
+        outstream << line << std::endl;
+    outstream << COMMENT_LINE_SEPARATOR << std::endl;
+    outstream << "LZDATA:" << std::endl;
+    for (size_t i = 0; i < packed.size(); i += 16)
+    {
+        string line;
+        for (size_t j = i; j < i + 16 && j < packed.size(); j++)
+            line += (line.empty() ? "\t.BYTE\t" : ", ") + std::to_string(packed[j]) + ".";
+        outstream << line << std::endl;
+    }
+    outstream << "\t.EVEN" << std::endl;
+    outstream << "LZEND:" << std::endl;
+    outstream << COMMENT_LINE_SEPARATOR << std::endl;
+    outstream << (g_turbo8 ? "\t.END" : "\t.END\tSTART") << std::endl;
+    outstream.close();
+}
+
 void ParseCommandLine(int argc, char** argv)
 {
     //TODO: if no arguments, show usage info
@@ -408,6 +708,57 @@ void ParseCommandLine(int argc, char** argv)
                 g_validationonly = true;
             else if (_stricmp(arg + 1, "g") == 0 || _stricmp(arg, "--showgeneration") == 0)
                 g_showgeneration = true;
+            else if (_stricmp(arg, "--infer-int") == 0)
+                g_inferint = true;
+            else if (_stricmp(arg, "--no-static-read") == 0)
+                g_staticread = false;
+            else if (_stricmp(arg, "--no-const-prop") == 0)
+                g_constprop = false;
+            else if (_stricmp(arg, "--keep-unreachable") == 0)
+                g_deadcode = false;
+            else if (_stricmp(arg, "--no-licm") == 0)
+                g_licm = false;
+            else if (_stricmp(arg, "--no-cse") == 0)
+                g_cse = false;
+            else if (_stricmp(arg, "--cfg-dot") == 0)
+                g_cfgdot = true;
+            else if (_stricmp(arg, "--no-string-buffers") == 0)
+                g_strbuffers = false;
+            else if (_stricmp(arg, "--stats") == 0)
+                g_stats = true;
+            else if (_stricmp(arg, "--bounds-report") == 0)
+                g_boundsreport = true;
+            else if (_stricmp(arg, "--compress") == 0)
+                g_compress = true;
+            else if (strncmp(arg, "--codegen=", 10) == 0)
+            {
+                string name = string(arg).substr(10);
+                if (name != "native" && name != "threaded")
+                {
+                    std::cerr << "Option --codegen parameter invalid." << arg << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                g_threaded = (name == "threaded");
+            }
+            else if (_stricmp(arg, "--profile") == 0)
+                g_profile = true;
+            else if (strncmp(arg, "--use-profile=", 14) == 0)
+                g_profilefilename = arg + 14;
+            else if (_stricmp(arg, "--map") == 0)
+                g_map = true;
+            else if (strncmp(arg, "--pc-samples=", 13) == 0)
+                g_samplesfilename = arg + 13;
+            else if (_stricmp(arg, "--annotate") == 0)
+                g_annotate = true;
+            else if (strncmp(arg, "--annotate-top=", 15) == 0)
+            {
+                g_annotate = true;
+                g_annotatetop = atoi(arg + 15);
+            }
+            else if (strncmp(arg, "--inline-size=", 14) == 0)
+                g_inlinesize = atoi(arg + 14);
+            else if (strncmp(arg, "--inline-budget=", 16) == 0)
+                g_inlinebudget = atoi(arg + 16);
             else if (strncmp(arg, "--platform=", 11) == 0)
             {
                 string name = string(arg).substr(11);
@@ -437,6 +788,103 @@ void ParseCommandLine(int argc, char** argv)
         std::cerr << "Input file not specified." << std::endl;
         exit(EXIT_FAILURE);
     }
+    if (g_compress && GetPlatformMemoryTop(g_platform) == 0)
+    {
+        std::cerr << "Option --compress is supported for BK0010 platform only." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Make the flat profile from the PC samples: the input file is the address map written with --map,
+// the samples file has octal addresses, one per line, with optional decimal count of the hits
+void ProcessSamples()
+{
+    struct MapEntry
+    {
+        string  location;  // Symbol, and the line text for the BASIC lines
+        int64_t samples;
+    };
+
+    std::ifstream mapstream;
+    mapstream.open(g_infilename);
+    if (!mapstream.is_open())
+    {
+        std::cerr << "Failed to open the input file " + g_infilename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::map<int, MapEntry> entries;  // Address => entry; the later entry on the same address wins, it's inner
+    int endaddr = -1;  // End of the image, PEND entry
+    string line;
+    while (std::getline(mapstream, line))
+    {
+        if (line.empty() || line[0] == ';')
+            continue;
+        std::istringstream linestream(line);
+        string addrtext, kind, symbol, text;
+        if (!std::getline(linestream, addrtext, '\t') || !std::getline(linestream, kind, '\t') ||
+            !std::getline(linestream, symbol, '\t') || addrtext.find_first_not_of("01234567") != string::npos)
+            continue;
+        std::getline(linestream, text);
+        int addr = (int)std::strtol(addrtext.c_str(), nullptr, 8);
+        if (kind == "end")
+        {
+            endaddr = addr;
+            continue;
+        }
+        entries[addr] = { text.empty() ? symbol : symbol + "\t" + text, 0 };
+    }
+    mapstream.close();
+    if (entries.empty())
+    {
+        std::cerr << "Input file " << g_infilename << " is not a valid address map." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::ifstream samplesstream;
+    samplesstream.open(g_samplesfilename);
+    if (!samplesstream.is_open())
+    {
+        std::cerr << "Failed to open the samples file " + g_samplesfilename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int64_t total = 0, outside = 0;
+    while (std::getline(samplesstream, line))
+    {
+        std::istringstream linestream(line);
+        string addrtext;
+        long long count = 1;
+        if (!(linestream >> addrtext) || addrtext.find_first_not_of("01234567") != string::npos)
+            continue;
+        if (!(linestream >> count))
+            count = 1;
+        int addr = (int)std::strtol(addrtext.c_str(), nullptr, 8);
+        total += count;
+        auto it = entries.upper_bound(addr);
+        if (it == entries.begin() || (endaddr >= 0 && addr >= endaddr))
+            outside += count;
+        else
+            std::prev(it)->second.samples += count;
+    }
+    samplesstream.close();
+
+    std::vector<const MapEntry*> sorted;
+    for (const auto& entry : entries)
+    {
+        if (entry.second.samples > 0)
+            sorted.push_back(&entry.second);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const MapEntry* a, const MapEntry* b) { return a->samples > b->samples; });
+
+    std::cout << "Samples: " << total << ", outside the program: " << outside << std::endl;
+    if (total == 0)
+        return;
+    std::cout << " Samples       %  Location" << std::endl;
+    for (const MapEntry* entry : sorted)
+    {
+        std::cout << std::setw(8) << entry->samples << "  " << std::fixed << std::setprecision(1) << std::setw(5)
+                  << (entry->samples * 100.0 / total) << "%  " << entry->location << std::endl;
+    }
 }
 
 int main(int argc, char* argv[])
@@ -448,9 +896,21 @@ int main(int argc, char* argv[])
 
     size_t dotpos = g_infilename.find_last_of('.');
     if (dotpos == string::npos)
+    {
         g_outfilename = g_infilename + ".MAC";
+        g_dotfilename = g_infilename + ".dot";
+        g_lmapfilename = g_infilename + ".lmap";
+        g_mapfilename = g_infilename + ".map";
+    }
     else
+    {
         g_outfilename = g_infilename.substr(0, dotpos) + ".MAC";
+        g_dotfilename = g_infilename.substr(0, dotpos) + ".dot";
+        g_lmapfilename = g_infilename.substr(0, dotpos) + ".lmap";
+        g_mapfilename = g_infilename.substr(0, dotpos) + ".map";
+    }
+    if (g_compress)  // Keep the program .MAC file, it has the same name as the .BIN file
+        g_outfilename = g_outfilename.substr(0, g_outfilename.size() - 4) + "LZ.MAC";
 
     g_rttplfilename = string("runtime-") + GetPlatformName(g_platform) + ".tmac";
     size_t seppos = g_exefilepath.find_last_of(PATH_SEPARATOR);
@@ -469,7 +929,12 @@ int main(int argc, char* argv[])
         std::cout << "vibasc  " << __DATE__ << std::endl;
 
     std::cout << std::endl;
-    ProcessFiles();
+    if (g_compress)
+        ProcessCompress();
+    else if (!g_samplesfilename.empty())
+        ProcessSamples();
+    else
+        ProcessFiles();
 
     return EXIT_SUCCESS;
 }
@@ -1,11 +1,13 @@
 ﻿#pragma once
 
+#include <cstdint>
 #include <cstring>
 #include <string>
 #include <iostream>
 #include <limits.h>
 #include <vector>
 #include <set>
+#include <map>
 #include <algorithm>
 #include <iterator>
 #include <cmath>
@@ -144,7 +146,7 @@ enum RuntimeSymbol
     RuntimeFDIV         = 31,  // FIS
     RuntimeFPACK        = 32,  // Parse Single from buffer
     RuntimeINPF         = 33,  // INPUT Single
-    RuntimeReserved5    = 34,
+    RuntimeUNLZ         = 34,  // LZ decompressor for the self-extracting image, not a part of the runtime
     RuntimeFRND         = 35,  // Random number
     RuntimeFSQR         = 36,  // Square root
     RuntimeFPWF         = 37,  // Power Single ^ Single
@@ -163,8 +165,17 @@ enum RuntimeSymbol
     RuntimeSTCP         = 50,  // String copy
     RuntimeSTCM         = 51,  // Compare two Strings
     RuntimeSSAL         = 52,  // String Stack allocate
-    RuntimeReserved6    = 53,
+    RuntimeARRE         = 53,  // Array index out of bounds error
     RuntimeCOLR         = 54,  // COLOR
+    RuntimeSTAS         = 55,  // String assignment, copy the string to the heap
+    RuntimeSSFR         = 56,  // String Stack free
+    RuntimeSTCAT        = 57,  // String concatenation
+    RuntimeSTCHR        = 58,  // CHR$ function
+    RuntimeSTSTR        = 59,  // STRING$ function
+    RuntimeSTMID        = 60,  // MID$ function
+    RuntimeTHRD         = 61,  // Threaded code inner interpreter
+    RuntimePDUMP        = 62,  // Write the profile counters
+    RuntimeHEAP         = 63,  // String heap and garbage collector; keep it the last, the heap starts after it
     __RuntimeSymbol_SIZE__
 };
 
@@ -255,8 +266,9 @@ struct VariableModel : VariableBaseModel
 {
     std::vector<int> indices;  // List of variable indices if any
     SourceLineModel* psourceline;  // Source line, used for FOR..NEXT linkage
+    int strbuffer;  // String variable buffer size in chars, 0 if not needed, -1 to keep the values in the heap
 public:
-    VariableModel() : indices(), psourceline(nullptr) {}
+    VariableModel() : indices(), psourceline(nullptr), strbuffer(-1) {}
 };
 
 struct ExpressionModel;
@@ -270,8 +282,13 @@ struct ExpressionNode
     bool        brackets;       // Flag indicating that this node and all the sub-tree was in brackets
     ValueType   vtype;
     bool        constval;       // Flag for constant value
+    int         cseid;          // Common subexpression number, 0 if none
+    int         csetemp;        // Temporary variable index for the common subexpression value
+    bool        csedef;         // Flag the node calculates the common subexpression value and saves it
+    bool        inbounds;       // Flag for the array index root node: the value is proven to be within the bounds
 public:
-    ExpressionNode() : left(-1), right(-1), brackets(false), vtype(ValueTypeNone), constval(false) {}
+    ExpressionNode() : left(-1), right(-1), brackets(false), vtype(ValueTypeNone), constval(false),
+        cseid(0), csetemp(0), csedef(false), inbounds(false) {}
 public:
     int GetOperationPriority() const;
     void Dump(std::ostream& out) const;
@@ -293,6 +310,9 @@ public:
     bool IsVariableExpression() const;
     string GetVariableExpressionDecoratedName() const;
     ValueType GetExpressionValueType() const;
+    bool IsBooleanNode(const ExpressionNode& node) const;  // Node value could be only -1 (TRUE) or 0 (FALSE)
+    bool IsSideEffectNode(const ExpressionNode& node) const;  // Node sub-tree has functions with side effects
+    bool IsVariableUsed(const string& canoname) const;
     int AddOperationNode(ExpressionNode& node, int prev);  // Add binary operation node into the tree
 };
 
@@ -319,6 +339,7 @@ struct StatementModel
     std::vector<Token> params;  // Statement params like list of variables
     std::vector<VariableModel> variables;  // Variables with indices
     std::vector<VariableExpressionModel> varexprs;  // Variables with expressions for indices
+    std::vector<ExpressionModel> invariants;  // FOR: loop-invariant expressions calculated before the loop
     StatementModel* stthen;
     StatementModel* stelse;
 public:
@@ -326,6 +347,10 @@ public:
         paramline(0), inner(false), relative(false), fileoper(false), gotogosub(false), deffnorusr(false),
         nocrlf(false), datafixed(false), forindex(0),
         filemode(FileModeAny), stthen(nullptr), stelse(nullptr) { }
+public:
+    bool IsVariableUsed(const string& canoname) const;  // Statement reads or writes the variable
+    bool IsControlTransfer() const;  // Statement could pass control out of the normal flow
+    void GetJumpTargets(std::vector<int>& linenums) const;  // Line numbers the statement could pass control to
 };
 
 struct SourceLineModel
@@ -334,12 +359,17 @@ struct SourceLineModel
     int     srclinenum; // Source file line number
     string  text;       // Full line text
     bool    error;      // Flag indicating that this line has an error
+    bool    unreachable;  // Flag indicating that the control never gets to this line, no code generated
+    bool    labeled;    // Flag indicating that the line number label is needed, as the line is a jump target
+    int64_t runcount;   // Number of the line runs from the profile, -1 if not known
+    bool    hot;        // The profile shows the line takes a notable share of the runs
     StatementModel statement;
 public:
     SourceLineModel() :
-        linenum(0), srclinenum(0), error(false) {}
+        linenum(0), srclinenum(0), error(false), unreachable(false), labeled(true), runcount(-1), hot(false) {}
 public:
     string GetLineNumberLabel() const;
+    bool IsCold() const { return runcount >= 0 && !hot; }
 };
 
 struct DataElementModel
@@ -358,13 +388,18 @@ struct SourceModel
     std::vector<VariableModel> vars;//TODO: change to set
     std::vector<string> conststrings;//TODO: change to set
     std::vector<DataElementModel> data;
+    int datastart;  // First DATA element to READ at run time, the elements before are taken at compile time
+public:
+    SourceModel() : datastart(0) {}
 public:
     bool RegisterVariable(const VariableModel& var);  // Add variable to the list
     bool RegisterVariable(const VariableExpressionModel& var);
     bool IsVariableRegistered(const string& varname) const;
+    const VariableModel* GetVariable(const string& varname) const;
     bool IsLineNumberExists(int linenumber) const;
     string GetNextLineLabel(int linenumber) const;
     SourceLineModel& GetSourceLine(int srclinenumber);
+    int ApplyProfile(const std::map<string, int64_t>& counts);
     void RegisterConstString(const string& str);
     int GetConstStringIndex(const string& str);
 };
@@ -380,11 +415,29 @@ public:
     void AddRuntimeLine(const string& str);
 };
 
+// Code of one BASIC line in FinalModel::lines
+struct FinalLineSpan
+{
+    size_t  start;      // Index of the first line of the code
+    int     lineindex;  // Index of the line in SourceModel::lines
+    bool    native;     // The line should stay in machine code
+};
+
+// Code size and estimated time of one BASIC line, see Optimizer::EstimateLineCosts
+struct FinalLineCost
+{
+    int     words;      // Code size in words, including the threaded code lists
+    int     cycles;     // Estimated CPU cycles for one run of the line code, including the called runtime routines
+};
+
 struct RuntimeBlock
 {
     RuntimeSymbol rtsymbol;
     std::vector<string> lines;
     std::vector<RuntimeSymbol> needs;  // dependencies
+    bool isinline;  // the block could be expanded in place of the call
+public:
+    RuntimeBlock() : rtsymbol(RuntimeNone), isinline(false) {}
 };
 
 
@@ -531,6 +584,8 @@ class Validator
     SourceLineModel* m_line;  // Curent line being validated
     std::vector<ValidatorForSpec> m_fornextstack;
     int             m_forcount;
+    bool            m_folding;      // Folding the expression changed after the validation, see FoldExpression
+    bool            m_foldfailed;   // Error met while folding
 private:
     static const ValidatorKeywordSpec m_keywordspecs[];
     static const ValidatorOperSpec m_operspecs[];
@@ -540,13 +595,16 @@ public:
 public:
     bool ProcessLine();
     void ProcessEnd();
+    bool FoldExpression(ExpressionModel& expr);  // Re-calculate value types and constant values
 private:
     void ValidateStatement(StatementModel& statement);
+    bool SkipFoldingError();
     void Error(const string& message);
     void Error(ExpressionModel& expr, const string& message);
     void Error(ExpressionModel& expr, const ExpressionNode& node, const string& message);
     bool CheckIntegerOrSingleExpression(ExpressionModel& expr);
     bool CheckStringExpression(ExpressionModel& expr);
+    bool CheckArrayIndices(const string& canoname, std::vector<ExpressionModel>& args);
     void ValidateExpression(ExpressionModel& expr);
     void ValidateExpression(ExpressionModel& expr, int index);
 private:
@@ -638,6 +696,120 @@ private:
     void ValidateFuncIif(ExpressionModel& expr, ExpressionNode& node);
 };
 
+typedef std::map<string, double> AnalyzerConstants;  // Variables known to have constant values
+typedef std::map<string, std::pair<int, int> > AnalyzerRanges;  // Loop variables with their value ranges
+
+struct AnalyzerLineState
+{
+    bool    reached;    // Line is reachable
+    AnalyzerConstants consts;  // Constant variables at the line entry
+public:
+    AnalyzerLineState() : reached(false) {}
+};
+
+struct AnalyzerVariableSpec
+{
+    const SourceLineModel* pline;  // Line of the first variable occurrence
+    Token   token;      // Token of the first variable occurrence
+public:
+    AnalyzerVariableSpec() : pline(nullptr) {}
+};
+
+struct AnalyzerSubexpression
+{
+    ExpressionNode* pnode;  // First occurrence, calculates the value
+    int     cseid;      // Common subexpression number
+    int     csetemp;    // Temporary variable index, 0 until the value is used again
+    std::set<string> names;  // Variables the value depends on
+public:
+    AnalyzerSubexpression() : pnode(nullptr), cseid(0), csetemp(0) {}
+};
+
+class Analyzer
+{
+    SourceModel*    m_source;
+    std::map<string, AnalyzerVariableSpec> m_candidates;  // Single variables to demote to Integer
+    std::set<string> m_excluded;  // Candidates that could hold non-integer values
+    std::set<string> m_integers;  // Integer variables
+    std::set<string> m_demoted;   // New names of the demoted variables
+    bool            m_nonintegerdata;  // DATA has non-integer numbers
+    std::pair<int, int> m_datarange;  // Range of the integer numbers in DATA
+    AnalyzerRanges  m_intranges;  // Value ranges of the candidates
+    Validator*      m_validator;
+    std::map<int, int> m_linemap;  // Line number to line index map
+    std::vector<int> m_returnpoints;  // Indices of lines following GOSUB
+    std::map<string, AnalyzerSubexpression> m_available;  // Subexpressions calculated in the current block
+    int             m_csecount;  // Counter for common subexpression numbers
+    int             m_csetemps;  // Counter for temporary variables in the current block
+    int             m_looptemps;  // Number of temporary variables for loop invariants
+    int             m_checksremoved;  // Array index checks proven not needed
+    int             m_checkskept;     // Array index checks left in the code
+    std::map<string, AnalyzerSubexpression> m_invariants;  // Invariants of the current loop
+public:
+    Analyzer(SourceModel* source);
+public:
+    void InferIntegerVariables();
+    void ResolveStaticReads();
+    void PropagateConstants(Validator* validator);
+    void EliminateUnreachableLines();
+    void WriteControlFlowGraph(std::ostream& out);
+    void RemoveUnusedLineLabels();
+    void EliminateCommonSubexpressions();
+    void HoistLoopInvariants();
+    void InferStringLengths();
+    void EliminateBoundsChecks(std::ostream* report);
+private:
+    void BuildLineMap();
+    void GetSuccessors(int index, const AnalyzerConstants* consts, std::vector<int>& successors);
+    bool GetStatementSuccessors(const StatementModel& statement, const AnalyzerConstants* consts, std::vector<int>& successors);
+    void TransferStatement(const StatementModel& statement, AnalyzerConstants& consts);
+    void CollectAssignedVariables(const StatementModel& statement, std::set<string>& names, bool& clobberall);
+    bool GetConstCondition(const ExpressionModel& expr, const AnalyzerConstants& consts, bool& condition);
+    bool SubstituteConstants(ExpressionModel& expr, const AnalyzerConstants& consts);
+    bool SubstituteStatement(StatementModel& statement, const AnalyzerConstants& consts);
+    static void MergeConstants(AnalyzerConstants& consts, const AnalyzerConstants& other);
+    static bool IsDeclarativeLine(const SourceLineModel& line);
+    void GetForNextLinks(int index, std::vector<int>& links) const;
+    static void CollectJumpTargets(const StatementModel& statement, std::set<int>& targets);
+    static bool IsBlockEnd(const StatementModel& statement);
+    static bool IsCostlyNode(const ExpressionModel& expr, const ExpressionNode& node);
+    static bool GetSubexpressionKey(const ExpressionModel& expr, const ExpressionNode& node, string& key, std::set<string>& names);
+    void NumberStatement(StatementModel& statement, bool candefine);
+    void NumberExpression(ExpressionModel& expr, ExpressionNode& node, bool candefine);
+    void KillSubexpressions(const StatementModel& statement);
+    static bool IsFaultingNode(const ExpressionModel& expr, const ExpressionNode& node);
+    bool GetLoopBody(int forindex, int& nextindex);
+    void HoistStatement(StatementModel& statement, StatementModel& forstatement, const std::set<string>& assigned, bool canfault);
+    void HoistExpression(ExpressionModel& expr, ExpressionNode& node, StatementModel& forstatement, const std::set<string>& assigned, bool canfault);
+    static int GetStringLengthBound(const ExpressionModel& expr, const ExpressionNode& node, const std::map<string, int>& lengths);
+    void AddLoopRange(int forindex, std::vector<AnalyzerRanges>& ranges);
+    static bool GetIndexRange(const ExpressionModel& expr, const ExpressionNode& node, const AnalyzerRanges& ranges, int& minvalue, int& maxvalue, string& reason);
+    void CheckBoundsStatement(const SourceLineModel& line, StatementModel& statement, const AnalyzerRanges& ranges, std::ostream* report);
+    void CheckBoundsExpression(const SourceLineModel& line, ExpressionModel& expr, ExpressionNode& node, const AnalyzerRanges& ranges, std::ostream* report);
+    void CheckBoundsElement(const SourceLineModel& line, const string& canoname, std::vector<ExpressionModel>& args, const AnalyzerRanges& ranges, std::ostream* report);
+    static bool InferStringStatement(const StatementModel& statement, int datalength, std::map<string, int>& lengths, std::map<string, int>& copies);
+private:
+    void Warning(const SourceLineModel& line, const Token& token, const string& message);
+    bool IsCandidate(const string& canoname) const;
+    void RegisterName(const SourceLineModel& line, const Token& token, const string& canoname, bool isarray);
+    void ScanStatement(const SourceLineModel& line, const StatementModel& statement);
+    void ScanExpression(const SourceLineModel& line, const ExpressionModel& expr);
+    bool CheckAssignments(const StatementModel& statement);
+    bool IsIntegerExpression(const ExpressionModel& expr) const;
+    bool IsIntegerNode(const ExpressionModel& expr, const ExpressionNode& node) const;
+    bool CheckIntegerRanges();
+    void CollectIntegerRanges(const StatementModel& statement, std::set<string>& grown, std::set<string>& failed);
+    void CheckIntegerOverflows(const StatementModel& statement, std::set<string>& failed) const;
+    void CheckIntegerOverflows(const ExpressionModel& expr, std::set<string>& failed) const;
+    bool GetIntegerNodeRange(const ExpressionModel& expr, const ExpressionNode& node, int& minvalue, int& maxvalue) const;
+    void CollectCandidateNames(const ExpressionModel& expr, const ExpressionNode& node, std::set<string>& names) const;
+    void RenameStatement(StatementModel& statement);
+    void RenameExpression(ExpressionModel& expr);
+    bool RenameToken(Token& token);
+    bool IsDemotedNode(const ExpressionModel& expr, const ExpressionNode& node) const;
+    void RetypeConstant(ExpressionNode& node);
+};
+
 class Generator;
 typedef void (Generator::* GeneratorMethodRef)(StatementModel&);
 struct GeneratorKeywordSpec
@@ -658,6 +830,45 @@ struct GeneratorFuncSpec
     GeneratorFuncMethodRef methodref;
 };
 
+struct GeneratorForSpec
+{
+    bool    rotated;    // Loop with the condition check at the bottom
+    bool    counter;    // Down-counting loop, the loop variable is not used in the loop body
+    int     trips;      // Number of iterations for the counter loop
+    int     finalvalue; // Value of the loop variable after the counter loop
+    string  reg;        // Register for the counter loop, or empty string to count in the loop variable
+    size_t  initline;   // Index of the counter initialization line in the final lines
+    bool    single;     // Single loop variable, TO and STEP values are Single
+    bool    totemp;     // TO value is kept in FTn temporary
+    bool    steptemp;   // STEP value is kept in FSn temporary
+    bool    cold;       // The profile shows the loop body is cold, the counter leaves the register to the hot loops
+    std::vector<string> pointers;  // Keys of the array element pointers moved by the loop
+    size_t  pointerline;  // Index of the first pointer initialization line in the final lines
+    size_t  bodyline;   // Index of the first loop body line in the final lines
+public:
+    GeneratorForSpec() : rotated(false), counter(false), trips(0), finalvalue(0), initline(0),
+        single(false), totemp(false), steptemp(false), cold(false), pointerline(0), bodyline(0) {}
+};
+
+struct GeneratorPointerSpec
+{
+    int     number;     // Pointer number, for Pn label
+    int     stride;     // Bytes to move the pointer on each loop iteration
+    int     elemsize;   // Array element size in bytes
+    string  key;        // Array element, like "A%(J%,I%+1)"
+public:
+    GeneratorPointerSpec() : number(0), stride(0), elemsize(0) {}
+};
+
+struct GeneratorInlineSpec
+{
+    std::vector<string> lines;  // Routine body without the entry label and the final RETURN
+    int     size;       // Size of the body in bytes
+    std::vector<RuntimeSymbol> needs;
+public:
+    GeneratorInlineSpec() : size(0) {}
+};
+
 class Generator
 {
     SourceModel*    m_source;
@@ -669,17 +880,42 @@ class Generator
     int             m_local;    // Counter for local labels within the current line
     std::set<RuntimeSymbol> m_runtimeneeds;
     std::set<KeywordIndex> m_notimplemented;  // Statements/functions used but not implemented
+    std::map<int, GeneratorForSpec> m_forspecs;  // FOR index => loop details
+    int             m_counterloops;  // Number of counter loops opened at the moment
+    std::set<int>   m_usedstrings;  // Indices of the const strings referenced by the generated code
+    std::set<int>   m_csedefined;   // Common subexpressions with the values saved to temporaries
+    int             m_csetemps;     // Number of temporaries for the common subexpressions
+    std::map<RuntimeSymbol, GeneratorInlineSpec> m_inlinespecs;  // Runtime routines allowed for inlining
+    int             m_inlinemaxsize;  // Max size of the routine to inline in loops, in bytes
+    int             m_inlinebudget;   // Bytes left for the code growth because of inlining
+    int             m_loopdepth;      // Number of FOR loops opened at the moment
+    std::map<string, GeneratorPointerSpec> m_pointers;  // Array element pointers of the loops opened at the moment
+    int             m_pointercount;   // Number of array element pointers
+    std::map<int, string> m_pointerwords;  // Pointers kept in memory: pointer number => array element
+    bool            m_threaded;       // Turn the lines into threaded code where it is shorter
+    std::vector<FinalLineSpan> m_linespans;  // Code of the lines in the final model
+    bool            m_nextnative;     // "REM $NATIVE" met, the next line stays in machine code
+    bool            m_profile;        // Count the runs of every line in the profile table
+    std::vector<int> m_profilelines;  // Indices of the source lines with the profile counters
 public:
     Generator(SourceModel* source, FinalModel* intermed,
         const std::vector<string>* initlines, const std::vector<string>* termlines);
 public:
+    void SetInlineBlocks(const std::vector<RuntimeBlock>& blocks, int maxsize, int budget);
+    void SetThreaded(bool threaded) { m_threaded = threaded; }
+    void SetProfile(bool profile) { m_profile = profile; }
     void ProcessBegin();
     bool ProcessLine();
     void ProcessEnd();
+    static void FormatLines(std::vector<string>& lines);
     void GenerateStrings();
     void GenerateVariables();
     void GenerateDataBlock();
     void GenerateRuntimeNeeds();
+    void GenerateProfileTable();
+    void AnnotateCosts(int topcount);
+    void WriteLineMap(std::ostream& out, int loadaddr) const;
+    void WriteMap(std::ostream& out, int loadaddr) const;
     const std::set<RuntimeSymbol> GetRuntimeNeeds() const { return m_runtimeneeds; }
 private:
     static const GeneratorKeywordSpec m_keywordspecs[];
@@ -692,16 +928,39 @@ private:
     void AddLine(const string& str) { m_final->AddLine(str); }
     void AddComment(const string& str) { m_final->AddComment(str); }
     void AddRuntimeCall(RuntimeSymbol need, string comment = "");
+    bool InlineRuntimeCall(RuntimeSymbol rtsymbol, const string& comment);
+    bool IsColdLoop() const;
     string GetNextLocalLabel() { return std::to_string(++m_local) + "$"; }
+    int GetConstStringIndex(const string& str);
+    int GetStringBufferSize(const string& canoname) const;
     void GenerateConstString(string label, string str);
     void GenerateStatement(StatementModel& statement);
     void GenerateExpression(const ExpressionModel& expr);
     void GenerateExpression(const ExpressionModel& expr, const ExpressionNode& node);
+    void GenerateCommonSubexpression(const ExpressionModel& expr, const ExpressionNode& node);
+    void GenerateLoopInvariants(const StatementModel& statement);
     void GenerateExprFunction(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateExprUnaryNot(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateExprUnaryMinus(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateExprBinaryOperation(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateAssignment(VariableExpressionModel& var, ExpressionModel& expr);
+    void GenerateArrayIndex(const ExpressionModel& expr);
+    void GenerateMultiplyByConst(int value);
+    void GenerateArrayIndexCheck(const string& canoname, int maxindex, const string& reg);
+    void GenerateArrayElementAddress(const string& canoname, const std::vector<ExpressionModel>& args);
+    void GenerateArrayElementPointer(const string& canoname, const std::vector<ExpressionModel>& args, const string& reg);
+    string GetArrayElementOperand(const string& canoname, const std::vector<ExpressionModel>& args) const;
+    void GenerateArrayElement(const ExpressionNode& node);
+    void GenerateArrayAssignment(VariableExpressionModel& var, ExpressionModel& expr);
+    bool HasJumpsIntoLoop(int nextindex) const;
+    void GenerateArrayPointers(const StatementModel& statement, GeneratorForSpec& forspec);
+    void GenerateArrayPointersNext(GeneratorForSpec& forspec);
+    bool IsCounterLoop(const StatementModel& statement, int& trips, int& finalvalue);
+    void GenerateForSingle(StatementModel& statement, GeneratorForSpec& forspec);
+    void GenerateForSingleValue(ExpressionModel& expr, const string& temp, const string& comment);
+    void GenerateNextSingle(const StatementModel& forstatement, const GeneratorForSpec& forspec);
+    void GenerateSingleConstPush(float fvalue);
+    void GenerateConditionJump(const ExpressionModel& expr, const ExpressionNode& node, bool jumpiftrue, const string& label);
 private:
     void GenerateIgnoredStatement(StatementModel& statement);
     void GenerateBeep(StatementModel& statement);
@@ -750,6 +1009,8 @@ private:
     void GenerateOperMod(const ExpressionModel& expr, const ExpressionNode& node, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
     void GenerateOperPower(const ExpressionModel& expr, const ExpressionNode& node, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
     void GenerateLogicOperArguments(const ExpressionModel& expr, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
+    void GenerateStringArguments(const ExpressionModel& expr, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
+    string GetStringOperand(const ExpressionNode& node);
     void GenerateOperEqual(const ExpressionModel& expr, const ExpressionNode& node, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
     void GenerateOperNotEqual(const ExpressionModel& expr, const ExpressionNode& node, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
     void GenerateOperLess(const ExpressionModel& expr, const ExpressionNode& node, const ExpressionNode& nodeleft, const ExpressionNode& noderight);
@@ -784,9 +1045,50 @@ private:
     void GenerateFuncAsc(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateFuncChr(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateFuncString(const ExpressionModel& expr, const ExpressionNode& node);
+    void GenerateFuncMid(const ExpressionModel& expr, const ExpressionNode& node);
     void GenerateFuncIif(const ExpressionModel& expr, const ExpressionNode& node);
 };
 
+// Assembler code line split to parts
+struct AsmLineModel
+{
+    string  label;      // Label defined on the line, without ':'
+    string  opcode;     // Instruction or directive
+    std::vector<string> operands;
+    string  comment;    // Comment including ';'
+    bool    parsed;     // false if the line format was not recognized
+public:
+    AsmLineModel() : parsed(false) {}
+public:
+    void Parse(const string& line);
+    string Format() const;
+    int GetSize() const;  // Size of the code in bytes, -1 if unknown
+    int GetCycles(TargetPlatform platform) const;  // Estimated time of the instruction in CPU cycles, -1 if unknown
+    static bool IsLocalLabel(const string& name);
+    static bool IsLabelName(const string& name);
+};
+
+class Optimizer
+{
+    FinalModel* m_final;
+    std::vector<FinalLineSpan>* m_spans;  // Code of the BASIC lines, kept in place when the lines are rewritten
+public:
+    Optimizer(FinalModel* final, std::vector<FinalLineSpan>* spans);
+public:
+    void RelaxBranches();
+    void RemoveRedundantLoads();
+    int ThreadCode(std::vector<string>& primitives);
+    void EstimateLineCosts(TargetPlatform platform, std::vector<FinalLineCost>& costs);
+private:
+    void UpdateLineSpans(const std::vector<size_t>& newindex);
+};
+
+// Addresses of the assembler lines, see optimizer.cpp
+int GetAsmAddresses(const std::vector<string>& lines, int startaddr, std::vector<int>& addrs);
+
+// LZ packing for the self-extracting image, see compressor.cpp
+void LzPack(const std::vector<uint8_t>& data, std::vector<uint8_t>& packed, int& margin);
+
 class RuntimeGenerator
 {
     std::set<RuntimeSymbol> m_needs;
@@ -798,6 +1100,7 @@ public:
     void ParseRuntimeTemplate(std::istream* pInput);
     void GenerateRuntime(const std::set<RuntimeSymbol>& needs);
     void GetRuntimeBlock(RuntimeSymbol rtsymbol, std::vector<string>& copyto);
+    void GetInlineBlocks(std::vector<RuntimeBlock>& copyto);
 private:
     RuntimeBlock FindRuntimeBlock(RuntimeSymbol rtsymbol);
     void AddLine(const string& str) { m_final->AddRuntimeLine(str); }
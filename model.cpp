@@ -351,7 +351,7 @@ bool ExpressionModel::IsVariableExpression() const
         return false;
 
     const ExpressionNode& noderoot = nodes[root];
-    return noderoot.token.type == TokenTypeIdentifier;
+    return noderoot.token.type == TokenTypeIdentifier && noderoot.args.empty();
 }
 
 string ExpressionModel::GetVariableExpressionDecoratedName() const
@@ -377,6 +377,69 @@ ValueType ExpressionModel::GetExpressionValueType() const
     return noderoot.token.vtype;
 }
 
+bool ExpressionModel::IsBooleanNode(const ExpressionNode& node) const
+{
+    if (node.constval)
+        return (node.vtype == ValueTypeInteger || node.vtype == ValueTypeSingle) &&
+            (node.token.dvalue == -1 || node.token.dvalue == 0);
+
+    if (node.token.type != TokenTypeOperation)
+        return false;
+
+    if (node.left == -1 && node.right >= 0)  // unary operation
+        return node.token.keyword == KeywordNOT && IsBooleanNode(nodes[node.right]);
+
+    if (node.left < 0 || node.right < 0)
+        return false;
+
+    const string& text = node.token.text;
+    if (text == "=" || text == "<>" || text == "><" || text == "<" || text == ">" ||
+        text == "<=" || text == ">=" || text == "=<" || text == "=>")
+        return true;
+    if (text == "AND" || text == "OR" || text == "XOR" || text == "EQV")
+        return IsBooleanNode(nodes[node.left]) && IsBooleanNode(nodes[node.right]);
+
+    return false;
+}
+
+bool ExpressionModel::IsSideEffectNode(const ExpressionNode& node) const
+{
+    if (node.token.type == TokenTypeKeyword)
+    {
+        KeywordIndex keyword = node.token.keyword;
+        if (keyword == KeywordRND || keyword == KeywordINKEY || keyword == KeywordINP || keyword == KeywordPEEK)
+            return true;
+    }
+
+    for (const ExpressionModel& arg : node.args)
+    {
+        if (!arg.IsEmpty() && arg.IsSideEffectNode(arg.nodes[arg.root]))
+            return true;
+    }
+
+    if (node.left >= 0 && IsSideEffectNode(nodes[node.left]))
+        return true;
+    if (node.right >= 0 && IsSideEffectNode(nodes[node.right]))
+        return true;
+
+    return false;
+}
+
+bool ExpressionModel::IsVariableUsed(const string& canoname) const
+{
+    for (const ExpressionNode& node : nodes)
+    {
+        if (node.token.type == TokenTypeIdentifier && GetCanonicVariableName(node.token.text) == canoname)
+            return true;
+        for (const ExpressionModel& arg : node.args)
+        {
+            if (arg.IsVariableUsed(canoname))
+                return true;
+        }
+    }
+    return false;
+}
+
 int ExpressionModel::AddOperationNode(ExpressionNode& node, int prev)
 {
     int index = (int)nodes.size();
@@ -421,6 +484,94 @@ int ExpressionModel::AddOperationNode(ExpressionNode& node, int prev)
     return index;
 }
 
+//////////////////////////////////////////////////////////////////////
+// StatementModel
+
+bool StatementModel::IsVariableUsed(const string& canoname) const
+{
+    if (ident.type == TokenTypeIdentifier && GetCanonicVariableName(ident.text) == canoname)
+        return true;
+    for (const ExpressionModel& expr : args)
+    {
+        if (expr.IsVariableUsed(canoname))
+            return true;
+    }
+    for (const Token& param : params)
+    {
+        if (param.type == TokenTypeIdentifier && GetCanonicVariableName(param.text) == canoname)
+            return true;
+    }
+    for (const VariableModel& var : variables)
+    {
+        if (var.GetVariableCanonicName() == canoname)
+            return true;
+    }
+    for (const VariableExpressionModel& var : varexprs)
+    {
+        if (var.GetVariableCanonicName() == canoname)
+            return true;
+        for (const ExpressionModel& expr : var.args)
+        {
+            if (expr.IsVariableUsed(canoname))
+                return true;
+        }
+    }
+    if (stthen != nullptr && stthen->IsVariableUsed(canoname))
+        return true;
+    if (stelse != nullptr && stelse->IsVariableUsed(canoname))
+        return true;
+    return false;
+}
+
+bool StatementModel::IsControlTransfer() const
+{
+    switch (token.keyword)
+    {
+    case KeywordGOTO:
+    case KeywordGOSUB:
+    case KeywordON:
+    case KeywordRETURN:
+    case KeywordEND:
+    case KeywordSTOP:
+        return true;
+    case KeywordIF:
+        if ((stthen == nullptr && params.size() >= 1) || (stelse == nullptr && params.size() >= 2))
+            return true;  // THEN linenum or ELSE linenum
+        break;
+    default:
+        break;
+    }
+    if (stthen != nullptr && stthen->IsControlTransfer())
+        return true;
+    if (stelse != nullptr && stelse->IsControlTransfer())
+        return true;
+    return false;
+}
+
+void StatementModel::GetJumpTargets(std::vector<int>& linenums) const
+{
+    if (token.keyword == KeywordGOTO || token.keyword == KeywordGOSUB)
+        linenums.push_back(paramline);
+    else if (token.keyword == KeywordON)
+    {
+        for (const Token& param : params)
+            linenums.push_back((int)param.dvalue);
+    }
+    else if (token.keyword == KeywordIF)
+    {
+        if (stthen == nullptr && params.size() >= 1)
+            linenums.push_back((int)params[0].dvalue);
+        if (stelse == nullptr && params.size() >= 2)
+            linenums.push_back((int)params[1].dvalue);
+    }
+
+    if (stthen != nullptr)
+        stthen->GetJumpTargets(linenums);
+    if (stelse != nullptr)
+        stelse->GetJumpTargets(linenums);
+}
+
+
 //////////////////////////////////////////////////////////////////////
 // SourceLineModel
 
@@ -446,6 +597,16 @@ bool SourceModel::IsVariableRegistered(const string& varname) const
     return false;
 }
 
+const VariableModel* SourceModel::GetVariable(const string& varname) const
+{
+    for (auto it = std::begin(vars); it != std::end(vars); ++it)
+    {
+        if (it->name == varname)
+            return &(*it);
+    }
+    return nullptr;
+}
+
 bool SourceModel::RegisterVariable(const VariableModel& var)
 {
     for (auto it = std::begin(vars); it != std::end(vars); ++it)
@@ -464,7 +625,7 @@ bool SourceModel::RegisterVariable(const VariableExpressionModel& var)
     VariableModel var1;
     var1.name = var.name;
     for (auto it = std::begin(var.args); it != std::end(var.args); it++)
-        var1.indices.push_back(1);
+        var1.indices.push_back(10);  // Array without DIM has indices 0..10
 
     return RegisterVariable(var1);
 }
@@ -512,11 +673,35 @@ SourceLineModel& SourceModel::GetSourceLine(int srclinenumber)
     exit(EXIT_FAILURE);
 }
 
+// Take the line run counts from the profile, keyed by the line labels: "N100" by line number, "L7" for the line
+// without number by source line number. The line is hot when it runs at least 1/16 of the times of the most run line.
+// Returns the number of the profile keys not found in the program.
+int SourceModel::ApplyProfile(const std::map<string, int64_t>& counts)
+{
+    const int hotshare = 16;
+
+    int64_t maxcount = 0;
+    size_t found = 0;
+    for (SourceLineModel& line : lines)
+    {
+        auto it = counts.find(line.GetLineNumberLabel());
+        if (it == counts.end())
+            continue;
+        line.runcount = it->second;
+        maxcount = std::max(maxcount, line.runcount);
+        found++;
+    }
+    for (SourceLineModel& line : lines)
+        line.hot = (line.runcount > 0 && line.runcount * hotshare >= maxcount);
+
+    return (int)(counts.size() - found);
+}
+
 void SourceModel::RegisterConstString(const string& str)
 {
     if (str.empty())  // We're not registering an empty string, always have one
         return;
-    if (str.length() < 2)  // one-char strings will be assigned inline, no need for const string
+    if (str.length() < 2)  // one-char strings are mostly printed inline, the generator adds them when needed
         return;
 
     for (auto it = std::begin(conststrings); it != std::end(conststrings); ++it)
@@ -592,15 +777,20 @@ const char* RuntimeSymbolNames[] = {
     "FCMP", "FSGN",
     "FADD", "FSUB", "FMUL", "FDIV",  // FIS
     "FPACK", "INPF",
-    "",  // Reserved
+    "UNLZ",
     "FRND", "FSQR", "FPWF", "FPWI",
     "FCOS", "FSIN", "FTAN", "FATN", "FEXP", "FLOG",
     "REST", "REAI", "REAF", "REAS",
     "INKEY",
     "STCP", "STCM",
     "SSAL",
-    "",  // Reserved
+    "ARRE",
     "COLR",
+    "STAS", "SSFR",
+    "STCAT", "STCHR", "STSTR", "STMID",
+    "THRD",
+    "PDUMP",
+    "HEAP",
 };
 
 string GetRuntimeSymbolName(RuntimeSymbol rtsymbol)
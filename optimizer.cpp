@@ -0,0 +1,1904 @@
+﻿
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <map>
+
+#include "main.h"
+
+
+//////////////////////////////////////////////////////////////////////
+// Assembler code lines
+
+
+static const char* const AsmNoOperandOpcodes[] = {
+    "HALT", "WAIT", "RTI", "BPT", "IOT", "RESET", "RTT", "NOP", "RETURN",
+    "CLC", "CLV", "CLZ", "CLN", "CCC", "SEC", "SEV", "SEZ", "SEN", "SCC",
+};
+static const char* const AsmOperandOpcodes[] = {
+    "CLR", "CLRB", "COM", "COMB", "INC", "INCB", "DEC", "DECB", "NEG", "NEGB",
+    "ADC", "ADCB", "SBC", "SBCB", "TST", "TSTB", "ROR", "RORB", "ROL", "ROLB",
+    "ASR", "ASRB", "ASL", "ASLB", "SWAB", "SXT", "MTPS", "MFPS", "JMP", "CALL", "RTS",
+    "FADD", "FSUB", "FMUL", "FDIV",
+    "MOV", "MOVB", "CMP", "CMPB", "BIT", "BITB", "BIC", "BICB", "BIS", "BISB",
+    "ADD", "SUB", "JSR", "XOR", "MUL", "DIV", "ASH", "ASHC",
+};
+// One-word instructions with offset or number packed into the instruction word
+static const char* const AsmPackedOpcodes[] = {
+    "BR", "BNE", "BEQ", "BGE", "BLT", "BGT", "BLE", "BPL", "BMI", "BHI", "BLOS",
+    "BVC", "BVS", "BCC", "BCS", "BHIS", "BLO", "SOB", "EMT", "TRAP", "MARK",
+};
+
+// Conditional branches and its inversions
+static const char* const AsmBranchInversions[][2] = {
+    { "BNE", "BEQ" }, { "BEQ", "BNE" }, { "BGE", "BLT" }, { "BLT", "BGE" },
+    { "BGT", "BLE" }, { "BLE", "BGT" }, { "BPL", "BMI" }, { "BMI", "BPL" },
+    { "BHI", "BLOS" }, { "BLOS", "BHI" }, { "BVC", "BVS" }, { "BVS", "BVC" },
+    { "BCC", "BCS" }, { "BCS", "BCC" }, { "BHIS", "BLO" }, { "BLO", "BHIS" },
+};
+
+template<size_t N>
+static bool IsOneOf(const string& opcode, const char* const (&list)[N])
+{
+    for (const char* item : list)
+    {
+        if (opcode == item)
+            return true;
+    }
+    return false;
+}
+
+static string GetInvertedBranch(const string& opcode)
+{
+    for (auto& inversion : AsmBranchInversions)
+    {
+        if (opcode == inversion[0])
+            return inversion[1];
+    }
+    return string();
+}
+
+static string TrimAsmText(const string& text)
+{
+    size_t start = text.find_first_not_of(" \t");
+    if (start == string::npos)
+        return string();
+    size_t end = text.find_last_not_of(" \t");
+    return text.substr(start, end - start + 1);
+}
+
+void AsmLineModel::Parse(const string& line)
+{
+    label.clear();  opcode.clear();  operands.clear();  comment.clear();
+    parsed = true;
+
+    size_t pos = 0;
+    if (!line.empty() && line[0] != '\t' && line[0] != ' ' && line[0] != ';')
+    {
+        size_t colon = line.find(':');
+        if (colon == string::npos)  // Assignment like "SAVESP = . + 2" or something unusual
+        {
+            parsed = false;
+            return;
+        }
+        label = line.substr(0, colon);
+        pos = colon + 1;
+    }
+
+    size_t semicolon = line.find(';', pos);
+    if (semicolon != string::npos)
+        comment = line.substr(semicolon);
+    string text = TrimAsmText(line.substr(pos, semicolon == string::npos ? string::npos : semicolon - pos));
+    if (text.empty())
+        return;
+
+    size_t space = text.find_first_of(" \t");
+    opcode = text.substr(0, space);
+    if (space == string::npos)
+        return;
+
+    string rest = TrimAsmText(text.substr(space));
+    while (!rest.empty())
+    {
+        size_t comma = rest.find(',');
+        operands.push_back(TrimAsmText(rest.substr(0, comma)));
+        if (comma == string::npos)
+            break;
+        rest = rest.substr(comma + 1);
+    }
+}
+
+string AsmLineModel::Format() const
+{
+    string result = label.empty() ? "" : label + ":";
+    if (!opcode.empty())
+    {
+        result += "\t" + opcode;
+        for (size_t i = 0; i < operands.size(); i++)
+            result += (i == 0 ? "\t" : ", ") + operands[i];
+    }
+    if (!comment.empty())
+        result += "\t" + comment;
+    return result;
+}
+
+static bool IsAsmRegister(const string& text)
+{
+    if (text == "SP" || text == "PC")
+        return true;
+    return text.size() == 2 && (text[0] == 'R' || text[0] == '%') && text[1] >= '0' && text[1] <= '7';
+}
+
+// Check if the operand needs an extra word after the instruction word
+static bool IsAsmOperandExtended(string operand)
+{
+    if (!operand.empty() && operand[0] == '@')
+        operand.erase(0, 1);
+    if (IsAsmRegister(operand))
+        return false;
+    if (!operand.empty() && operand[0] == '-')  // -(Rn)
+        operand.erase(0, 1);
+    if (!operand.empty() && operand[operand.size() - 1] == '+')  // (Rn)+
+        operand.erase(operand.size() - 1);
+    if (operand.size() > 2 && operand[0] == '(' && operand[operand.size() - 1] == ')')
+        return !IsAsmRegister(operand.substr(1, operand.size() - 2));
+    return true;  // #n, @#n, n(Rn), label
+}
+
+int AsmLineModel::GetSize() const
+{
+    if (!parsed)
+        return -1;
+    if (opcode.empty())
+        return 0;
+    if (IsOneOf(opcode, AsmNoOperandOpcodes) || IsOneOf(opcode, AsmPackedOpcodes))
+        return 2;
+    if (IsOneOf(opcode, AsmOperandOpcodes))
+    {
+        int size = 2;
+        for (const string& operand : operands)
+        {
+            if (IsAsmOperandExtended(operand))
+                size += 2;
+        }
+        return size;
+    }
+    if (opcode == ".WORD")
+        return (int)operands.size() * 2;
+
+    return -1;  // Unknown opcode or directive
+}
+
+// Instruction timings in CPU cycles, rough figures good enough to compare the code variants
+struct AsmTimings
+{
+    TargetPlatform platform;
+    int     basic;      // Instruction with register operands
+    int     source[8];  // Extra for the source operand, or the only operand not changed, by addressing mode
+    int     dest[8];    // Extra for the destination operand, by addressing mode
+    int     branch;     // BR, Bxx, SOB
+    int     jump;       // JMP, plus the operand address calculation
+    int     call;       // CALL, JSR, plus the operand address calculation
+    int     ret;        // RETURN, RTS
+    int     trap;       // EMT, TRAP, IOT, BPT; the time of the handler is not known
+    int     mul;        // MUL, -1 if not supported
+    int     div;        // DIV
+    int     shift;      // ASH, ASHC
+    int     fis;        // FADD, FSUB, FMUL, FDIV
+};
+
+static const AsmTimings AsmTimingsTable[] = {
+    // BK0010: K1801VM1, no EIS and FIS instructions
+    { PlatformBK0010, 12, { 0, 12, 12, 20, 12, 20, 20, 28 }, { 0, 20, 20, 28, 20, 28, 28, 36 },
+      16, 12, 32, 28, 68, -1, -1, -1, -1 },
+    // UKNC: K1801VM2
+    { PlatformUKNC, 8, { 0, 8, 8, 16, 8, 16, 16, 24 }, { 0, 12, 12, 20, 12, 20, 20, 28 },
+      10, 8, 20, 16, 48, 72, 128, 40, 240 },
+};
+
+// Addressing mode of the operand: 0 for Rn, 1 for (Rn), ... 7 for @X(Rn); labels and #n are PC modes 6 and 2
+static int GetAsmOperandMode(const string& operand)
+{
+    bool deferred = !operand.empty() && operand[0] == '@';
+    string text = deferred ? operand.substr(1) : operand;
+    if (IsAsmRegister(text))
+        return deferred ? 1 : 0;
+    if (!text.empty() && text[0] == '#')
+        return deferred ? 3 : 2;
+    if (text.size() > 3 && text[0] == '-' && text[1] == '(')
+        return deferred ? 5 : 4;
+    if (text.size() > 3 && text[0] == '(' && text[text.size() - 1] == '+')
+        return deferred ? 3 : 2;
+    if (text.size() > 2 && text[0] == '(' && text[text.size() - 1] == ')')
+        return deferred ? 7 : 1;
+    return deferred ? 7 : 6;  // X(Rn) or label
+}
+
+int AsmLineModel::GetCycles(TargetPlatform platform) const
+{
+    if (!parsed)
+        return -1;
+    if (opcode.empty())
+        return 0;
+    const AsmTimings* timings = nullptr;
+    for (const AsmTimings& item : AsmTimingsTable)
+    {
+        if (item.platform == platform)
+            timings = &item;
+    }
+    if (timings == nullptr)
+        return -1;
+
+    if (opcode == "RETURN" || opcode == "RTS")
+        return timings->ret;
+    if (opcode == "EMT" || opcode == "TRAP" || opcode == "IOT" || opcode == "BPT")
+        return timings->trap;
+    if (IsOneOf(opcode, AsmPackedOpcodes))
+        return timings->branch;
+    if (IsOneOf(opcode, AsmNoOperandOpcodes))
+        return timings->basic;
+    if (!IsOneOf(opcode, AsmOperandOpcodes) || operands.empty())
+        return -1;
+
+    int cycles = timings->basic;
+    if (opcode == "JMP")
+        cycles = timings->jump;
+    else if (opcode == "CALL" || opcode == "JSR")
+        cycles = timings->call;
+    else if (opcode == "MUL")
+        cycles = timings->mul;
+    else if (opcode == "DIV")
+        cycles = timings->div;
+    else if (opcode == "ASH" || opcode == "ASHC")
+        cycles = timings->shift;
+    else if (opcode[0] == 'F')
+        cycles = timings->fis;
+    if (cycles < 0)
+        return -1;  // Not supported on the platform
+
+    if (operands.size() == 1)  // The operand is read only, or changed
+    {
+        bool readonly = (opcode == "TST" || opcode == "TSTB" || opcode == "JMP" || opcode == "CALL" ||
+                         opcode == "MTPS" || opcode[0] == 'F');
+        return cycles + (readonly ? timings->source : timings->dest)[GetAsmOperandMode(operands[0])];
+    }
+    if (opcode == "JSR" || opcode == "XOR")  // Register, then the address or the destination
+        return cycles + (opcode == "JSR" ? timings->source : timings->dest)[GetAsmOperandMode(operands[1])];
+    if (opcode == "MUL" || opcode == "DIV" || opcode == "ASH" || opcode == "ASHC")  // Source, then register
+        return cycles + timings->source[GetAsmOperandMode(operands[0])];
+    return cycles + timings->source[GetAsmOperandMode(operands[0])] + timings->dest[GetAsmOperandMode(operands[1])];
+}
+
+bool AsmLineModel::IsLocalLabel(const string& name)
+{
+    return !name.empty() && name[name.size() - 1] == '$';
+}
+
+// Check for plain label name, like "N100" or "2$"
+bool AsmLineModel::IsLabelName(const string& name)
+{
+    if (name.empty() || (name[0] >= '0' && name[0] <= '9' && !IsLocalLabel(name)))
+        return false;
+    for (char ch : name)
+    {
+        if (!((ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '$' || ch == '.' || ch == '_'))
+            return false;
+    }
+    return name != ".";
+}
+
+// Get offset for operand like ".+6" or ".-4", in bytes; returns false if the operand is not relative to '.'
+static bool GetAsmDotOffset(const string& operand, int& offset)
+{
+    if (operand.size() < 3 || operand[0] != '.' || (operand[1] != '+' && operand[1] != '-'))
+        return false;
+    string number = operand.substr(2);
+    bool decimal = (number[number.size() - 1] == '.');
+    if (decimal)
+        number.erase(number.size() - 1);
+    offset = (int)std::strtol(number.c_str(), nullptr, decimal ? 10 : 8);
+    if (operand[1] == '-')
+        offset = -offset;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Branch relaxation
+
+enum RelaxKind
+{
+    RelaxNone = 0,
+    RelaxJump,      // JMP label  =>  BR label
+    RelaxBranch,    // BR/Bxx label, expanded to JMP or Bxx-over-JMP if the label is too far
+    RelaxSkipJump,  // Bxx over JMP label  =>  inverted Bxx label
+};
+
+struct RelaxItem
+{
+    RelaxKind kind;
+    bool isshort;
+    size_t target;  // Line index for the target label
+    size_t jump;    // Line index for the skipped JMP, for RelaxSkipJump
+};
+
+Optimizer::Optimizer(FinalModel* final, std::vector<FinalLineSpan>* spans)
+    : m_final(final), m_spans(spans)
+{
+    assert(final != nullptr);
+}
+
+// Move the starts of the line spans after the lines are rewritten; newindex[i] is the new index of the old line i
+void Optimizer::UpdateLineSpans(const std::vector<size_t>& newindex)
+{
+    if (m_spans == nullptr)
+        return;
+    for (FinalLineSpan& span : *m_spans)
+    {
+        if (span.start < newindex.size())
+            span.start = newindex[span.start];
+    }
+}
+
+// Replace JMP with BR, and Bxx-over-JMP with inverted Bxx, when the target is within the branch range;
+// expand BR/Bxx with target out of the range.
+void Optimizer::RelaxBranches()
+{
+    std::vector<string>& lines = m_final->lines;
+    size_t count = lines.size();
+
+    std::vector<AsmLineModel> asmlines(count);
+    for (size_t i = 0; i < count; i++)
+        asmlines[i].Parse(lines[i]);
+
+    // Collect labels; local label scope is between two regular labels
+    std::map<string, size_t> labels;
+    std::vector<int> scopes(count);
+    int scope = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const string& label = asmlines[i].label;
+        if (!label.empty() && !AsmLineModel::IsLocalLabel(label))
+            scope++;
+        scopes[i] = scope;
+        if (label.empty())
+            continue;
+        string key = AsmLineModel::IsLocalLabel(label) ? std::to_string(scope) + ":" + label : label;
+        labels[key] = i;
+    }
+    auto findlabel = [&](size_t index, const string& name, size_t& target) -> bool
+    {
+        if (!AsmLineModel::IsLabelName(name))
+            return false;
+        string key = AsmLineModel::IsLocalLabel(name) ? std::to_string(scopes[index]) + ":" + name : name;
+        auto it = labels.find(key);
+        if (it == labels.end())
+            return false;
+        target = it->second;
+        return true;
+    };
+    // Find next line with code or label, skipping comments
+    auto findnext = [&](size_t index) -> size_t
+    {
+        for (index++; index < count; index++)
+        {
+            const AsmLineModel& asmline = asmlines[index];
+            if (!asmline.parsed || !asmline.label.empty() || !asmline.opcode.empty())
+                break;
+        }
+        return index;
+    };
+
+    // Find candidates
+    std::vector<RelaxItem> items(count, RelaxItem { RelaxNone, false, 0, 0 });
+    std::vector<int> owners(count, -1);  // For JMP lines owned by RelaxSkipJump items, index of the owner
+    for (size_t i = 0; i < count; i++)
+    {
+        const AsmLineModel& asmline = asmlines[i];
+        if (asmline.operands.size() != 1 || owners[i] >= 0)
+            continue;
+        RelaxItem& item = items[i];
+        const string& operand = asmline.operands[0];
+
+        if (asmline.opcode == "JMP" && findlabel(i, operand, item.target))
+        {
+            item.kind = RelaxJump;
+            continue;
+        }
+
+        bool isbranch = (asmline.opcode == "BR" || !GetInvertedBranch(asmline.opcode).empty());
+        if (!isbranch)
+            continue;
+
+        // Conditional branch over JMP, like "BGE .+6 / JMP X1" or "BEQ 2$ / JMP N100 / 2$:"
+        size_t next = findnext(i);
+        if (asmline.opcode != "BR" && next < count &&
+            asmlines[next].opcode == "JMP" && asmlines[next].label.empty() && asmlines[next].operands.size() == 1 &&
+            findlabel(next, asmlines[next].operands[0], item.target))
+        {
+            size_t after = findnext(next);
+            int offset;
+            size_t skipto;
+            bool skipsjump = (GetAsmDotOffset(operand, offset) && offset == 6 && next == i + 1) ||
+                (findlabel(i, operand, skipto) && skipto == after);
+            if (skipsjump)
+            {
+                item.kind = RelaxSkipJump;
+                item.jump = next;
+                owners[next] = (int)i;
+                continue;
+            }
+        }
+
+        if (findlabel(i, operand, item.target))
+            item.kind = RelaxBranch;
+    }
+
+    // Calculate addresses; every line of unknown size starts a new segment, distances are known only within a segment
+    std::vector<int> sizes(count);
+    for (size_t i = 0; i < count; i++)
+        sizes[i] = asmlines[i].GetSize();
+    std::vector<int> addrs(count + 1);
+    std::vector<int> segments(count + 1);
+    auto calcaddrs = [&]()
+    {
+        int addr = 0, segment = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            addrs[i] = addr;  segments[i] = segment;
+            if (sizes[i] < 0)
+            {
+                segment++;  addr = 0;
+            }
+            else
+                addr += sizes[i];
+        }
+        addrs[count] = addr;  segments[count] = segment;
+    };
+    calcaddrs();
+
+    // Code covered by ".+N" offsets should keep its size
+    for (size_t i = 0; i < count; i++)
+    {
+        const AsmLineModel& asmline = asmlines[i];
+        int offset;
+        if (items[i].kind == RelaxSkipJump || asmline.operands.empty() || !GetAsmDotOffset(asmline.operands[0], offset))
+            continue;
+        int from = std::min(addrs[i], addrs[i] + offset);
+        int to = std::max(addrs[i], addrs[i] + offset);
+        for (size_t j = 0; j < count; j++)
+        {
+            if (j == i || segments[j] != segments[i] || addrs[j] < from || addrs[j] >= to)
+                continue;
+            items[j].kind = RelaxNone;  // pinned
+            if (owners[j] >= 0)
+                items[owners[j]].kind = RelaxNone;
+        }
+    }
+    // Branches we can't measure are left as is
+    for (size_t i = 0; i < count; i++)
+    {
+        RelaxItem& item = items[i];
+        if (item.kind != RelaxNone && segments[i] != segments[item.target])
+            item.kind = RelaxNone;
+    }
+
+    // Start with all the candidates in long form
+    auto setsize = [&](size_t i)
+    {
+        const RelaxItem& item = items[i];
+        if (item.kind == RelaxJump)
+            sizes[i] = item.isshort ? 2 : 4;
+        else if (item.kind == RelaxBranch)
+            sizes[i] = item.isshort ? 2 : (asmlines[i].opcode == "BR" ? 4 : 6);
+        else if (item.kind == RelaxSkipJump)
+            sizes[item.jump] = item.isshort ? 0 : 4;
+    };
+    for (size_t i = 0; i < count; i++)
+        setsize(i);
+
+    // Shrink the jumps while there are jumps within the range; shrinking makes distances only shorter
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        calcaddrs();
+        for (size_t i = 0; i < count; i++)
+        {
+            RelaxItem& item = items[i];
+            if (item.kind == RelaxNone || item.isshort)
+                continue;
+            int offset = addrs[item.target] - (addrs[i] + 2);
+            if (offset >= -256 && offset <= 254)
+            {
+                item.isshort = true;
+                setsize(i);
+                changed = true;
+            }
+        }
+    }
+
+    // Rewrite the lines
+    std::vector<string> result;
+    result.reserve(count);
+    std::vector<size_t> newindex(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        newindex[i] = result.size();
+        const RelaxItem& item = items[i];
+        AsmLineModel asmline = asmlines[i];
+        if (item.kind == RelaxJump && item.isshort)
+        {
+            asmline.opcode = "BR";
+            result.push_back(asmline.Format());
+        }
+        else if (item.kind == RelaxBranch && !item.isshort)
+        {
+            if (asmline.opcode == "BR")
+            {
+                asmline.opcode = "JMP";
+                result.push_back(asmline.Format());
+            }
+            else
+            {
+                AsmLineModel asmjump = asmline;
+                asmline.opcode = GetInvertedBranch(asmline.opcode);
+                asmline.operands[0] = ".+6";
+                asmline.comment.clear();
+                result.push_back(asmline.Format());
+                asmjump.label.clear();
+                asmjump.opcode = "JMP";
+                result.push_back(asmjump.Format());
+            }
+        }
+        else if (item.kind == RelaxSkipJump && item.isshort)
+        {
+            const AsmLineModel& asmjump = asmlines[item.jump];
+            asmline.opcode = GetInvertedBranch(asmline.opcode);
+            asmline.operands[0] = asmjump.operands[0];
+            asmline.comment = asmjump.comment;
+            result.push_back(asmline.Format());
+        }
+        else if (owners[i] >= 0 && items[owners[i]].kind == RelaxSkipJump && items[owners[i]].isshort)
+            ;  // skip the JMP line replaced with the branch
+        else
+            result.push_back(lines[i]);
+    }
+
+    lines.swap(result);
+    UpdateLineSpans(newindex);
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Peephole optimizations
+
+// Remove "MOV X, R0" right after "MOV R0, X" or "MOV X, R0", where X is a variable; the flags are the same as well.
+// The lines between could be comments only, any label means that the control could come from elsewhere.
+void Optimizer::RemoveRedundantLoads()
+{
+    std::vector<string>& lines = m_final->lines;
+    size_t count = lines.size();
+
+    std::vector<AsmLineModel> asmlines(count);
+    for (size_t i = 0; i < count; i++)
+        asmlines[i].Parse(lines[i]);
+
+    std::vector<bool> removed(count, false);
+    for (size_t i = 0; i < count; i++)
+    {
+        const AsmLineModel& asmline = asmlines[i];
+        if (removed[i] || asmline.opcode != "MOV" || asmline.operands.size() != 2)
+            continue;
+        string variable;
+        if (asmline.operands[0] == "R0")
+            variable = asmline.operands[1];
+        else if (asmline.operands[1] == "R0")
+            variable = asmline.operands[0];
+        if (!AsmLineModel::IsLabelName(variable) || AsmLineModel::IsLocalLabel(variable) || IsAsmRegister(variable))
+            continue;
+
+        for (size_t j = i + 1; j < count; j++)
+        {
+            const AsmLineModel& asmnext = asmlines[j];
+            if (!asmnext.parsed || !asmnext.label.empty())
+                break;
+            if (asmnext.opcode.empty())
+                continue;  // comment line
+            if (asmnext.opcode == "MOV" && asmnext.operands.size() == 2 &&
+                asmnext.operands[0] == variable && asmnext.operands[1] == "R0")
+                removed[j] = true;
+            break;
+        }
+    }
+
+    std::vector<string> result;
+    result.reserve(count);
+    std::vector<size_t> newindex(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        newindex[i] = result.size();
+        if (!removed[i])
+            result.push_back(lines[i]);
+    }
+
+    lines.swap(result);
+    UpdateLineSpans(newindex);
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Threaded code
+//
+// A run of threaded lines starts with "JSR R5, THRD", then goes the list of addresses, R5 points to the next one.
+// Every primitive ends with "JMP @(R5)+"; the address of machine code in the list means a jump there.
+// The primitives are the instruction sequences of the threaded lines, the same sequences share one primitive.
+// A primitive could take the immediate values and the addresses from the list: "MOV #3, R1" => "MOV (R5)+, R1".
+
+enum ThreadStepKind
+{
+    ThreadStepComment,  // Comment line, copied as is
+    ThreadStepLabel,
+    ThreadStepAtom,     // Instructions to run in a primitive; several atoms in a row could share one primitive
+    ThreadStepJump,     // BR or JMP to a label
+    ThreadStepBranch,   // Conditional branch to a label
+    ThreadStepGosub,    // CALL of the program code
+};
+
+struct ThreadStep
+{
+    ThreadStepKind kind;
+    size_t  line;       // Index of the line
+    size_t  refline;    // For jumps: index of the line with the target label
+    string  text;       // Label; jump target; atom instructions
+    string  opcode;     // Branch opcode
+    int     size;       // Atom code size in bytes
+    bool    calls;      // The atom calls a subroutine, R5 should be saved
+    bool    returns;    // The atom ends with RETURN
+    bool    flagsin;    // The atom starts with the instruction using the flags set before
+    bool    flagsout;   // The atom does not end with a call, R5 is restored after the call
+    bool    flagsnext;  // The next step uses the flags set by the atom
+    string  primitive;  // Primitive started by the atom, 'L' or 'P' then instructions; empty for continuation
+    bool    tcall;      // The atom is a CALL done with TCALL
+    string  ptext;      // Atom instructions taking the parameters from the list
+    string  pshape;     // For every instruction: 'c' call, 'p' takes parameters, '-' other
+    std::vector<string> params;  // Parameters of ptext
+    std::vector<string> args;    // Parameters of the primitive started by the atom
+};
+
+struct ThreadSegment
+{
+    size_t  start, end;  // Range of lines
+    bool    threaded;
+    int     nativesize;
+    int     threadsize;
+    std::vector<ThreadStep> steps;
+};
+
+// Primitive candidate: sequence of atoms met in the threaded code
+struct ThreadSequence
+{
+    int     count;
+    int     size;       // Size of the instructions, without the parameters
+    int     nparams;
+    bool    calls;
+    bool    returns;
+    bool    keepflags;  // The flags after the final call are used, keep them when R5 is restored
+};
+
+const int ThreadMaxSequence = 8;  // Max atoms in one primitive
+const int ThreadRuntimeSize = 50;  // Size of THRD block in the runtime
+
+// Instructions using the condition codes set by the previous instruction
+static bool IsAsmFlagsUser(const string& opcode)
+{
+    return !GetInvertedBranch(opcode).empty() ||
+        opcode == "ADC" || opcode == "ADCB" || opcode == "SBC" || opcode == "SBCB";
+}
+
+static bool IsAsmCallLike(const string& opcode)
+{
+    return opcode == "CALL" || opcode == "EMT" || opcode == "TRAP";
+}
+
+// Check for the operand like "VARIX" or "VARIS+4."
+static bool IsAsmAddressOperand(const string& operand)
+{
+    size_t pos = operand.find_first_of("+-");
+    string name = operand.substr(0, pos);
+    if (!AsmLineModel::IsLabelName(name) || AsmLineModel::IsLocalLabel(name) || IsAsmRegister(name))
+        return false;
+    if (pos == string::npos)
+        return true;
+    string number = operand.substr(pos + 1);
+    if (!number.empty() && number[number.size() - 1] == '.')
+        number.erase(number.size() - 1);
+    return !number.empty() && number.find_first_not_of("0123456789") == string::npos;
+}
+
+// Operand taking the value from the list instead of the extra word: immediate "#X" => "(R5)+",
+// address "X" or "@#X" => "@(R5)+". Returns empty string if the operand could not be changed.
+static string GetThreadParameter(const string& opcode, const string& operand, string& param)
+{
+    bool byteop = opcode.size() > 3 && opcode[opcode.size() - 1] == 'B';  // "(R5)+" would add 1 in byte mode
+    if (operand.size() > 1 && operand[0] == '#' && !byteop)
+    {
+        param = operand.substr(1);
+        return "(R5)+";
+    }
+    if (operand.size() > 2 && operand.compare(0, 2, "@#") == 0)
+    {
+        param = operand.substr(2);
+        return "@(R5)+";
+    }
+    if (IsAsmAddressOperand(operand))
+    {
+        param = operand;
+        return "@(R5)+";
+    }
+    return string();
+}
+
+// Parameters are not allowed between the calls, the routines spoil R5
+static bool IsThreadShapeValid(const string& shape)
+{
+    size_t firstcall = shape.find('c');
+    if (firstcall == string::npos)
+        return true;
+    size_t lastcall = shape.rfind('c');
+    return shape.find('p', firstcall) == string::npos || shape.find('p', firstcall) > lastcall;
+}
+
+static bool IsAsmIdentChar(char ch)
+{
+    return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') ||
+        ch == '$' || ch == '.' || ch == '_' || ch == '%';
+}
+
+// Split the operand to names and numbers
+static std::vector<string> GetAsmOperandTokens(const string& operand)
+{
+    std::vector<string> tokens;
+    string token;
+    for (char ch : operand)
+    {
+        if (IsAsmIdentChar(ch))
+        {
+            token += ch;
+            continue;
+        }
+        if (!token.empty())
+            tokens.push_back(token);
+        token.clear();
+    }
+    if (!token.empty())
+        tokens.push_back(token);
+    return tokens;
+}
+
+// R5 is the thread pointer; PC, '.' and local labels depend on the place of the instruction
+static bool IsThreadableOperand(const string& operand)
+{
+    for (const string& token : GetAsmOperandTokens(operand))
+    {
+        if (token == "R5" || token == "%5" || token == "PC" || token == "R7" || token == "%7" || token == ".")
+            return false;
+        if (AsmLineModel::IsLocalLabel(token))
+            return false;
+    }
+    return true;
+}
+
+// Collect instructions for one atom starting from the line; forward branches like "BEQ .+6" take the skipped
+// instructions into the atom. Returns index of the line after the atom, 0 if the instructions could not be threaded.
+static size_t FormThreadAtom(const std::vector<AsmLineModel>& asmlines, const std::vector<int>& sizes,
+        const std::set<string>& codelabels, size_t start, size_t end, ThreadStep& step)
+{
+    step.kind = ThreadStepAtom;
+    step.line = start;
+    step.size = 0;
+    step.calls = step.returns = false;
+    step.flagsin = false;
+    step.flagsout = true;
+    step.flagsnext = false;
+    step.params.clear();
+    int reqend = 0;
+    size_t index = start;
+    do
+    {
+        if (index >= end || step.returns)
+            return 0;
+        const AsmLineModel& asmline = asmlines[index];
+        if (!asmline.parsed || (index > start && !asmline.label.empty()))
+            return 0;
+        if (asmline.opcode.empty())  // comment line
+        {
+            index++;
+            continue;
+        }
+
+        const string& opcode = asmline.opcode;
+        if (IsAsmFlagsUser(opcode) && step.size == 0)
+            step.flagsin = true;
+        bool isbranch = (opcode == "BR" || !GetInvertedBranch(opcode).empty());
+        if (isbranch)
+        {
+            int offset;
+            if (asmline.operands.size() != 1 || !GetAsmDotOffset(asmline.operands[0], offset) || offset <= 0)
+                return 0;
+            reqend = std::max(reqend, step.size + offset);
+        }
+        else
+        {
+            if (opcode == "RETURN")
+                step.returns = true;
+            else if (IsAsmCallLike(opcode))
+                step.calls = true;
+            else if (!(IsOneOf(opcode, AsmOperandOpcodes) && opcode != "JMP" && opcode != "JSR" && opcode != "RTS") &&
+                     !(IsOneOf(opcode, AsmNoOperandOpcodes) && opcode != "RTI" && opcode != "RTT" && opcode != "BPT" &&
+                       opcode != "IOT" && opcode != "HALT" && opcode != "WAIT"))
+                return 0;
+            if (opcode == "CALL" && asmline.operands.size() == 1 && codelabels.count(asmline.operands[0]) != 0)
+                return 0;
+            for (const string& operand : asmline.operands)
+            {
+                if (!IsThreadableOperand(operand))
+                    return 0;
+            }
+        }
+        if (sizes[index] <= 0)
+            return 0;
+
+        string instruction = "\t" + opcode;
+        string pinstruction = instruction;
+        char shape = IsAsmCallLike(opcode) ? 'c' : '-';
+        for (size_t i = 0; i < asmline.operands.size(); i++)
+        {
+            const string& operand = asmline.operands[i];
+            string param;
+            string poperand = (shape == 'c' || isbranch) ? string() : GetThreadParameter(opcode, operand, param);
+            if (!poperand.empty())
+            {
+                step.params.push_back(param);
+                shape = 'p';
+            }
+            instruction += (i == 0 ? "\t" : ", ") + operand;
+            pinstruction += (i == 0 ? "\t" : ", ") + (poperand.empty() ? operand : poperand);
+        }
+        step.text += (step.text.empty() ? "" : "\n") + instruction;
+        step.ptext += (step.ptext.empty() ? "" : "\n") + pinstruction;
+        step.pshape += shape;
+        step.size += sizes[index];
+        step.flagsout = !IsAsmCallLike(opcode);
+        index++;
+    }
+    while (step.size < reqend);
+
+    // The branches over the call would need fixing as the primitive saves R5 around the call
+    if (reqend > 0 && step.calls)
+        return 0;
+    // The same for the branches over the instructions taking the parameters
+    if (reqend > 0 && !step.params.empty())
+    {
+        step.ptext = step.text;
+        std::replace(step.pshape.begin(), step.pshape.end(), 'p', '-');
+        step.params.clear();
+    }
+
+    return index;
+}
+
+// The flags set by the machine code are valid here: the previous step is the atom, its flags are kept.
+// Labels, jumps and calls spoil the flags as the thread is entered or moved.
+static bool IsThreadFlagsValid(ThreadSegment& segment)
+{
+    for (auto it = segment.steps.rbegin(); it != segment.steps.rend(); ++it)
+    {
+        if (it->kind == ThreadStepComment)
+            continue;
+        if (it->kind != ThreadStepAtom)
+            return false;
+        it->flagsnext = true;
+        return true;
+    }
+    return false;
+}
+
+// Split the line code to the steps; returns false if the code should stay in machine code
+static bool AnalyzeThreadSegment(const std::vector<AsmLineModel>& asmlines, const std::vector<int>& sizes,
+        const std::set<string>& codelabels, ThreadSegment& segment)
+{
+    size_t index = segment.start;
+    while (index < segment.end)
+    {
+        const AsmLineModel& asmline = asmlines[index];
+        if (!asmline.parsed)
+            return false;
+
+        ThreadStep step = ThreadStep();
+        step.kind = ThreadStepComment;
+        step.line = step.refline = index;
+        if (!asmline.label.empty())
+        {
+            step.kind = ThreadStepLabel;
+            step.text = asmline.label;
+            segment.steps.push_back(step);
+        }
+        if (asmline.opcode.empty())
+        {
+            if (asmline.label.empty())
+                segment.steps.push_back(step);
+            index++;
+            continue;
+        }
+
+        const string& opcode = asmline.opcode;
+        const string operand = asmline.operands.size() == 1 ? asmline.operands[0] : string();
+        bool isbranch = (opcode == "BR" || !GetInvertedBranch(opcode).empty());
+        int offset;
+        if ((isbranch || opcode == "JMP") && AsmLineModel::IsLabelName(operand))
+        {
+            step.kind = (opcode == "BR" || opcode == "JMP") ? ThreadStepJump : ThreadStepBranch;
+            step.opcode = opcode;
+            step.text = operand;
+        }
+        else if (isbranch && opcode != "BR" && GetAsmDotOffset(operand, offset) && offset == 6 &&
+                 index + 1 < segment.end && asmlines[index + 1].label.empty() && asmlines[index + 1].opcode == "JMP" &&
+                 asmlines[index + 1].operands.size() == 1 && AsmLineModel::IsLabelName(asmlines[index + 1].operands[0]))
+        {
+            // Conditional branch over JMP, like "BGE .+6 / JMP X1"
+            step.kind = ThreadStepBranch;
+            step.opcode = GetInvertedBranch(opcode);
+            step.text = asmlines[index + 1].operands[0];
+            step.refline = index + 1;
+            if (!IsThreadFlagsValid(segment))
+                return false;
+            segment.steps.push_back(step);
+            index += 2;
+            continue;
+        }
+        else if (opcode == "CALL" && codelabels.count(operand) != 0)
+        {
+            step.kind = ThreadStepGosub;
+            step.text = operand;
+        }
+        else
+        {
+            size_t next = FormThreadAtom(asmlines, sizes, codelabels, index, segment.end, step);
+            if (next == 0)
+                return false;
+            if (step.flagsin)
+            {
+                // Glue the atom to the previous one, so the flags are not spoiled between them
+                if (!IsThreadFlagsValid(segment))
+                    return false;
+                ThreadStep* previous = &segment.steps.back();
+                while (previous->kind == ThreadStepComment)
+                    previous--;
+                previous->text += "\n" + step.text;
+                previous->ptext += "\n" + step.ptext;
+                previous->pshape += step.pshape;
+                previous->params.insert(previous->params.end(), step.params.begin(), step.params.end());
+                previous->size += step.size;
+                previous->calls = previous->calls || step.calls;
+                previous->returns = step.returns;
+                previous->flagsout = step.flagsout;
+                previous->flagsnext = false;
+            }
+            else
+                segment.steps.push_back(step);
+            index = next;
+            continue;
+        }
+        if (step.kind == ThreadStepBranch && !IsThreadFlagsValid(segment))
+            return false;
+        segment.steps.push_back(step);
+        index++;
+    }
+    return true;
+}
+
+// Primitive size in bytes: instructions, saving R5 around the calls, "JMP @(R5)+" at the end
+static int GetThreadPrimitiveSize(const ThreadSequence& sequence)
+{
+    return sequence.size + (sequence.calls ? 8 : 0) + (sequence.keepflags ? 4 : 0) + (sequence.returns ? 0 : 2);
+}
+
+// Make the primitive from the instructions; R5 is saved around the calls as the routines spoil it
+static void AddThreadPrimitive(const string& name, const string& instructions, bool keepflags,
+        std::vector<string>& primitives)
+{
+    std::vector<string> body;
+    size_t pos = 0;
+    while (pos != string::npos)
+    {
+        size_t next = instructions.find('\n', pos);
+        body.push_back(instructions.substr(pos, next == string::npos ? next : next - pos));
+        pos = (next == string::npos) ? next : next + 1;
+    }
+    int firstcall = -1, lastcall = -1;
+    for (size_t i = 0; i < body.size(); i++)
+    {
+        AsmLineModel asmline;
+        asmline.Parse(body[i]);
+        if (IsAsmCallLike(asmline.opcode))
+        {
+            if (firstcall < 0)
+                firstcall = (int)i;
+            lastcall = (int)i;
+        }
+        else if (lastcall >= 0 && lastcall + 1 == (int)i && IsAsmFlagsUser(asmline.opcode))
+            keepflags = true;
+    }
+    if (lastcall >= 0)
+    {
+        if (keepflags)  // the routine returns the result in the flags, like FCMP
+        {
+            body.insert(body.begin() + lastcall + 1, "\tMTPS\t(SP)+");
+            body.insert(body.begin() + lastcall + 1, "\tMOV\tTHIP, R5");
+            body.insert(body.begin() + lastcall + 1, "\tMFPS\t-(SP)");
+        }
+        else
+            body.insert(body.begin() + lastcall + 1, "\tMOV\tTHIP, R5");
+        body.insert(body.begin() + firstcall, "\tMOV\tR5, THIP");
+    }
+    AsmLineModel last;
+    last.Parse(body.back());
+    if (last.opcode != "RETURN")
+        body.push_back("\tJMP\t@(R5)+");
+    body[0] = name + ":" + body[0];
+    primitives.insert(primitives.end(), body.begin(), body.end());
+}
+
+// State of the threaded code pass, shared by the steps below
+struct ThreadContext
+{
+    const std::vector<string>* lines;
+    std::vector<AsmLineModel> asmlines;
+    std::vector<int> sizes;
+    std::map<string, size_t> labels;
+    std::set<string> codelabels;
+    std::vector<int> scopes;  // Local label scope of every line
+    std::vector<ThreadSegment> segments;
+    std::vector<int> linesegments;  // Segment of every line, -1 for the lines out of the segments
+    std::vector<std::pair<size_t, string> > references;  // References to the labels: line index and label key
+    std::vector<int> runs;  // Index of the first segment of the run, -1 for machine code
+    std::set<string> entries;  // Labels the machine code could jump to
+    std::map<string, ThreadSequence> sequences;
+    std::map<string, string> primitivenames;
+    std::set<string> branchprimitives;
+    std::vector<string> threadprimitives;
+    std::vector<size_t> newindex;  // New indices of the lines, for the line spans
+
+    string GetLabelKey(size_t index, const string& name) const
+    {
+        return AsmLineModel::IsLocalLabel(name) ? std::to_string(scopes[index]) + ":" + name : name;
+    }
+    // Index of the last segment of the run
+    size_t GetRunLast(size_t first) const
+    {
+        size_t last = first;
+        while (last + 1 < segments.size() && runs[last + 1] == runs[first])
+            last++;
+        return last;
+    }
+};
+
+// Collect labels; local label scope is between two regular labels
+static void CollectThreadLabels(ThreadContext& context)
+{
+    size_t count = context.asmlines.size();
+    context.scopes.resize(count);
+    int scope = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const string& label = context.asmlines[i].label;
+        if (!label.empty() && !AsmLineModel::IsLocalLabel(label))
+        {
+            scope++;
+            context.codelabels.insert(label);
+        }
+        context.scopes[i] = scope;
+        if (!label.empty())
+            context.labels[context.GetLabelKey(i, label)] = i;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (const string& operand : context.asmlines[i].operands)
+        {
+            for (const string& token : GetAsmOperandTokens(operand))
+            {
+                if (AsmLineModel::IsLabelName(token) &&
+                    context.labels.find(context.GetLabelKey(i, token)) != context.labels.end())
+                    context.references.push_back(std::make_pair(i, context.GetLabelKey(i, token)));
+            }
+        }
+    }
+}
+
+// Split the code to the lines, the last line of the code is LEND
+static void SplitThreadSegments(ThreadContext& context, const std::vector<FinalLineSpan>& spans)
+{
+    size_t count = context.asmlines.size();
+    context.segments.resize(spans.size());
+    context.linesegments.assign(count, -1);
+    for (size_t k = 0; k < spans.size(); k++)
+    {
+        ThreadSegment& segment = context.segments[k];
+        segment.start = spans[k].start;
+        segment.end = (k + 1 < spans.size()) ? spans[k + 1].start : count - 1;
+        segment.nativesize = 0;
+        segment.threadsize = 0;
+        for (size_t i = segment.start; i < segment.end; i++)
+        {
+            context.linesegments[i] = (int)k;
+            segment.nativesize += std::max(context.sizes[i], 0);
+        }
+        segment.threaded = !spans[k].native &&
+            AnalyzeThreadSegment(context.asmlines, context.sizes, context.codelabels, segment);
+    }
+}
+
+// Write the threaded code of the run, calculate the sizes; without the result only the sizes are calculated.
+// "TEXIT" belongs to the line of the last list word, so it goes before the comment and the labels of the next line.
+static void EmitThreadRun(ThreadContext& context, size_t first, size_t last, std::vector<string>* result)
+{
+    typedef std::pair<size_t, string> ThreadListLine;  // Index of the old line, or npos; text
+    const std::vector<string>& lines = *context.lines;
+    bool entered = false;  // "JSR R5, THRD" is done
+    bool reachable = true;  // The control could come to the current place of the list
+    std::vector<ThreadListLine> pending;  // Comments and entry labels to place before the next "JSR R5, THRD"
+    std::vector<ThreadListLine> inner;  // Thread labels to place after the next "JSR R5, THRD", with the comments
+    bool pendinglabels = false;  // There are entry labels in pending
+    size_t wordsegment = first;  // Segment of the last list word
+    std::set<size_t> placed;  // Starts of the segments already written
+    int runindex = (int)first;
+
+    // Write the line; the first line of the segment moves the segment start
+    auto output = [&](size_t line, const string& text)
+    {
+        if (result == nullptr)
+            return;
+        if (line != string::npos && context.segments[context.linesegments[line]].start == line &&
+            placed.insert(line).second)
+            context.newindex[line] = result->size();
+        result->push_back(text);
+    };
+    auto flush = [&](std::vector<ThreadListLine>& list)
+    {
+        for (const ThreadListLine& listline : list)
+            output(listline.first, listline.second);
+        list.clear();
+    };
+
+    for (size_t k = first; k <= last; k++)
+    {
+        ThreadSegment& segment = context.segments[k];
+        segment.threadsize = 0;
+        if (result != nullptr)
+            context.newindex[segment.start] = result->size();
+        for (const ThreadStep& step : segment.steps)
+        {
+            const AsmLineModel& asmline = context.asmlines[step.line];
+            if (step.kind == ThreadStepComment)
+            {
+                (inner.empty() ? pending : inner).push_back(ThreadListLine(step.line, lines[step.line]));
+                continue;
+            }
+            if (step.kind == ThreadStepLabel)
+            {
+                string label = step.text + ":";
+                if (asmline.opcode.empty() && !asmline.comment.empty())
+                    label += "\t" + asmline.comment;
+                if (!entered || context.entries.count(context.GetLabelKey(step.line, step.text)) != 0)
+                {
+                    pending.push_back(ThreadListLine(step.line, label));
+                    pendinglabels = true;
+                }
+                else if (pendinglabels)
+                    inner.push_back(ThreadListLine(step.line, label));
+                else
+                {
+                    flush(pending);
+                    output(step.line, label);
+                    reachable = true;
+                }
+                continue;
+            }
+            if (step.kind == ThreadStepAtom && step.primitive.empty() && !step.tcall)
+                continue;  // continuation of the primitive
+
+            if (!entered || pendinglabels)
+            {
+                if (entered && reachable)
+                {
+                    context.segments[wordsegment].threadsize += 2;
+                    output(string::npos, "\t.WORD\tTEXIT");
+                }
+                flush(pending);
+                output(string::npos, "\tJSR\tR5, THRD\t; threaded code");
+                flush(inner);
+                pendinglabels = false;
+                reachable = true;
+                segment.threadsize += 4;
+                entered = true;
+            }
+            else
+                flush(pending);
+            wordsegment = k;
+
+            const AsmLineModel& refline = context.asmlines[step.refline];
+            string comment = refline.comment.empty() ? "" : "\t" + refline.comment;
+            string item;
+            bool inrun = false;
+            if (step.kind == ThreadStepJump || step.kind == ThreadStepBranch)
+            {
+                string key = context.GetLabelKey(step.refline, step.text);
+                auto it = context.labels.find(key);
+                inrun = it != context.labels.end() && context.entries.count(key) == 0 &&
+                    context.linesegments[it->second] >= 0 && context.runs[context.linesegments[it->second]] == runindex;
+            }
+            switch (step.kind)
+            {
+            case ThreadStepAtom:
+                if (step.tcall)
+                    item = "TCALL, " + asmline.operands[0];
+                else
+                {
+                    if (result != nullptr && context.primitivenames.find(step.primitive) == context.primitivenames.end())
+                    {
+                        string name = "TP" + std::to_string(context.primitivenames.size() + 1);
+                        context.primitivenames[step.primitive] = name;
+                        AddThreadPrimitive(name, step.primitive.substr(1), context.sequences[step.primitive].keepflags,
+                            context.threadprimitives);
+                    }
+                    item = (result != nullptr) ? context.primitivenames[step.primitive] : string();
+                    for (const string& arg : step.args)
+                        item += ", " + arg;
+                    segment.threadsize += (int)step.args.size() * 2;
+                }
+                reachable = !step.returns;
+                break;
+            case ThreadStepJump:
+                item = inrun ? "TJMP, " + step.text : step.text;
+                reachable = false;
+                break;
+            case ThreadStepBranch:
+                item = "TB" + step.opcode.substr(1) + (inrun ? "" : "N") + ", " + step.text;
+                context.branchprimitives.insert(step.opcode + (inrun ? "" : "N"));
+                break;
+            case ThreadStepGosub:
+                item = "TGOSB, " + step.text;
+                break;
+            default:
+                break;
+            }
+            bool twowords = step.tcall || step.kind == ThreadStepBranch || step.kind == ThreadStepGosub ||
+                (step.kind == ThreadStepJump && inrun);
+            segment.threadsize += twowords ? 4 : 2;
+            output(step.line, "\t.WORD\t" + item + comment);
+        }
+    }
+    if (entered && reachable)
+    {
+        context.segments[wordsegment].threadsize += 2;
+        output(string::npos, "\t.WORD\tTEXIT");
+    }
+    flush(pending);
+    flush(inner);
+}
+
+// Find the runs of the threaded lines and the entry labels: the labels referenced outside of the run,
+// or not by the threaded jumps, or before the run code
+static void FindThreadEntries(ThreadContext& context)
+{
+    std::vector<ThreadSegment>& segments = context.segments;
+    std::vector<int>& runs = context.runs;
+    runs.assign(segments.size(), -1);
+    for (size_t k = 0; k < segments.size(); k++)
+    {
+        if (segments[k].threaded)
+            runs[k] = (k > 0 && runs[k - 1] >= 0) ? runs[k - 1] : (int)k;
+    }
+
+    std::set<size_t> threadjumps;  // Lines with the jumps turned into the threaded jumps
+    for (const ThreadSegment& segment : segments)
+    {
+        if (!segment.threaded)
+            continue;
+        for (const ThreadStep& step : segment.steps)
+        {
+            if (step.kind == ThreadStepJump || step.kind == ThreadStepBranch)
+                threadjumps.insert(step.refline);
+        }
+    }
+    context.entries.clear();
+    for (const auto& reference : context.references)
+    {
+        size_t target = context.labels[reference.second];
+        int targetseg = context.linesegments[target];
+        int refseg = context.linesegments[reference.first];
+        if (targetseg < 0 || runs[targetseg] < 0)
+            continue;  // the label is in the machine code
+        if (refseg >= 0 && runs[refseg] == runs[targetseg] && threadjumps.count(reference.first) != 0)
+            continue;
+        context.entries.insert(reference.second);
+    }
+    for (size_t k = 0; k < segments.size(); k++)
+    {
+        if (runs[k] != (int)k)
+            continue;
+        size_t last = context.GetRunLast(k);
+        // Labels at the start of the run, before "JSR R5, THRD"
+        bool found = false;
+        for (size_t j = k; j <= last && !found; j++)
+        {
+            for (auto it = segments[j].steps.begin(); it != segments[j].steps.end() && !found; ++it)
+            {
+                if (it->kind == ThreadStepLabel)
+                    context.entries.insert(context.GetLabelKey(it->line, it->text));
+                else if (it->kind != ThreadStepComment)
+                    found = true;
+            }
+        }
+        // Labels at the end of the run, on the machine code after the thread
+        found = false;
+        for (size_t j = last + 1; j > k && !found; j--)
+        {
+            for (auto it = segments[j - 1].steps.rbegin(); it != segments[j - 1].steps.rend() && !found; ++it)
+            {
+                if (it->kind == ThreadStepLabel)
+                    context.entries.insert(context.GetLabelKey(it->line, it->text));
+                else if (it->kind != ThreadStepComment)
+                    found = true;
+            }
+        }
+    }
+}
+
+static void AddThreadSequence(std::map<string, ThreadSequence>& sequences, const string& key,
+        const ThreadSequence& current)
+{
+    auto it = sequences.find(key);
+    if (it == sequences.end())
+        sequences[key] = current;
+    else
+    {
+        it->second.count++;
+        it->second.keepflags = it->second.keepflags || current.keepflags;
+    }
+}
+
+// Count the sequences of atoms within the lines, the candidates for the primitives; every sequence
+// goes as is, and with the parameters taken from the list if it has any
+static void CountThreadSequences(ThreadContext& context, const std::vector<std::vector<ThreadStep*> >& chunks)
+{
+    context.sequences.clear();
+    for (const std::vector<ThreadStep*>& chunk : chunks)
+    {
+        for (size_t i = 0; i < chunk.size(); i++)
+        {
+            string key = "L", pkey = "P", shape;
+            ThreadSequence current = { 1, 0, 0, false, false, false };
+            for (size_t j = i; j < chunk.size() && j < i + ThreadMaxSequence && !current.returns; j++)
+            {
+                key += (j == i ? "" : "\n") + chunk[j]->text;
+                pkey += (j == i ? "" : "\n") + chunk[j]->ptext;
+                shape += chunk[j]->pshape;
+                current.size += chunk[j]->size;
+                current.nparams += (int)chunk[j]->params.size();
+                current.calls = current.calls || chunk[j]->calls;
+                current.returns = chunk[j]->returns;
+                current.keepflags = chunk[j]->flagsnext && !chunk[j]->flagsout;
+                ThreadSequence literal = current;
+                literal.nparams = 0;
+                AddThreadSequence(context.sequences, key, literal);
+                if (current.nparams > 0 && IsThreadShapeValid(shape))
+                {
+                    ThreadSequence parametrized = current;
+                    parametrized.size -= current.nparams * 2;
+                    AddThreadSequence(context.sequences, pkey, parametrized);
+                }
+            }
+        }
+    }
+}
+
+// Greedy choice of the primitives: the longest profitable sequence at every place
+static void ChooseThreadPrimitives(ThreadContext& context)
+{
+    // Sequences of atoms within the lines, the labels and the jumps break the sequences
+    std::vector<std::vector<ThreadStep*> > chunks;
+    for (ThreadSegment& segment : context.segments)
+    {
+        if (!segment.threaded)
+            continue;
+        chunks.push_back(std::vector<ThreadStep*>());
+        for (ThreadStep& step : segment.steps)
+        {
+            if (step.kind == ThreadStepAtom)
+                chunks.back().push_back(&step);
+            else if (step.kind != ThreadStepComment && !chunks.back().empty())
+                chunks.push_back(std::vector<ThreadStep*>());
+        }
+    }
+    CountThreadSequences(context, chunks);
+
+    for (const std::vector<ThreadStep*>& chunk : chunks)
+    {
+        size_t i = 0;
+        while (i < chunk.size())
+        {
+            string key = "L", pkey = "P", bestkey;
+            int bestbenefit = INT_MIN;
+            size_t bestlength = 1;
+            for (size_t j = i; j < chunk.size() && j < i + ThreadMaxSequence; j++)
+            {
+                key += (j == i ? "" : "\n") + chunk[j]->text;
+                pkey += (j == i ? "" : "\n") + chunk[j]->ptext;
+                auto it = context.sequences.find(key);
+                if (it == context.sequences.end())
+                    break;
+                // The primitive saves "size - 2" bytes on every use: the list word instead of the instructions
+                for (const string& candidate : { key, pkey })
+                {
+                    it = context.sequences.find(candidate);
+                    if (it == context.sequences.end())
+                        continue;
+                    const ThreadSequence& sequence = it->second;
+                    int benefit = sequence.count * (sequence.size - 2) - GetThreadPrimitiveSize(sequence);
+                    if (benefit > bestbenefit || (benefit == bestbenefit && benefit > 0))
+                    {
+                        bestbenefit = benefit;
+                        bestkey = candidate;
+                        bestlength = j - i + 1;
+                    }
+                }
+            }
+            ThreadStep* step = chunk[i];
+            const AsmLineModel& asmline = context.asmlines[step->line];
+            step->tcall = (bestlength == 1 && bestbenefit <= 0 && asmline.opcode == "CALL" &&
+                step->text.find('\n') == string::npos && AsmLineModel::IsLabelName(asmline.operands[0]));
+            step->primitive = step->tcall ? string() : bestkey;
+            step->args.clear();
+            for (size_t j = i; j < i + bestlength; j++)
+            {
+                if (bestkey[0] == 'P')
+                    step->args.insert(step->args.end(), chunk[j]->params.begin(), chunk[j]->params.end());
+                if (j == i)
+                    continue;
+                chunk[j]->primitive.clear();
+                chunk[j]->tcall = false;
+            }
+            i += bestlength;
+        }
+    }
+}
+
+// Choose the primitives for the threaded lines and estimate the sizes; returns the total size of the code
+static int PlanThreadCode(ThreadContext& context)
+{
+    std::vector<ThreadSegment>& segments = context.segments;
+    FindThreadEntries(context);
+    ChooseThreadPrimitives(context);
+
+    // Estimate the threaded code size
+    context.branchprimitives.clear();
+    for (size_t k = 0; k < segments.size(); k++)
+    {
+        if (context.runs[k] == (int)k)
+            EmitThreadRun(context, k, context.GetRunLast(k), nullptr);
+    }
+    int total = ThreadRuntimeSize + (int)context.branchprimitives.size() * 12;
+    std::map<string, int> uses;
+    for (const ThreadSegment& segment : segments)
+    {
+        total += segment.threaded ? segment.threadsize : segment.nativesize;
+        for (const ThreadStep& step : segment.steps)
+        {
+            if (segment.threaded && step.kind == ThreadStepAtom && !step.primitive.empty() &&
+                uses[step.primitive]++ == 0)
+                total += GetThreadPrimitiveSize(context.sequences[step.primitive]);
+        }
+    }
+    // Every line using the primitive pays its share of the primitive size
+    for (ThreadSegment& segment : segments)
+    {
+        if (!segment.threaded)
+            continue;
+        for (const ThreadStep& step : segment.steps)
+        {
+            if (step.kind == ThreadStepAtom && !step.primitive.empty())
+            {
+                int count = uses[step.primitive];
+                segment.threadsize += (GetThreadPrimitiveSize(context.sequences[step.primitive]) + count - 1) / count;
+            }
+        }
+    }
+
+    return total;
+}
+
+// Choose the lines to stay threaded; the plan is made for the final choice
+static void SelectThreadSegments(ThreadContext& context)
+{
+    std::vector<ThreadSegment>& segments = context.segments;
+
+    // Back to machine code: the lines losing more than entering and leaving the thread costs,
+    // and the worst line of every run that is not shorter than its machine code
+    while (true)
+    {
+        PlanThreadCode(context);
+        bool changed = false;
+        for (size_t k = 0; k < segments.size(); k++)
+        {
+            if (context.runs[k] != (int)k)
+                continue;
+            int runthread = 0, runnative = 0;
+            size_t worst = k;
+            for (size_t j = k; j < segments.size() && context.runs[j] == (int)k; j++)
+            {
+                ThreadSegment& segment = segments[j];
+                runthread += segment.threadsize;
+                runnative += segment.nativesize;
+                if (segment.threadsize - segment.nativesize > segments[worst].threadsize - segments[worst].nativesize)
+                    worst = j;
+                if (segment.threadsize - segment.nativesize > 6)
+                {
+                    segment.threaded = false;
+                    changed = true;
+                }
+            }
+            if (runthread >= runnative)
+            {
+                segments[worst].threaded = false;
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+    }
+    // Then the lines still losing, one by one, if that makes the whole code shorter
+    int bestsize = PlanThreadCode(context);
+    std::vector<size_t> losing;
+    for (size_t k = 0; k < segments.size(); k++)
+    {
+        if (segments[k].threaded && segments[k].threadsize > segments[k].nativesize)
+            losing.push_back(k);
+    }
+    for (size_t k : losing)
+    {
+        segments[k].threaded = false;
+        int size = PlanThreadCode(context);
+        if (size < bestsize)
+            bestsize = size;
+        else
+            segments[k].threaded = true;
+    }
+    PlanThreadCode(context);
+}
+
+// Conditional branch primitives: target in the list follows the primitive address; "N" for the machine code target
+static void AddThreadBranchPrimitives(ThreadContext& context)
+{
+    for (const string& branch : context.branchprimitives)
+    {
+        bool native = branch[branch.size() - 1] == 'N';
+        string opcode = native ? branch.substr(0, branch.size() - 1) : branch;
+        std::vector<string>& primitives = context.threadprimitives;
+        primitives.push_back("TB" + opcode.substr(1) + (native ? "N" : "") + ":\t" + GetInvertedBranch(opcode) + "\t1$");
+        if (!native)
+            primitives.push_back("\tMOV\t(R5), R5");
+        primitives.push_back("\tJMP\t@(R5)+");
+        primitives.push_back("1$:\tTST\t(R5)+");
+        primitives.push_back("\tJMP\t@(R5)+");
+    }
+}
+
+// Turn the lines into threaded code, where it makes the code shorter; the lines marked as native stay as is.
+// The primitives to place out of the program code go to the list. Returns number of the threaded lines.
+int Optimizer::ThreadCode(std::vector<string>& primitives)
+{
+    std::vector<string>& lines = m_final->lines;
+    size_t count = lines.size();
+    if (m_spans == nullptr || m_spans->empty())
+        return 0;
+
+    ThreadContext context;
+    context.lines = &lines;
+    context.asmlines.resize(count);
+    context.sizes.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        context.asmlines[i].Parse(lines[i]);
+        context.sizes[i] = context.asmlines[i].GetSize();
+    }
+    context.newindex.resize(count);
+
+    CollectThreadLabels(context);
+    SplitThreadSegments(context, *m_spans);
+    SelectThreadSegments(context);
+
+    // Replace the lines
+    std::vector<ThreadSegment>& segments = context.segments;
+    std::vector<string> result;
+    result.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        int k = context.linesegments[i];
+        if (k < 0 || context.runs[k] < 0)
+        {
+            context.newindex[i] = result.size();
+            result.push_back(lines[i]);
+            continue;
+        }
+        size_t last = context.GetRunLast((size_t)k);
+        EmitThreadRun(context, (size_t)k, last, &result);
+        i = segments[last].end - 1;
+    }
+    AddThreadBranchPrimitives(context);
+
+    // Check the total size with the primitives and the inner interpreter
+    int nativesize = 0, threadsize = ThreadRuntimeSize, threadcount = 0;
+    for (const ThreadSegment& segment : segments)
+    {
+        if (!segment.threaded)
+            continue;
+        threadcount++;
+        nativesize += segment.nativesize;
+        threadsize += segment.threadsize;
+    }
+    for (const string& line : context.threadprimitives)
+    {
+        AsmLineModel asmline;
+        asmline.Parse(line);
+        threadsize += std::max(asmline.GetSize(), 0);
+    }
+    if (threadcount == 0 || threadsize >= nativesize)
+        return 0;
+
+    lines.swap(result);
+    UpdateLineSpans(context.newindex);
+    primitives.insert(primitives.end(), context.threadprimitives.begin(), context.threadprimitives.end());
+
+    return threadcount;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Code cost estimation
+//
+// Cost of the line is the sum of its instructions, each counted once, plus the cost of the runtime routines and
+// the threaded code primitives it calls. Cost of a routine is one pass along its code: conditional branches are
+// not taken, and when the code goes back to the place already passed (a loop), the pass continues from the target
+// of the last branch not taken. So the loops are counted once, and the routine's early exits are ignored.
+
+static bool IsAsmDataDirective(const string& opcode)
+{
+    return opcode == ".WORD" || opcode == ".BYTE" || opcode == ".ASCII" || opcode == ".ASCIZ" ||
+           opcode == ".BLKW" || opcode == ".BLKB" || opcode == ".EVEN";
+}
+
+void Optimizer::EstimateLineCosts(TargetPlatform platform, std::vector<FinalLineCost>& costs)
+{
+    costs.clear();
+    if (m_spans == nullptr || m_spans->empty())
+        return;
+
+    // The program code, then the runtime; the routines are after LEND
+    std::vector<AsmLineModel> asmlines;
+    asmlines.reserve(m_final->lines.size() + m_final->runtimelines.size());
+    for (const string& line : m_final->lines)
+    {
+        asmlines.emplace_back();
+        asmlines.back().Parse(line);
+    }
+    for (const string& line : m_final->runtimelines)
+    {
+        asmlines.emplace_back();
+        asmlines.back().Parse(line);
+    }
+    size_t count = asmlines.size();
+
+    size_t codeend = m_final->lines.size();
+    std::map<string, size_t> labels;
+    std::vector<int> scopes(count);
+    int scope = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const string& label = asmlines[i].label;
+        if (label == "LEND" && codeend == m_final->lines.size())
+            codeend = i;
+        if (!label.empty() && !AsmLineModel::IsLocalLabel(label))
+            scope++;
+        scopes[i] = scope;
+        if (!label.empty())
+            labels[AsmLineModel::IsLocalLabel(label) ? std::to_string(scope) + ":" + label : label] = i;
+    }
+    // Index of the line with the label, or count if the label is not found
+    auto findlabel = [&](size_t index, const string& name) -> size_t
+    {
+        if (!AsmLineModel::IsLabelName(name))
+            return count;
+        auto it = labels.find(AsmLineModel::IsLocalLabel(name) ? std::to_string(scopes[index]) + ":" + name : name);
+        return (it == labels.end()) ? count : it->second;
+    };
+
+    std::map<size_t, int> routinecosts;  // Routine start line index => cost of one call
+    std::function<int(size_t)> getroutinecost = [&](size_t start) -> int
+    {
+        if (start >= count || start <= codeend)
+            return 0;  // Not a routine: unknown label, or the program code
+        auto it = routinecosts.find(start);
+        if (it != routinecosts.end())
+            return it->second;
+        routinecosts[start] = 0;  // For the recursion
+
+        int cycles = 0;
+        std::set<size_t> visited;
+        std::vector<size_t> branches;  // Targets of the branches not taken
+        size_t i = start;
+        while (true)
+        {
+            if (i >= count || visited.count(i) != 0)
+            {
+                if (branches.empty())
+                    break;
+                i = branches.back();  branches.pop_back();
+                continue;
+            }
+            visited.insert(i);
+            const AsmLineModel& asmline = asmlines[i];
+            const string& opcode = asmline.opcode;
+            if (!asmline.parsed || opcode.empty() || opcode == ".GLOBL")
+            {
+                i++;
+                continue;
+            }
+            if (IsAsmDataDirective(opcode) || opcode == "RETURN" || opcode == "RTS" || opcode == "HALT" ||
+                opcode == "RTI" || opcode == "RTT")
+            {
+                cycles += std::max(asmline.GetCycles(platform), 0);
+                break;
+            }
+            cycles += std::max(asmline.GetCycles(platform), 0);
+
+            const string& target = asmline.operands.empty() ? "" : asmline.operands.back();
+            size_t targetindex = findlabel(i, target);
+            if (opcode == "CALL" || opcode == "JSR")
+                cycles += getroutinecost(targetindex);
+            else if (opcode == "JMP" || opcode == "BR")
+            {
+                if (targetindex == count)
+                    break;  // Computed address, the end of the routine
+                if (!AsmLineModel::IsLocalLabel(target) && opcode == "JMP")
+                {
+                    cycles += getroutinecost(targetindex);  // Jump to another routine
+                    break;
+                }
+                i = targetindex;
+                continue;
+            }
+            else if (IsOneOf(opcode, AsmPackedOpcodes) && opcode != "SOB" && targetindex < count)
+                branches.push_back(targetindex);
+            i++;
+        }
+
+        routinecosts[start] = cycles;
+        return cycles;
+    };
+
+    for (size_t k = 0; k < m_spans->size(); k++)
+    {
+        size_t start = (*m_spans)[k].start;
+        size_t end = (k + 1 < m_spans->size()) ? (*m_spans)[k + 1].start : codeend;
+        FinalLineCost cost = { 0, 0 };
+        for (size_t i = start; i < end && i < codeend; i++)
+        {
+            const AsmLineModel& asmline = asmlines[i];
+            cost.words += std::max(asmline.GetSize(), 0) / 2;
+            if (asmline.opcode == ".WORD")  // Threaded code list: the primitives and the routines for TCALL
+            {
+                for (const string& operand : asmline.operands)
+                    cost.cycles += getroutinecost(findlabel(i, operand));
+                continue;
+            }
+            cost.cycles += std::max(asmline.GetCycles(platform), 0);
+            if ((asmline.opcode == "CALL" || asmline.opcode == "JSR" || asmline.opcode == "JMP") && !asmline.operands.empty())
+                cost.cycles += getroutinecost(findlabel(i, asmline.operands.back()));
+        }
+        costs.push_back(cost);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Addresses of the lines, like the assembler assigns them
+
+// Number like "10." (decimal) or "12" (octal); returns false if the text is not a number
+static bool GetAsmNumber(const string& text, int& value)
+{
+    if (text.empty())
+        return false;
+    bool decimal = (text[text.size() - 1] == '.');
+    string digits = decimal ? text.substr(0, text.size() - 1) : text;
+    if (digits.empty() || digits.find_first_not_of(decimal ? "0123456789" : "01234567") != string::npos)
+        return false;
+    value = (int)std::strtol(digits.c_str(), nullptr, decimal ? 10 : 8);
+    return true;
+}
+
+// Size of .ASCII/.ASCIZ text: "<n>" is one byte, "/text/" is the chars between the delimiters
+static int GetAsmAsciiSize(const string& line, const string& opcode)
+{
+    size_t pos = line.find(opcode);
+    if (pos == string::npos)
+        return -1;
+    int size = (opcode == ".ASCIZ") ? 1 : 0;
+    for (pos += opcode.size(); pos < line.size(); pos++)
+    {
+        char ch = line[pos];
+        if (ch == ' ' || ch == '\t' || ch == ',')
+            continue;
+        if (ch == ';')
+            break;
+        size_t end = line.find(ch == '<' ? '>' : ch, pos + 1);
+        if (end == string::npos)
+            return -1;
+        size += (ch == '<') ? 1 : (int)(end - pos - 1);
+        pos = end;
+    }
+    return size;
+}
+
+// Calculate the address of every line from the start address; -1 for the lines after the line of unknown size.
+// Returns the address after the last line, or -1.
+int GetAsmAddresses(const std::vector<string>& lines, int startaddr, std::vector<int>& addrs)
+{
+    addrs.assign(lines.size(), -1);
+    int addr = startaddr;
+    std::vector<std::pair<int, int> > repeats;  // .REPT blocks: count, start address
+    for (size_t i = 0; i < lines.size() && addr >= 0; i++)
+    {
+        addrs[i] = addr;
+        const string& line = lines[i];
+        AsmLineModel asmline;
+        asmline.Parse(line);
+        if (!asmline.parsed)
+        {
+            if (line.find('=') < line.find(';'))
+                continue;  // Assignment like "SAVESP = . + 2"
+            addr = -1;
+            break;
+        }
+
+        const string& opcode = asmline.opcode;
+        int size = asmline.GetSize();
+        int count = 0;
+        if (size >= 0)
+            addr += size;
+        else if (opcode == ".BYTE")
+            addr += (int)asmline.operands.size();
+        else if ((opcode == ".BLKW" || opcode == ".BLKB") && asmline.operands.size() == 1 &&
+                 GetAsmNumber(asmline.operands[0], count))
+            addr += (opcode == ".BLKW") ? count * 2 : count;
+        else if (opcode == ".ASCII" || opcode == ".ASCIZ")
+        {
+            size = GetAsmAsciiSize(line, opcode);
+            addr = (size < 0) ? -1 : addr + size;
+        }
+        else if (opcode == ".EVEN")
+            addr = (addr + 1) & ~1;
+        else if (opcode == ".REPT" && asmline.operands.size() == 1 && GetAsmNumber(asmline.operands[0], count))
+            repeats.push_back(std::make_pair(count, addr));
+        else if (opcode == ".ENDR" && !repeats.empty())
+        {
+            addr = repeats.back().second + (addr - repeats.back().second) * repeats.back().first;
+            repeats.pop_back();
+        }
+        else if (opcode != ".GLOBL" && opcode != ".END")
+            addr = -1;  // Unknown instruction or directive
+    }
+    return addr;
+}
@@ -661,7 +661,7 @@ ExpressionModel Parser::ParseExpression()
                                 Error(token, "Expression should not be empty.");
                                 return expression;
                             }
-                            node.args.push_back(expri);
+                            expression.nodes[index].args.push_back(expri);
 
                             token = PeekNextTokenSkipDivider();
                             if (token.IsCloseBracket())
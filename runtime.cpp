@@ -19,6 +19,7 @@ void RuntimeGenerator::ParseRuntimeTemplate(std::istream* pInput)
     std::vector<string> lines;  // lines for the current block
     RuntimeSymbol blockrtsymbol = RuntimeNone;  // name for the current block
     std::vector<RuntimeSymbol> blockneeds;  // dependencies for the current block
+    bool blockinline = false;  // the current block could be expanded in place of the call
     char buffer[256];
     bool preambule = true;
     while (!pInput->eof())
@@ -42,12 +43,18 @@ void RuntimeGenerator::ParseRuntimeTemplate(std::istream* pInput)
                 block.rtsymbol = blockrtsymbol;
                 block.lines = lines;
                 block.needs = blockneeds;
+                block.isinline = blockinline;
                 m_rtblocks.push_back(block);
             }
 
             lines.clear();
             blockrtsymbol = RuntimeNone;
             blockneeds.clear();
+            blockinline = false;
+        }
+        else if (line.find(";## Inline") == 0)  // the block is allowed for inlining
+        {
+            blockinline = true;
         }
         else if (line.find(";## Need ") == 0)  // list of dependencies
         {
@@ -83,6 +90,7 @@ void RuntimeGenerator::ParseRuntimeTemplate(std::istream* pInput)
         block.rtsymbol = blockrtsymbol;
         block.lines = lines;
         block.needs = blockneeds;
+        block.isinline = blockinline;
         m_rtblocks.push_back(block);
     }
 }
@@ -111,6 +119,16 @@ void RuntimeGenerator::GetRuntimeBlock(RuntimeSymbol rtsymbol, std::vector<strin
     std::copy(rtblock.lines.begin(), rtblock.lines.end(), std::back_inserter(copyto));
 }
 
+// Get the blocks marked with ";## Inline", the generator could expand them in place of the calls
+void RuntimeGenerator::GetInlineBlocks(std::vector<RuntimeBlock>& copyto)
+{
+    for (const RuntimeBlock& rtblock : m_rtblocks)
+    {
+        if (rtblock.isinline)
+            copyto.push_back(rtblock);
+    }
+}
+
 void RuntimeGenerator::GenerateRuntime(const std::set<RuntimeSymbol>& needs)
 {
     for (RuntimeSymbol rtsymbol : needs)
@@ -176,9 +194,9 @@ void RuntimeGenerator::GenerateRuntime(const std::set<RuntimeSymbol>& needs)
         if (!g_turbo8)
             AddLine("\t.GLOBL\t" + rtsymbolname);
 
-        // copy lines to final model
+        // copy lines to final model; no .GLOBL directive in BKTurbo8 syntax
         for (string line : rtblock.lines)
-            AddLine(line);
+            AddLine((g_turbo8 && line.compare(0, 7, "\t.GLOBL") == 0) ? ";" + line : line);
     }
 }
 
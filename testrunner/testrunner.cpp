@@ -18,10 +18,14 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
 #include <assert.h>
 
 typedef std::string string;
 
+// LZ packing for the self-extracting image, see compressor.cpp
+void LzPack(const std::vector<uint8_t>& data, std::vector<uint8_t>& packed, int& margin);
+
 bool g_verbose = false;  // Verbose mode
 int  g_failedtests = 0;
 
@@ -237,6 +241,34 @@ void process_test_run(const string& workingdir, const string& modulename, const
 }
 #endif
 
+// Read the text file skipping the empty lines; returns false if the file is not found
+bool read_file_lines(const string& filepath, std::vector<string>& lines)
+{
+    std::ifstream fs(filepath);
+    if (!fs.is_open())
+        return false;
+    string line;
+    while (std::getline(fs, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            lines.push_back(line);
+    }
+    return true;
+}
+
+// Compare the lines to the etalon ones; returns 0 if equal, or the number of the first different line
+size_t compare_file_lines(const std::vector<string>& lines, const std::vector<string>& etalonlines)
+{
+    for (size_t linenum = 0; linenum < lines.size() || linenum < etalonlines.size(); linenum++)
+    {
+        if (linenum >= lines.size() || linenum >= etalonlines.size() || lines[linenum] != etalonlines[linenum])
+            return linenum + 1;
+    }
+    return 0;
+}
+
 void process_test(const string& testfilename)
 {
     size_t dotpos = testfilename.find_last_of('.');
@@ -259,6 +291,7 @@ void process_test(const string& testfilename)
     remove_file_if_exists(testdirpath, macetalonfilename);
     string outfilename = testname + ".out";
     remove_file_if_exists(testdirpath, outfilename);
+    remove_file_if_exists(testdirpath, testname + ".map");
 
     // parse and split the test file
     char buffer[256];
@@ -282,15 +315,27 @@ void process_test(const string& testfilename)
     }
     ofs.flush();
     ofs.close();
-    // next section of the test file is expected errors/warnings
+    // next section of the test file is expected errors/warnings, and optional budgets like "SIZE <= 40" or "CYCLES <= 1500".
+    // SIZE is the code size of the program lines in bytes. CYCLES is the sum of the line estimates, one pass of every
+    // annotated line, not a count for the real run: loops and the lines not run don't change it.
+    // "OVER BUDGET" line means the test expects the code to be over the budget, to check the budget check itself.
     bool outhasanyerrors = false;
     std::vector<string> errorlines;
+    int sizebudget = -1, cyclesbudget = -1;
+    bool overbudget = false;
     while (!fs.eof())
     {
         fs.getline(buffer, sizeof(buffer));
         if (buffer[0] == '-')
             break;
-        if (*buffer != 0)
+        int budget;
+        if (sscanf(buffer, "SIZE <= %d", &budget) == 1)
+            sizebudget = budget;
+        else if (sscanf(buffer, "CYCLES <= %d", &budget) == 1)
+            cyclesbudget = budget;
+        else if (strcmp(buffer, "OVER BUDGET") == 0)
+            overbudget = true;
+        else if (*buffer != 0)
         {
             errorlines.push_back(buffer);
             string line(buffer);
@@ -330,8 +375,11 @@ void process_test(const string& testfilename)
         ofsetalon.close();
     }
 
-    // run the compiler
+    // run the compiler; for the budgets, the compiler notes the size and the estimated time of every line in .MAC file
     string compilerpath(COMPILER_PATH);
+    bool hasbudgets = (sizebudget >= 0 || cyclesbudget >= 0);
+    if (hasbudgets)
+        compilerparams.append(" --annotate-top=0");
     compilerparams.append(" ").append(testname + ".ASC");
     process_test_run(testdirpath, compilerpath, compilerparams, outfilename);
 
@@ -467,8 +515,9 @@ void process_test(const string& testfilename)
     }
 #endif
 
-    // read .MAC file and check if we have TODOs there
+    // read .MAC file and check if we have TODOs there; sum the line notes like "; 17 words, ~1068 cycles"
     bool machastodos = false;
+    int codesize = 0, codecycles = 0;
     std::ifstream fsmac(testdirpath + PATH_SEPARATOR + macfilename);
     //TODO: check for error
     std::vector<string> mactext;
@@ -480,6 +529,13 @@ void process_test(const string& testfilename)
         string line(buffer);
         if (line.find("TODO") != string::npos)
             machastodos = true;
+        int words, cycles;
+        char wordsword[8];
+        if (sscanf(buffer, "; %d %7s ~%d cycles", &words, wordsword, &cycles) == 3)
+        {
+            codesize += words * 2;
+            codecycles += cycles;
+        }
         if (*buffer == ';')
             continue;  // skip comment lines
         size_t commentpos = line.find(";");
@@ -547,6 +603,171 @@ void process_test(const string& testfilename)
         return;
     }
 
+    // check the budgets: code size of the program lines in bytes, and the estimated CPU cycles for one pass of every line
+    string budgetfailure;
+    if (sizebudget >= 0 && codesize > sizebudget)
+        budgetfailure = "SIZE " + std::to_string(codesize) + " is over the budget " + std::to_string(sizebudget);
+    else if (cyclesbudget >= 0 && codecycles > cyclesbudget)
+        budgetfailure = "CYCLES " + std::to_string(codecycles) + " is over the budget " + std::to_string(cyclesbudget);
+    if (!budgetfailure.empty() && !overbudget)
+    {
+        std::cout << "  FAILED: " << budgetfailure << std::endl;
+        g_failedtests++;
+        return;
+    }
+    if (budgetfailure.empty() && overbudget)
+    {
+        std::cout << "  FAILED: SIZE " << codesize << ", CYCLES " << codecycles << " are within the budget, expected over" << std::endl;
+        g_failedtests++;
+        return;
+    }
+
+    // compare the address map to the etalon .map file next to the test file, if any
+    std::vector<string> mapetalontext;
+    if (read_file_lines(string(TESTS_SUB_DIR) + PATH_SEPARATOR + testname + ".map", mapetalontext))
+    {
+        std::vector<string> maptext;
+        read_file_lines(testdirpath + PATH_SEPARATOR + testname + ".map", maptext);
+        size_t linenum = compare_file_lines(maptext, mapetalontext);
+        if (linenum != 0)
+        {
+            std::cout << "  FAILED: .map file is different from etalon on line " << linenum << std::endl;
+            g_failedtests++;
+            return;
+        }
+
+        // make the flat profile with the map from the .samples file, compare it to the etalon .profile file
+        std::vector<string> samplestext, profileetalontext;
+        if (read_file_lines(string(TESTS_SUB_DIR) + PATH_SEPARATOR + testname + ".samples", samplestext) &&
+            read_file_lines(string(TESTS_SUB_DIR) + PATH_SEPARATOR + testname + ".profile", profileetalontext))
+        {
+            string samplesfilename = testname + ".samples";
+            std::ofstream ofssamples(testdirpath + PATH_SEPARATOR + samplesfilename);
+            for (const auto& line : samplestext)
+                ofssamples << line << std::endl;
+            ofssamples.close();
+            string profileoutfilename = testname + ".outprof";
+            remove_file_if_exists(testdirpath, profileoutfilename);
+            string profileparams = "-q --pc-samples=" + samplesfilename + " " + testname + ".map";
+            process_test_run(testdirpath, compilerpath, profileparams, profileoutfilename);
+
+            std::vector<string> profiletext;
+            read_file_lines(testdirpath + PATH_SEPARATOR + profileoutfilename, profiletext);
+            linenum = compare_file_lines(profiletext, profileetalontext);
+            if (linenum != 0)
+            {
+                std::cout << "  FAILED: profile is different from etalon on line " << linenum << std::endl;
+                g_failedtests++;
+                return;
+            }
+        }
+    }
+
+    SetTextAttribute(TEXTATTRIBUTES_GOOD);
+    std::cout << "OK";
+    SetTextAttribute(TEXTATTRIBUTES_NORMAL);
+    if (overbudget)
+        std::cout << " (expected: " << budgetfailure << ")";
+    else if (hasbudgets)
+        std::cout << " (SIZE " << codesize << ", CYCLES " << codecycles << ")";
+    std::cout << std::endl;
+}
+
+// Unpack the LZ stream the same way as UNLZ block of the runtime template does it; the packed data is in the memory
+// from packedpos, it's unpacked in place to the memory start. Returns false if the stream is broken.
+bool lz_unpack(std::vector<uint8_t>& memory, size_t packedpos, size_t packedsize, size_t size)
+{
+    size_t inpos = packedpos, outpos = 0;
+    size_t packedend = packedpos + packedsize;
+    unsigned flags = 1;  // flag byte is over
+    while (outpos < size)
+    {
+        if (outpos > inpos)
+            return false;  // the unpacked data went over the packed data not read yet
+        if (flags == 1)
+        {
+            if (inpos >= packedend)
+                return false;
+            flags = memory[inpos++] | 0x100;  // end marker for the flag byte
+        }
+        bool literal = (flags & 1) != 0;
+        flags >>= 1;
+        if (literal)
+        {
+            if (inpos >= packedend)
+                return false;
+            memory[outpos++] = memory[inpos++];
+            continue;
+        }
+        if (inpos + 2 > packedend)
+            return false;
+        int a = memory[inpos++];
+        int b = memory[inpos++];
+        size_t offset = (a & 0xF0) * 16 + b + 1;
+        size_t length = (a & 0x0F) + 3;
+        if (offset > outpos || outpos + length > size)
+            return false;
+        for (size_t i = 0; i < length; i++, outpos++)
+            memory[outpos] = memory[outpos - offset];
+    }
+    return inpos == packedend;
+}
+
+// Pack the data, then unpack it in place with the packed data placed margin bytes above the start
+bool lz_check_roundtrip(const std::vector<uint8_t>& data)
+{
+    std::vector<uint8_t> packed;
+    int margin;
+    LzPack(data, packed, margin);
+
+    std::vector<uint8_t> memory(std::max(data.size(), margin + packed.size()));
+    std::copy(packed.begin(), packed.end(), memory.begin() + margin);
+    if (!lz_unpack(memory, margin, packed.size(), data.size()))
+        return false;
+    return std::equal(data.begin(), data.end(), memory.begin());
+}
+
+// Unit check for the LZ packing used by --compress option, reported like a test
+void process_lz_test()
+{
+    SetTextAttribute(TEXTATTRIBUTES_NORMAL);
+    std::cout << std::left << std::setw(24) << "lz-pack-unpack" << "\t";
+
+    std::vector<std::vector<uint8_t> > samples;
+    samples.push_back(std::vector<uint8_t>());
+    samples.push_back(std::vector<uint8_t>(1, 0123));
+    samples.push_back(std::vector<uint8_t>(5000, 0));  // long runs, the repeats overlap themselves
+    std::vector<uint8_t> text;
+    const char* words[] = { "PRINT ", "GOTO ", "MOV\tR0, ", "CALL\t", "10 ", "VARIA", "\r\n" };
+    for (int i = 0; i < 3000; i++)
+    {
+        const char* word = words[(i * 7 + i / 5) % 7];
+        text.insert(text.end(), word, word + strlen(word));
+    }
+    samples.push_back(text);
+    std::vector<uint8_t> noise(6000);  // no repeats, and the repeats beyond the window
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < noise.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        noise[i] = (uint8_t)(seed >> 16);
+    }
+    samples.push_back(noise);
+    noise.insert(noise.end(), noise.begin(), noise.begin() + 3000);
+    samples.push_back(noise);
+
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        if (!lz_check_roundtrip(samples[i]))
+        {
+            SetTextAttribute(TEXTATTRIBUTES_BAD);
+            std::cout << "  FAILED: sample " << i + 1 << " is different after unpacking" << std::endl;
+            SetTextAttribute(TEXTATTRIBUTES_NORMAL);
+            g_failedtests++;
+            return;
+        }
+    }
+
     SetTextAttribute(TEXTATTRIBUTES_GOOD);
     std::cout << "OK";
     SetTextAttribute(TEXTATTRIBUTES_NORMAL);
@@ -590,16 +811,18 @@ int main(int argc, char* argv[])
 
     std::sort(testfilenames.begin(), testfilenames.end());
 
-    // Run all the test cases
+    // Run all the test cases, then the unit checks
     for (string& testfilename : testfilenames)
     {
         process_test(testfilename);
     }
+    process_lz_test();
+    int testcount = testfilenames.size() + 1;
 
-    int passedtests = testfilenames.size() - g_failedtests;
+    int passedtests = testcount - g_failedtests;
 
     SetTextAttribute(TEXTATTRIBUTES_TITLE);
-    std::cout << "TOTAL tests executed: " << testfilenames.size();
+    std::cout << "TOTAL tests executed: " << testcount;
     std::cout << ", passed: " << passedtests;
     if (g_failedtests > 0)
         std::cout << ", failed: " << g_failedtests;
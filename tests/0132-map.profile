@@ -0,0 +1,7 @@
+Samples: 32, outside the program: 13
+ Samples       %  Location
+      10   31.2%  WREOL
+       5   15.6%  N20	20 PRINT "HI"
+       2    6.2%  LEND
+       1    3.1%  N10	10 A%=2
+       1    3.1%  WRSTRX
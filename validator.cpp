@@ -133,6 +133,8 @@ Validator::Validator(SourceModel* source)
     m_line = nullptr;
 
     m_forcount = 0;
+    m_folding = false;
+    m_foldfailed = false;
 }
 
 bool Validator::ProcessLine()
@@ -221,8 +223,19 @@ void Validator::ValidateStatement(StatementModel& statement)
     (this->*methodref)(statement);
 }
 
+// While folding an expression the errors are not reported, only noted
+bool Validator::SkipFoldingError()
+{
+    if (!m_folding)
+        return false;
+    m_foldfailed = true;
+    return true;
+}
+
 void Validator::Error(const string& message)
 {
+    if (SkipFoldingError())
+        return;
     std::cerr << "ERROR ";
     if (m_line->linenum == 0)
         std::cerr << "at " << m_line->srclinenum;
@@ -234,6 +247,8 @@ void Validator::Error(const string& message)
 }
 void Validator::Error(ExpressionModel& expr, const string& message)
 {
+    if (SkipFoldingError())
+        return;
     std::cerr << "ERROR ";
     if (m_line->linenum == 0)
         std::cerr << "at " << m_line->srclinenum;
@@ -245,6 +260,8 @@ void Validator::Error(ExpressionModel& expr, const string& message)
 }
 void Validator::Error(ExpressionModel& expr, const ExpressionNode& node, const string& message)
 {
+    if (SkipFoldingError())
+        return;
     std::cerr << "ERROR ";
     if (m_line->linenum != 0)
         std::cerr << "in line " << m_line->linenum << " ";
@@ -284,7 +301,11 @@ void Validator::ValidateExpression(ExpressionModel& expr, int index)
     {
         VariableModel var;
         var.name = GetCanonicVariableName(node.token.text);
+        for (size_t i = 0; i < node.args.size(); i++)
+            var.indices.push_back(10);  // Array without DIM has indices 0..10
         m_source->RegisterVariable(var);
+        if (!CheckArrayIndices(var.name, node.args))
+            return;
     }
 
     if (node.token.type == TokenTypeOperation && node.left < 0 && node.right >= 0)  // Unary operation, one operand
@@ -299,6 +320,8 @@ void Validator::ValidateExpression(ExpressionModel& expr, int index)
             ValidateUnaryNot(expr, node, noderight);
         else
         {
+            if (SkipFoldingError())
+                return;
             std::cerr << "ERROR in line " << m_line->linenum << " at " << node.token.line << ":" << node.token.pos << " - TODO validate unary operator " << node.token.text << std::endl;
             m_line->error = true;
             RegisterError();
@@ -312,6 +335,8 @@ void Validator::ValidateExpression(ExpressionModel& expr, int index)
 
         if (nodeleft.vtype == ValueTypeNone || noderight.vtype == ValueTypeNone)
         {
+            if (SkipFoldingError())
+                return;
             std::cerr << "ERROR in line " << m_line->linenum << " at " << node.token.line << ":" << node.token.pos << " - Cannot calculate value type for the node." << std::endl;
             m_line->error = true;
             RegisterError();
@@ -334,6 +359,8 @@ void Validator::ValidateExpression(ExpressionModel& expr, int index)
             (this->*methodref)(expr, node, nodeleft, noderight);
         else
         {
+            if (SkipFoldingError())
+                return;
             std::cerr << "ERROR in line " << m_line->linenum << " at " << node.token.line << ":" << node.token.pos << " - TODO validate operator \'" + text + "\'." << std::endl;
             m_line->error = true;
             RegisterError();
@@ -357,6 +384,8 @@ void Validator::ValidateExpression(ExpressionModel& expr, int index)
 
         if (methodref == nullptr)
         {
+            if (SkipFoldingError())
+                return;
             std::cerr << "ERROR in line " << m_line->linenum << " at " << node.token.line << ":" << node.token.pos << " - TODO validate function " + GetKeywordString(keyword) << std::endl;
             m_line->error = true;
             RegisterError();
@@ -369,6 +398,17 @@ void Validator::ValidateExpression(ExpressionModel& expr, int index)
     //TODO
 }
 
+// Used after the expression was changed, like variables substituted with constants.
+// Returns false if the expression got an error, like division by zero; the error is not reported.
+bool Validator::FoldExpression(ExpressionModel& expr)
+{
+    m_folding = true;
+    m_foldfailed = false;
+    ValidateExpression(expr);
+    m_folding = false;
+    return !m_foldfailed;
+}
+
 bool Validator::CheckIntegerOrSingleExpression(ExpressionModel& expr)
 {
     if (expr.IsEmpty())
@@ -389,6 +429,41 @@ bool Validator::CheckIntegerOrSingleExpression(ExpressionModel& expr)
     return true;
 }
 
+// Check the array element indices against the array declaration; args are empty for simple variable
+bool Validator::CheckArrayIndices(const string& canoname, std::vector<ExpressionModel>& args)
+{
+    const VariableModel* pvar = m_source->GetVariable(canoname);
+    assert(pvar != nullptr);
+    if (pvar->indices.size() != args.size())
+    {
+        if (args.empty())
+            Error("Array " + canoname + " used without indices.");
+        else if (pvar->indices.empty())
+            Error("Variable " + canoname + " is not an array.");
+        else
+            Error("Array " + canoname + " has " + std::to_string(pvar->indices.size()) + " indices, not " + std::to_string(args.size()) + ".");
+        return false;
+    }
+
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        ExpressionModel& expr = args[i];
+        if (!CheckIntegerOrSingleExpression(expr))
+            return false;
+        if (expr.IsConstExpression())
+        {
+            double dvalue = std::floor(expr.GetConstExpressionDValue());  // The same way the generator takes the index
+            if (dvalue < 0 || dvalue > pvar->indices[i])
+            {
+                Error(expr, "Array " + canoname + " index " + std::to_string((long long)dvalue) + " is out of range 0.." + std::to_string(pvar->indices[i]) + ".");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 bool Validator::CheckStringExpression(ExpressionModel& expr)
 {
     if (expr.IsEmpty())
@@ -454,9 +529,11 @@ void Validator::ValidateData(StatementModel& statement)
 
 void Validator::ValidateRead(StatementModel& statement)
 {
-    for (const VariableExpressionModel& varexpr : statement.varexprs)
+    for (VariableExpressionModel& varexpr : statement.varexprs)
     {
         m_source->RegisterVariable(varexpr);
+        if (!CheckArrayIndices(varexpr.name, varexpr.args))
+            return;
     }
 }
 
@@ -617,7 +694,7 @@ void Validator::ValidateFor(StatementModel& statement)
 
     if (statement.args.size() > 2)  // has STEP expression
     {
-        ExpressionModel& expr3 = statement.args[1];
+        ExpressionModel& expr3 = statement.args[2];
         if (!CheckIntegerOrSingleExpression(expr3))
             return;
 
@@ -929,10 +1006,9 @@ void Validator::ValidateLet(StatementModel& statement)
         MODEL_ERROR("One variable expected.");
 
     VariableExpressionModel& var = statement.varexprs[0];
-    for (auto it = std::begin(var.args); it != std::end(var.args); it++)
-        ValidateExpression(*it);
-
     m_source->RegisterVariable(var);
+    if (!CheckArrayIndices(var.name, var.args))
+        return;
 
     if (statement.args.size() != 1)
         MODEL_ERROR("One parameter expected.");